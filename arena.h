@@ -0,0 +1,129 @@
+#if !defined(ARENA_H)
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+
+// All engine memory comes from one block reserved at startup. Long lived
+// state is pushed onto a MemoryArena and never freed; per block temporaries
+// come from a scratch arena that is reset at the top of every block. Nothing
+// on the audio thread touches the heap.
+
+#define ENGINE_MEMORY_SIZE (32 * 1024 * 1024)
+#define ENGINE_SCRATCH_SIZE (4 * 1024 * 1024)
+#define ARENA_ALIGNMENT 64 // Cache line, also enough for any SIMD load
+
+typedef struct {
+    uint8 *base;
+    size_t size;
+    size_t used;
+} MemoryArena;
+
+// Reserve the engine's memory once and touch every page up front, so the
+// audio thread never takes a page fault on first use
+void *reserve_memory(size_t size) {
+    void *memory = malloc(size);
+    if (memory) memset(memory, 0, size);
+    return memory;
+}
+
+void arena_init(MemoryArena *arena, void *base, size_t size) {
+    arena->base = (uint8 *) base;
+    arena->size = size;
+    arena->used = 0;
+}
+
+// Running out is a sizing bug, not something to recover from, so it stops
+// the program in every build rather than writing past the end
+void *arena_push(MemoryArena *arena, size_t size, size_t alignment) {
+    size_t start = (arena->used + alignment - 1) & ~(alignment - 1);
+    if (start > arena->size || size > arena->size - start) {
+        fprintf(stderr, "Arena out of memory: %zu bytes wanted, %zu of %zu used\n", size, arena->used, arena->size);
+        abort();
+    }
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+#define arena_push_struct(arena, type) ((type *) arena_push(arena, sizeof(type), ARENA_ALIGNMENT))
+#define arena_push_array(arena, type, count) \
+    ((type *) arena_push(arena, (count) * sizeof(type), ARENA_ALIGNMENT))
+
+// Carve a separate arena out of a parent, e.g. the per block scratch space
+void sub_arena(MemoryArena *arena, MemoryArena *parent, size_t size) {
+    arena_init(arena, arena_push(parent, size, ARENA_ALIGNMENT), size);
+}
+
+void arena_reset(MemoryArena *arena) {
+    arena->used = 0;
+}
+
+// Everything pushed between begin and end is given back at end
+typedef struct {
+    MemoryArena *arena;
+    size_t used;
+} TemporaryMemory;
+
+TemporaryMemory begin_temporary_memory(MemoryArena *arena) {
+    TemporaryMemory temporary = {arena, arena->used};
+    return temporary;
+}
+
+void end_temporary_memory(TemporaryMemory temporary) {
+    assert(temporary.arena->used >= temporary.used);
+    temporary.arena->used = temporary.used;
+}
+
+// Debug check that nothing allocates on the audio thread. The callback
+// brackets itself with audio_thread_begin/end; built with
+// -DAUDIO_ALLOC_GUARD=1 on glibc, malloc and friends are wrapped to assert
+// when called inside that bracket. build.sh turns it on for the debug SDL
+// build only, optimized builds never carry the wrappers.
+_Thread_local bool32 on_audio_thread;
+
+void audio_thread_begin(void) {
+    on_audio_thread = 1;
+}
+
+void audio_thread_end(void) {
+    on_audio_thread = 0;
+}
+
+#if !defined(AUDIO_ALLOC_GUARD)
+#define AUDIO_ALLOC_GUARD 0
+#endif
+
+#if AUDIO_ALLOC_GUARD && defined(__GLIBC__) && !UNSAFE
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *memory, size_t size);
+extern void __libc_free(void *memory);
+
+// Clear the flag before asserting, the assert itself may allocate
+#define check_audio_thread_allocation() \
+    if (on_audio_thread) { on_audio_thread = 0; assert(!"heap used on the audio thread"); }
+
+void *malloc(size_t size) {
+    check_audio_thread_allocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    check_audio_thread_allocation();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *memory, size_t size) {
+    check_audio_thread_allocation();
+    return __libc_realloc(memory, size);
+}
+
+void free(void *memory) {
+    check_audio_thread_allocation();
+    __libc_free(memory);
+}
+#endif
+
+#endif
@@ -0,0 +1,326 @@
+#define _GNU_SOURCE // pthread_setaffinity_np in workers.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "platform.h"
+#include "arena.h"
+#include "engine.h"
+#include "output.h"
+
+// Oscillator, mixing, effects, resampling and callback benchmarks. Prints one row per measurement
+// as CSV (default) or JSON lines (--json):
+//
+//   benchmark,variant,parameter,ns_per_sample,samples_per_second
+//
+// ns_per_sample is per output frame. Each measurement is the best of several
+// timed runs so scheduler noise doesn't show up as a regression.
+
+#define CHANNELS 2
+#define MAX_BLOCK_FRAMES 4096
+#define RUNS 7
+#define MIN_RUN_SECONDS 0.02
+
+typedef struct {
+    const char *name;
+    GenerateFunction *generate[WAVE_TYPE_COUNT];
+    bool32 supported;
+} OscillatorPath;
+
+const char *wave_names[WAVE_TYPE_COUNT] = {"sine", "triangle", "square", "sawtooth"};
+bool32 output_json = 0;
+MemoryArena bench_arena;
+
+float64 get_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void report(const char *benchmark, const char *variant, int32 parameter, float64 ns_per_sample) {
+    float64 samples_per_second = 1e9 / ns_per_sample;
+    if (output_json) {
+        printf("{\"benchmark\": \"%s\", \"variant\": \"%s\", \"parameter\": %d, "
+               "\"ns_per_sample\": %.4f, \"samples_per_second\": %.0f}\n",
+               benchmark, variant, parameter, ns_per_sample, samples_per_second);
+    } else {
+        printf("%s,%s,%d,%.4f,%.0f\n", benchmark, variant, parameter, ns_per_sample, samples_per_second);
+    }
+}
+
+// Time one generate_* function over a block, repeated until each run is long
+// enough to measure
+float64 bench_generator(GenerateFunction *generate, int32 block_frames) {
+    static float32 mix_bus[MAX_BLOCK_FRAMES];
+    memset(mix_bus, 0, sizeof(mix_bus));
+    uint32 increment = phase_increment(440.0f, 44100.0f);
+    uint32 phase = 0;
+
+    int32 iterations = 1;
+    float64 best = 1e30;
+    for (int32 run = 0; run < RUNS; run++) {
+        float64 start, elapsed;
+        for (;;) {
+            start = get_seconds();
+            for (int32 iteration = 0; iteration < iterations; iteration++) {
+                phase = generate(phase, increment, 0.001f, mix_bus, block_frames);
+            }
+            elapsed = get_seconds() - start;
+            if (elapsed >= MIN_RUN_SECONDS) break;
+            iterations *= 2;
+        }
+        float64 ns = elapsed * 1e9 / ((float64) iterations * block_frames);
+        if (ns < best) best = ns;
+    }
+    return best;
+}
+
+// Time generate_voices with voice_count voices held, playing patch with its
+// first filter set to filter_type, spread over workers (NULL for the calling
+// thread alone)
+float64 bench_voices(int32 voice_count, int32 block_frames, Patch *patch, FilterType filter_type,
+                     WorkerPool *workers) {
+    static VoicePool pool;
+    static PatchProgram program;
+    static float32 mix_bus[MAX_BLOCK_FRAMES];
+    arena_reset(&bench_arena);
+    voice_pool_init(&pool, 44100.0f);
+    patch_compile(patch, &program);
+    pool.filters[0] = program.filters[0];
+    pool.filters[0].type = filter_type;
+    for (int32 voice = 0; voice < voice_count; voice++) {
+        float32 frequency = 110.0f * (1.0f + voice * 0.037f);
+        voice_note_on(&pool, voice, frequency, 0.001f, (WaveType) (voice % WAVE_TYPE_COUNT), 44100.0f);
+    }
+
+    int32 iterations = 1;
+    float64 best = 1e30;
+    for (int32 run = 0; run < RUNS; run++) {
+        float64 start, elapsed;
+        for (;;) {
+            start = get_seconds();
+            for (int32 iteration = 0; iteration < iterations; iteration++) {
+                generate_voices(&pool, &program, mix_bus, &bench_arena, block_frames, workers);
+            }
+            elapsed = get_seconds() - start;
+            if (elapsed >= MIN_RUN_SECONDS) break;
+            iterations *= 2;
+        }
+        float64 ns = elapsed * 1e9 / ((float64) iterations * block_frames);
+        if (ns < best) best = ns;
+    }
+    return best;
+}
+
+// Time the convolution reverb with a generated impulse of ir_seconds. The
+// cost per frame should not depend on the block size.
+float64 bench_reverb(float32 ir_seconds, int32 block_frames) {
+    static float32 input[MAX_BLOCK_FRAMES];
+    static float32 output[MAX_BLOCK_FRAMES];
+    arena_reset(&bench_arena);
+    Reverb *reverb = arena_push_struct(&bench_arena, Reverb);
+    reverb_init(reverb, &bench_arena);
+    reverb_generate(reverb, ir_seconds, 44100.0f);
+    for (int32 index = 0; index < MAX_BLOCK_FRAMES; index++) input[index] = (index % 97) * 0.01f - 0.5f;
+
+    int32 iterations = 1;
+    float64 best = 1e30;
+    for (int32 run = 0; run < RUNS; run++) {
+        float64 start, elapsed;
+        for (;;) {
+            start = get_seconds();
+            for (int32 iteration = 0; iteration < iterations; iteration++) {
+                reverb_process(reverb, input, output, block_frames);
+            }
+            elapsed = get_seconds() - start;
+            if (elapsed >= MIN_RUN_SECONDS) break;
+            iterations *= 2;
+        }
+        float64 ns = elapsed * 1e9 / ((float64) iterations * block_frames);
+        if (ns < best) best = ns;
+    }
+    return best;
+}
+
+// Time engine to device rate conversion, 48 kHz down to 44.1 kHz in 512
+// frame blocks, per output frame. taps gets the filter length used.
+float64 bench_resampler(ResampleQuality quality, int32 *taps) {
+    static float32 input[MAX_BLOCK_FRAMES];
+    static float32 output[MAX_BLOCK_FRAMES];
+    arena_reset(&bench_arena);
+    Resampler *resampler = arena_push_struct(&bench_arena, Resampler);
+    resampler_init(resampler, 48000.0f, 44100.0f, quality);
+    *taps = resampler->table.taps;
+    for (int32 index = 0; index < MAX_BLOCK_FRAMES; index++) input[index] = (index % 97) * 0.01f - 0.5f;
+
+    int32 iterations = 1;
+    float64 best = 1e30;
+    for (int32 run = 0; run < RUNS; run++) {
+        float64 start, elapsed;
+        for (;;) {
+            start = get_seconds();
+            for (int32 iteration = 0; iteration < iterations; iteration++) {
+                int32 input_frames = resampler_input_needed(resampler, 512);
+                resampler_process(resampler, input, input_frames, output, 512);
+            }
+            elapsed = get_seconds() - start;
+            if (elapsed >= MIN_RUN_SECONDS) break;
+            iterations *= 2;
+        }
+        float64 ns = elapsed * 1e9 / ((float64) iterations * 512);
+        if (ns < best) best = ns;
+    }
+    return best;
+}
+
+// Time what audio_callback does for one block: drain commands, render the
+// voices and convert to interleaved S16. A note on and off pair is queued
+// each block so the event splitting path is exercised too. Release is zero
+// so that note is gone by the end of its block; otherwise each block would
+// leave a releasing voice behind and small blocks would render many more.
+float64 bench_callback(int32 voice_count, int32 block_frames) {
+    arena_reset(&bench_arena);
+    Engine *engine = arena_push_struct(&bench_arena, Engine);
+    float32 *mix_bus = arena_push_array(&bench_arena, float32, MAX_BLOCK_FRAMES);
+    int16 *output = arena_push_array(&bench_arena, int16, MAX_BLOCK_FRAMES * CHANNELS);
+    engine_init(engine, &bench_arena, 44100.0f, block_frames);
+    engine_set_parameter(engine, PARAMETER_RELEASE, 0.0f);
+    for (int32 voice = 0; voice < voice_count; voice++) {
+        voice_note_on(&engine->voices, voice, 110.0f * (1.0f + voice * 0.037f), 0.001f,
+                      (WaveType) (voice % WAVE_TYPE_COUNT), engine->sample_rate);
+    }
+
+    int32 iterations = 1;
+    float64 best = 1e30;
+    for (int32 run = 0; run < RUNS; run++) {
+        float64 start, elapsed;
+        for (;;) {
+            start = get_seconds();
+            for (int32 iteration = 0; iteration < iterations; iteration++) {
+                Command command = {0};
+                command.type = COMMAND_NOTE_ON;
+                command.note = -1;
+                command.value = 440.0f;
+                command.time = engine->sample_clock + block_frames / 2;
+                engine_send(engine, command);
+                command.type = COMMAND_NOTE_OFF;
+                engine_send(engine, command);
+
+                engine_render(engine, mix_bus, block_frames);
+                write_s16(output, mix_bus, block_frames, CHANNELS, NULL);
+            }
+            elapsed = get_seconds() - start;
+            if (elapsed >= MIN_RUN_SECONDS) break;
+            iterations *= 2;
+        }
+        float64 ns = elapsed * 1e9 / ((float64) iterations * block_frames);
+        if (ns < best) best = ns;
+    }
+    assert(engine->voices.active_count == voice_count);
+    return best;
+}
+
+int32 main(int32 argc, char* argv[]) {
+    for (int32 arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "--json") == 0) output_json = 1;
+    }
+
+    wavetable_init();
+    oscillator_simd_init();
+    resample_tables_init();
+    arena_init(&bench_arena, reserve_memory(ENGINE_MEMORY_SIZE), ENGINE_MEMORY_SIZE);
+
+    OscillatorPath paths[] = {
+        {"reference", {generate_sine, generate_triangle, generate_square, generate_sawtooth}, 1},
+        {"table", {generate_sine_table, generate_triangle_table, generate_square_table,
+                   generate_sawtooth_table}, 1},
+        {"blep", {generate_sine, generate_triangle_blep, generate_square_blep, generate_sawtooth_blep}, 1},
+#if defined(__x86_64__) || defined(__i386__)
+        {"sse2", {generate_sine_sse2, generate_triangle_sse2, generate_square_sse2,
+                  generate_sawtooth_sse2}, __builtin_cpu_supports("sse2")},
+        {"avx2", {generate_sine_avx2, generate_triangle_avx2, generate_square_avx2,
+                  generate_sawtooth_avx2}, __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")},
+        {"sse2_blep", {generate_sine_sse2, generate_triangle_blep_sse2, generate_square_blep_sse2,
+                       generate_sawtooth_blep_sse2}, __builtin_cpu_supports("sse2")},
+        {"avx2_blep", {generate_sine_avx2, generate_triangle_blep_avx2, generate_square_blep_avx2,
+                       generate_sawtooth_blep_avx2}, __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")},
+#endif
+    };
+
+    Patch default_patch;
+    patch_default(&default_patch);
+
+    GenerateFunction *dispatched[WAVE_TYPE_COUNT];
+    memcpy(dispatched, generators, sizeof(generators));
+
+    if (!output_json) printf("benchmark,variant,parameter,ns_per_sample,samples_per_second\n");
+
+    // Each generate_* function on its own, 512 frame blocks
+    for (int32 path = 0; path < (int32) array_count(paths); path++) {
+        if (!paths[path].supported) continue;
+        for (int32 wave = 0; wave < WAVE_TYPE_COUNT; wave++) {
+            char benchmark[64];
+            snprintf(benchmark, sizeof(benchmark), "generate_%s", wave_names[wave]);
+            report(benchmark, paths[path].name, 512, bench_generator(paths[path].generate[wave], 512));
+        }
+    }
+
+    // Voice count sweep through generate_voices, for every oscillator path
+    for (int32 path = 0; path < (int32) array_count(paths); path++) {
+        if (!paths[path].supported) continue;
+        memcpy(generators, paths[path].generate, sizeof(generators));
+        for (int32 voice_count = 1; voice_count <= MAX_VOICES; voice_count *= 2) {
+            report("voices", paths[path].name, voice_count, bench_voices(voice_count, 512, &default_patch, FILTER_NONE, NULL));
+        }
+    }
+    memcpy(generators, dispatched, sizeof(generators));
+
+    // The same sweep with every voice filtered, dispatched path
+    for (int32 voice_count = 1; voice_count <= MAX_VOICES; voice_count *= 2) {
+        report("voices_svf", oscillator_path, voice_count,
+               bench_voices(voice_count, 512, &default_patch, FILTER_SVF_LOWPASS, NULL));
+        report("voices_biquad", oscillator_path, voice_count,
+               bench_voices(voice_count, 512, &default_patch, FILTER_BIQUAD_LOWPASS, NULL));
+    }
+
+    // Three oscillators, filter and drive per voice, see patch_stack
+    Patch stack_patch;
+    patch_stack(&stack_patch);
+    for (int32 voice_count = 1; voice_count <= MAX_VOICES; voice_count *= 2) {
+        report("voices_stack", oscillator_path, voice_count,
+               bench_voices(voice_count, 512, &stack_patch, FILTER_SVF_LOWPASS, NULL));
+    }
+
+    // 256 filtered voices over a growing worker pool, parameter is threads
+    // including the caller
+    static WorkerPool workers;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int32 thread_count = 1; thread_count < cores && thread_count <= MAX_WORKERS; thread_count *= 2) {
+        worker_pool_start(&workers, thread_count);
+        report("voices_threads", oscillator_path, thread_count + 1,
+               bench_voices(MAX_VOICES, 512, &default_patch, FILTER_SVF_LOWPASS, &workers));
+        worker_pool_stop(&workers);
+    }
+
+    // Reverb at several block sizes, variant is the impulse length
+    int32 block_sizes[] = {64, 128, 256, 512, 1024, 4096};
+    for (int32 size = 0; size < (int32) array_count(block_sizes); size++) {
+        report("reverb", "ir_1s", block_sizes[size], bench_reverb(1.0f, block_sizes[size]));
+        report("reverb", "ir_4s", block_sizes[size], bench_reverb(4.0f, block_sizes[size]));
+    }
+
+    // Resampler tiers, parameter is the filter length
+    for (int32 quality = 0; quality < RESAMPLE_QUALITY_COUNT; quality++) {
+        int32 taps;
+        float64 ns = bench_resampler((ResampleQuality) quality, &taps);
+        char variant[32];
+        snprintf(variant, sizeof(variant), "%s_%s", resample_tiers[quality].name, resample_path);
+        report("resample_48k_44k", variant, taps, ns);
+    }
+
+    // Full callback at several device block sizes, 16 voices, dispatched path
+    for (int32 size = 0; size < (int32) array_count(block_sizes); size++) {
+        report("callback", oscillator_path, block_sizes[size], bench_callback(16, block_sizes[size]));
+    }
+    return 0;
+}
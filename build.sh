@@ -1,4 +1,10 @@
 #!/usr/bin/env bash
 
-clang -g -L/usr/local/lib -lSDL2 -o main.out sdl_platform.c
+# Debug build, asserts if anything allocates on the audio thread
+clang -g -DAUDIO_ALLOC_GUARD=1 -pthread -L/usr/local/lib -lSDL2 -o main.out sdl_platform.c
 
+# Headless renderer, no SDL needed
+clang -O2 -pthread -o offline_render.out offline_render.c -lm
+
+# Benchmarks, optimized like a release build
+clang -O3 -pthread -o bench.out bench.c -lm
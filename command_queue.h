@@ -0,0 +1,101 @@
+#if !defined(COMMAND_QUEUE_H)
+#define COMMAND_QUEUE_H
+
+#include <stdatomic.h>
+#include "platform.h"
+
+// Single producer / single consumer ring of commands from the main thread to
+// the audio thread. Both sides are wait-free: no locks, no syscalls, and a
+// full or empty ring is reported instead of waited on. Only the main thread
+// may push and only the audio callback may pop.
+
+#define COMMAND_QUEUE_SIZE 256 // Must be a power of two
+#define CACHE_LINE_SIZE 64
+
+typedef enum {
+    COMMAND_NOTE_ON,   // note, value = frequency
+    COMMAND_NOTE_OFF,  // note
+    COMMAND_WAVE_TYPE, // wave_type used by following note ons
+    COMMAND_PARAMETER, // parameter, value
+} CommandType;
+
+typedef enum {
+    PARAMETER_VOLUME,  // Per voice amplitude on the mix bus
+    PARAMETER_ATTACK,  // Seconds
+    PARAMETER_DECAY,   // Seconds
+    PARAMETER_SUSTAIN, // Gain
+    PARAMETER_RELEASE, // Seconds
+    PARAMETER_FILTER_TYPE,  // FilterType
+    PARAMETER_CUTOFF,       // Hz
+    PARAMETER_RESONANCE,    // Q
+    PARAMETER_KEY_TRACKING, // 0 to 1
+    PARAMETER_DELAY_TIME,     // Seconds
+    PARAMETER_DELAY_FEEDBACK, // Gain
+    PARAMETER_DELAY_SEND,     // Gain from the mix bus into the delay
+    PARAMETER_REVERB_SEND,    // Gain from the mix bus into the reverb
+    PARAMETER_COUNT,
+} Parameter;
+
+typedef struct {
+    uint64 time; // Sample frame the command takes effect on
+    CommandType type;
+    union {
+        int32 note;
+        int32 wave_type;
+        int32 parameter;
+    };
+    float32 value;
+} Command;
+
+typedef struct {
+    // Indices count up forever and are masked on access. Each one sits on its
+    // own cache line so the two threads don't false share.
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32 write_index;
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32 read_index;
+    _Alignas(CACHE_LINE_SIZE) Command commands[COMMAND_QUEUE_SIZE];
+} CommandQueue;
+
+void command_queue_init(CommandQueue *queue) {
+    atomic_init(&queue->write_index, 0);
+    atomic_init(&queue->read_index, 0);
+}
+
+// Producer side. Returns false if the ring is full.
+bool32 command_queue_push(CommandQueue *queue, Command command) {
+    uint32 write = atomic_load_explicit(&queue->write_index, memory_order_relaxed);
+    uint32 read = atomic_load_explicit(&queue->read_index, memory_order_acquire);
+    if (write - read == COMMAND_QUEUE_SIZE) return 0;
+
+    queue->commands[write & (COMMAND_QUEUE_SIZE - 1)] = command;
+    atomic_store_explicit(&queue->write_index, write + 1, memory_order_release);
+    return 1;
+}
+
+// Consumer side. Returns false if the ring is empty.
+bool32 command_queue_pop(CommandQueue *queue, Command *command) {
+    uint32 read = atomic_load_explicit(&queue->read_index, memory_order_relaxed);
+    uint32 write = atomic_load_explicit(&queue->write_index, memory_order_acquire);
+    if (read == write) return 0;
+
+    *command = queue->commands[read & (COMMAND_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&queue->read_index, read + 1, memory_order_release);
+    return 1;
+}
+
+// Consumer side. Look at the oldest command without removing it, NULL if the
+// ring is empty. The pointer stays valid until command_queue_skip.
+Command *command_queue_peek(CommandQueue *queue) {
+    uint32 read = atomic_load_explicit(&queue->read_index, memory_order_relaxed);
+    uint32 write = atomic_load_explicit(&queue->write_index, memory_order_acquire);
+    if (read == write) return NULL;
+
+    return &queue->commands[read & (COMMAND_QUEUE_SIZE - 1)];
+}
+
+// Consumer side. Drop the command returned by command_queue_peek.
+void command_queue_skip(CommandQueue *queue) {
+    uint32 read = atomic_load_explicit(&queue->read_index, memory_order_relaxed);
+    atomic_store_explicit(&queue->read_index, read + 1, memory_order_release);
+}
+
+#endif
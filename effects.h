@@ -0,0 +1,670 @@
+#if !defined(EFFECTS_H)
+#define EFFECTS_H
+
+#include <math.h>
+#include <stdatomic.h>
+#include <string.h>
+#include "platform.h"
+#include "arena.h"
+#include "sampler.h"
+#include "oscillator_simd.h"
+
+// Send/return effects after the voices. Each effect takes a copy of the dry
+// mix bus scaled by its send level and adds what it returns back onto the
+// bus; the effects run in parallel, neither feeds the other.
+//
+// The delay is a ring buffer read at a fractional distance behind the write
+// position, with feedback. The reverb convolves with an impulse response in
+// the frequency domain, uniformly partitioned: the input is cut into
+// REVERB_PARTITION_FRAMES pieces, the spectrum of each is kept in a history,
+// and every partition of output is the sum of each past input spectrum times
+// the matching piece of the impulse response. All but the newest of those
+// products only need input that is already in the history, so they are
+// worked off a few at a time as the current partition's input arrives. What
+// is left when it completes is two FFTs and one product, so the work per
+// frame stays the same for any impulse length or block size. The wet signal
+// comes out one partition late, which plays as a few milliseconds of
+// pre-delay.
+//
+// The FFT butterflies and the spectrum products, which are nearly all of the
+// reverb's work, have SSE2 and AVX2 kernels picked at runtime by fft_init.
+//
+// An effect whose send is off is skipped once everything it holds is below
+// EFFECTS_SILENCE, so idle effects cost nothing.
+//
+// Impulse responses are transformed on the main thread into one of
+// REVERB_RESPONSE_SLOTS and handed over the same way engine.h hands over
+// patch programs.
+
+#define EFFECTS_SILENCE 1e-6f // -120 dB
+
+#define DELAY_MAX_FRAMES 262144 // Ring length, a power of two, about 6 s at 44.1 kHz
+#define DELAY_MIN_FRAMES 3.0f   // Interpolation reads a frame either side of the delay
+#define DELAY_SMOOTHING_SECONDS 0.05f // Time constant for delay time changes, which glide
+
+#define REVERB_PARTITION_FRAMES 256
+#define REVERB_FFT_SIZE (2 * REVERB_PARTITION_FRAMES)
+#define REVERB_BINS (REVERB_PARTITION_FRAMES + 1) // DC to Nyquist, the rest mirror them
+#define REVERB_BIN_STRIDE 264                     // REVERB_BINS rounded up to whole SIMD registers
+#define REVERB_MAX_PARTITIONS 1024                // About 6 s at 44.1 kHz
+#define REVERB_RESPONSE_SLOTS 3
+
+typedef struct {
+    float32 *buffer; // DELAY_MAX_FRAMES
+    uint32 write_position;
+    float32 time;          // Frames behind the input
+    float32 smoothed_time; // Where the read position is, gliding towards time
+    float32 smoothing;     // Per frame glide coefficient
+    float32 feedback;
+    int32 silent_frames; // How many of the latest frames written were silent
+} Delay;
+
+// Twiddles and bit reversal for a complex FFT of REVERB_FFT_SIZE points. The
+// twiddles of the pass that combines halves of length half sit in order at
+// index half, so every pass reads them contiguously.
+typedef struct {
+    float32 cosines[REVERB_FFT_SIZE];
+    float32 sines[REVERB_FFT_SIZE];
+    int32 bit_reverse[REVERB_FFT_SIZE];
+} FftTables;
+
+// Spectra of the impulse response partitions, REVERB_BIN_STRIDE apart,
+// already scaled for the inverse FFT
+typedef struct {
+    float32 *real;
+    float32 *imag;
+    int32 partition_count;
+    float64 energy; // Sum of squares of the impulse, while loading
+} ImpulseResponse;
+
+typedef struct {
+    FftTables fft;
+
+    // A response is in use while the audio thread may be convolving with it
+    // or about to: the last one it took and the last one sent
+    ImpulseResponse responses[REVERB_RESPONSE_SLOTS];
+    _Atomic(ImpulseResponse *) pending_response; // Sent, not yet taken
+    ImpulseResponse *last_sent_response;         // Main thread only
+    ImpulseResponse *last_taken_response;        // Main thread only
+
+    // Audio thread
+    ImpulseResponse *response; // NULL until one is loaded, the reverb is silent
+    float32 *history_real;     // Input spectra, REVERB_MAX_PARTITIONS of them in a ring
+    float32 *history_imag;
+    int32 history_position;    // Newest spectrum
+    int32 fill;                // Frames of the current partition so far
+    int32 tail_done;           // Products of older partitions added to the accumulator
+    float32 input_peak;        // Of the current partition
+    int32 silent_partitions;   // How many of the latest partitions of input were silent
+    _Alignas(64) float32 input[REVERB_FFT_SIZE];           // Previous partition, then the current one
+    _Alignas(64) float32 output[REVERB_PARTITION_FRAMES];  // Being played out
+    _Alignas(64) float32 accumulator_real[REVERB_BIN_STRIDE];
+    _Alignas(64) float32 accumulator_imag[REVERB_BIN_STRIDE];
+    _Alignas(64) float32 work_real[REVERB_FFT_SIZE];
+    _Alignas(64) float32 work_imag[REVERB_FFT_SIZE];
+} Reverb;
+
+typedef struct {
+    Delay delay;
+    Reverb reverb;
+    float32 delay_send; // Gain from the dry bus into each effect
+    float32 reverb_send;
+} Effects;
+
+//
+// FFT
+//
+
+// In place radix 2 FFT passes over bit reversed input. direction is -1 for
+// forward, 1 for inverse.
+typedef void FftPassesFunction(const FftTables *tables, float32 *real, float32 *imag, int32 direction);
+
+// accumulator += a * b over REVERB_BIN_STRIDE bins, complex
+typedef void SpectrumMultiplyAddFunction(float32 *accumulator_real, float32 *accumulator_imag,
+                                         const float32 *a_real, const float32 *a_imag,
+                                         const float32 *b_real, const float32 *b_imag);
+
+// One radix 2 pass combining halves of length half
+void fft_pass_scalar(const FftTables *tables, float32 *real, float32 *imag, int32 half, int32 direction) {
+    const float32 *cosines = tables->cosines + half;
+    const float32 *sines = tables->sines + half;
+    for (int32 start = 0; start < REVERB_FFT_SIZE; start += 2 * half) {
+        for (int32 index = 0; index < half; index++) {
+            float32 twiddle_real = cosines[index];
+            float32 twiddle_imag = direction * sines[index];
+            int32 a = start + index;
+            int32 b = a + half;
+            float32 product_real = twiddle_real * real[b] - twiddle_imag * imag[b];
+            float32 product_imag = twiddle_real * imag[b] + twiddle_imag * real[b];
+            real[b] = real[a] - product_real;
+            imag[b] = imag[a] - product_imag;
+            real[a] += product_real;
+            imag[a] += product_imag;
+        }
+    }
+}
+
+// The first two passes together, their twiddles are 1 and -i or i
+void fft_first_passes(float32 *real, float32 *imag, int32 direction) {
+    for (int32 start = 0; start < REVERB_FFT_SIZE; start += 4) {
+        float32 *r = real + start;
+        float32 *i = imag + start;
+        float32 r0 = r[0] + r[1], i0 = i[0] + i[1];
+        float32 r1 = r[0] - r[1], i1 = i[0] - i[1];
+        float32 r2 = r[2] + r[3], i2 = i[2] + i[3];
+        float32 r3 = r[2] - r[3], i3 = i[2] - i[3];
+        // Second pass, the odd pair is rotated a quarter turn
+        float32 rotated_real = -direction * i3;
+        float32 rotated_imag = direction * r3;
+        r[0] = r0 + r2; i[0] = i0 + i2;
+        r[2] = r0 - r2; i[2] = i0 - i2;
+        r[1] = r1 + rotated_real; i[1] = i1 + rotated_imag;
+        r[3] = r1 - rotated_real; i[3] = i1 - rotated_imag;
+    }
+}
+
+void fft_passes_scalar(const FftTables *tables, float32 *real, float32 *imag, int32 direction) {
+    fft_first_passes(real, imag, direction);
+    for (int32 half = 4; half < REVERB_FFT_SIZE; half *= 2) {
+        fft_pass_scalar(tables, real, imag, half, direction);
+    }
+}
+
+void spectrum_multiply_add_scalar(float32 *accumulator_real, float32 *accumulator_imag,
+                                  const float32 *a_real, const float32 *a_imag,
+                                  const float32 *b_real, const float32 *b_imag) {
+    for (int32 bin = 0; bin < REVERB_BIN_STRIDE; bin++) {
+        accumulator_real[bin] += a_real[bin] * b_real[bin] - a_imag[bin] * b_imag[bin];
+        accumulator_imag[bin] += a_real[bin] * b_imag[bin] + a_imag[bin] * b_real[bin];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Four butterflies of a pass with half at least 4
+SIMD_SSE2 static inline void fft_pass_sse2(const FftTables *tables, float32 *real, float32 *imag,
+                                           int32 half, __m128 direction) {
+    for (int32 start = 0; start < REVERB_FFT_SIZE; start += 2 * half) {
+        for (int32 index = 0; index < half; index += 4) {
+            __m128 twiddle_real = _mm_loadu_ps(tables->cosines + half + index);
+            __m128 twiddle_imag = _mm_mul_ps(direction, _mm_loadu_ps(tables->sines + half + index));
+            float32 *ar = real + start + index, *ai = imag + start + index;
+            float32 *br = ar + half, *bi = ai + half;
+            __m128 b_real = _mm_loadu_ps(br), b_imag = _mm_loadu_ps(bi);
+            __m128 product_real = _mm_sub_ps(_mm_mul_ps(twiddle_real, b_real), _mm_mul_ps(twiddle_imag, b_imag));
+            __m128 product_imag = _mm_add_ps(_mm_mul_ps(twiddle_real, b_imag), _mm_mul_ps(twiddle_imag, b_real));
+            __m128 a_real = _mm_loadu_ps(ar), a_imag = _mm_loadu_ps(ai);
+            _mm_storeu_ps(br, _mm_sub_ps(a_real, product_real));
+            _mm_storeu_ps(bi, _mm_sub_ps(a_imag, product_imag));
+            _mm_storeu_ps(ar, _mm_add_ps(a_real, product_real));
+            _mm_storeu_ps(ai, _mm_add_ps(a_imag, product_imag));
+        }
+    }
+}
+
+SIMD_SSE2 void fft_passes_sse2(const FftTables *tables, float32 *real, float32 *imag, int32 direction) {
+    fft_first_passes(real, imag, direction);
+    __m128 sign = _mm_set1_ps((float32) direction);
+    for (int32 half = 4; half < REVERB_FFT_SIZE; half *= 2) {
+        fft_pass_sse2(tables, real, imag, half, sign);
+    }
+}
+
+SIMD_SSE2 void spectrum_multiply_add_sse2(float32 *accumulator_real, float32 *accumulator_imag,
+                                          const float32 *a_real, const float32 *a_imag,
+                                          const float32 *b_real, const float32 *b_imag) {
+    for (int32 bin = 0; bin < REVERB_BIN_STRIDE; bin += 4) {
+        __m128 ar = _mm_loadu_ps(a_real + bin), ai = _mm_loadu_ps(a_imag + bin);
+        __m128 br = _mm_loadu_ps(b_real + bin), bi = _mm_loadu_ps(b_imag + bin);
+        __m128 real = _mm_sub_ps(_mm_mul_ps(ar, br), _mm_mul_ps(ai, bi));
+        __m128 imag = _mm_add_ps(_mm_mul_ps(ar, bi), _mm_mul_ps(ai, br));
+        _mm_storeu_ps(accumulator_real + bin, _mm_add_ps(_mm_loadu_ps(accumulator_real + bin), real));
+        _mm_storeu_ps(accumulator_imag + bin, _mm_add_ps(_mm_loadu_ps(accumulator_imag + bin), imag));
+    }
+}
+
+// The pass with half 4 is done four wide, the rest eight wide
+SIMD_AVX2 void fft_passes_avx2(const FftTables *tables, float32 *real, float32 *imag, int32 direction) {
+    fft_first_passes(real, imag, direction);
+    fft_pass_sse2(tables, real, imag, 4, _mm_set1_ps((float32) direction));
+    __m256 sign = _mm256_set1_ps((float32) direction);
+    for (int32 half = 8; half < REVERB_FFT_SIZE; half *= 2) {
+        for (int32 start = 0; start < REVERB_FFT_SIZE; start += 2 * half) {
+            for (int32 index = 0; index < half; index += 8) {
+                __m256 twiddle_real = _mm256_loadu_ps(tables->cosines + half + index);
+                __m256 twiddle_imag = _mm256_mul_ps(sign, _mm256_loadu_ps(tables->sines + half + index));
+                float32 *ar = real + start + index, *ai = imag + start + index;
+                float32 *br = ar + half, *bi = ai + half;
+                __m256 b_real = _mm256_loadu_ps(br), b_imag = _mm256_loadu_ps(bi);
+                __m256 product_real = _mm256_fmsub_ps(twiddle_real, b_real, _mm256_mul_ps(twiddle_imag, b_imag));
+                __m256 product_imag = _mm256_fmadd_ps(twiddle_real, b_imag, _mm256_mul_ps(twiddle_imag, b_real));
+                __m256 a_real = _mm256_loadu_ps(ar), a_imag = _mm256_loadu_ps(ai);
+                _mm256_storeu_ps(br, _mm256_sub_ps(a_real, product_real));
+                _mm256_storeu_ps(bi, _mm256_sub_ps(a_imag, product_imag));
+                _mm256_storeu_ps(ar, _mm256_add_ps(a_real, product_real));
+                _mm256_storeu_ps(ai, _mm256_add_ps(a_imag, product_imag));
+            }
+        }
+    }
+}
+
+SIMD_AVX2 void spectrum_multiply_add_avx2(float32 *accumulator_real, float32 *accumulator_imag,
+                                          const float32 *a_real, const float32 *a_imag,
+                                          const float32 *b_real, const float32 *b_imag) {
+    for (int32 bin = 0; bin < REVERB_BIN_STRIDE; bin += 8) {
+        __m256 ar = _mm256_loadu_ps(a_real + bin), ai = _mm256_loadu_ps(a_imag + bin);
+        __m256 br = _mm256_loadu_ps(b_real + bin), bi = _mm256_loadu_ps(b_imag + bin);
+        __m256 real = _mm256_fmadd_ps(ar, br, _mm256_loadu_ps(accumulator_real + bin));
+        __m256 imag = _mm256_fmadd_ps(ar, bi, _mm256_loadu_ps(accumulator_imag + bin));
+        _mm256_storeu_ps(accumulator_real + bin, _mm256_fnmadd_ps(ai, bi, real));
+        _mm256_storeu_ps(accumulator_imag + bin, _mm256_fmadd_ps(ai, br, imag));
+    }
+}
+
+#endif
+
+FftPassesFunction *fft_passes = fft_passes_scalar;
+SpectrumMultiplyAddFunction *spectrum_multiply_add = spectrum_multiply_add_scalar;
+const char *fft_path = "scalar";
+
+// Build the tables and point the FFT and spectrum kernels at the widest ones
+// this CPU supports
+void fft_init(FftTables *tables) {
+    tables->cosines[0] = tables->sines[0] = 0.0f; // Unused
+    for (int32 half = 1; half < REVERB_FFT_SIZE; half *= 2) {
+        for (int32 index = 0; index < half; index++) {
+            float64 angle = TWO_PI * (float64) index / (2 * half);
+            tables->cosines[half + index] = (float32) cos(angle);
+            tables->sines[half + index] = (float32) sin(angle);
+        }
+    }
+    int32 bits = 0;
+    while ((1 << bits) < REVERB_FFT_SIZE) bits++;
+    for (int32 index = 0; index < REVERB_FFT_SIZE; index++) {
+        int32 reversed = 0;
+        for (int32 bit = 0; bit < bits; bit++) {
+            if (index & (1 << bit)) reversed |= 1 << (bits - 1 - bit);
+        }
+        tables->bit_reverse[index] = reversed;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        fft_passes = fft_passes_avx2;
+        spectrum_multiply_add = spectrum_multiply_add_avx2;
+        fft_path = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        fft_passes = fft_passes_sse2;
+        spectrum_multiply_add = spectrum_multiply_add_sse2;
+        fft_path = "sse2";
+    }
+#endif
+}
+
+// In place radix 2 FFT. direction is -1 for forward, 1 for inverse; neither
+// is scaled.
+void fft(FftTables *tables, float32 *real, float32 *imag, int32 direction) {
+    for (int32 index = 0; index < REVERB_FFT_SIZE; index++) {
+        int32 other = tables->bit_reverse[index];
+        if (other > index) {
+            float32 swap = real[index]; real[index] = real[other]; real[other] = swap;
+            swap = imag[index]; imag[index] = imag[other]; imag[other] = swap;
+        }
+    }
+    fft_passes(tables, real, imag, direction);
+}
+
+// Spectrum of REVERB_FFT_SIZE real values, bins 0 to REVERB_BINS - 1 into
+// real and imag (REVERB_BIN_STRIDE long, the padding zeroed)
+void fft_real(FftTables *tables, const float32 *values, float32 *real, float32 *imag,
+              float32 *work_real, float32 *work_imag) {
+    memcpy(work_real, values, REVERB_FFT_SIZE * sizeof(float32));
+    memset(work_imag, 0, REVERB_FFT_SIZE * sizeof(float32));
+    fft(tables, work_real, work_imag, -1);
+    memcpy(real, work_real, REVERB_BINS * sizeof(float32));
+    memcpy(imag, work_imag, REVERB_BINS * sizeof(float32));
+    memset(real + REVERB_BINS, 0, (REVERB_BIN_STRIDE - REVERB_BINS) * sizeof(float32));
+    memset(imag + REVERB_BINS, 0, (REVERB_BIN_STRIDE - REVERB_BINS) * sizeof(float32));
+}
+
+//
+// Delay
+//
+
+// Four point Hermite interpolation at t between y1 and y2
+float32 hermite(float32 t, float32 y0, float32 y1, float32 y2, float32 y3) {
+    float32 c1 = 0.5f * (y2 - y0);
+    float32 c2 = y0 - 2.5f * y1 + 2.0f * y2 - 0.5f * y3;
+    float32 c3 = 0.5f * (y3 - y0) + 1.5f * (y1 - y2);
+    return ((c3 * t + c2) * t + c1) * t + y1;
+}
+
+void delay_init(Delay *delay, MemoryArena *arena, float32 sample_rate) {
+    delay->buffer = arena_push_array(arena, float32, DELAY_MAX_FRAMES);
+    memset(delay->buffer, 0, DELAY_MAX_FRAMES * sizeof(float32));
+    delay->write_position = 0;
+    delay->time = delay->smoothed_time = 0.375f * sample_rate;
+    delay->smoothing = 1.0f - expf(-1.0f / (DELAY_SMOOTHING_SECONDS * sample_rate));
+    delay->feedback = 0.4f;
+    delay->silent_frames = DELAY_MAX_FRAMES;
+}
+
+void delay_set_time(Delay *delay, float32 frames) {
+    if (frames < DELAY_MIN_FRAMES) frames = DELAY_MIN_FRAMES;
+    if (frames > DELAY_MAX_FRAMES - 2) frames = DELAY_MAX_FRAMES - 2;
+    delay->time = frames;
+}
+
+// Add the delayed signal of total_samples frames of input into out
+void delay_process(Delay *delay, const float32 *input, float32 *out, int32 total_samples) {
+    float32 *buffer = delay->buffer;
+    uint32 mask = DELAY_MAX_FRAMES - 1;
+    uint32 write = delay->write_position;
+    float32 time = delay->smoothed_time;
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        time += delay->smoothing * (delay->time - time);
+
+        // The read point falls between frames base and base + 1
+        int32 whole = (int32) time;
+        float32 t = 1.0f - (time - whole);
+        uint32 base = write - whole - 1;
+        float32 value = hermite(t, buffer[(base - 1) & mask], buffer[base & mask],
+                                buffer[(base + 1) & mask], buffer[(base + 2) & mask]);
+
+        float32 written = input[sample_index] + delay->feedback * value;
+        buffer[write & mask] = written;
+        out[sample_index] += value;
+        write++;
+        bool32 silent = written < EFFECTS_SILENCE && written > -EFFECTS_SILENCE;
+        if (!silent) {
+            delay->silent_frames = 0;
+        } else if (delay->silent_frames < DELAY_MAX_FRAMES) {
+            delay->silent_frames++; // Saturates, the gate only asks whether the whole ring is silent
+        }
+    }
+    delay->write_position = write;
+    delay->smoothed_time = time;
+}
+
+//
+// Reverb, loading on the main thread
+//
+
+void reverb_init(Reverb *reverb, MemoryArena *arena) {
+    fft_init(&reverb->fft);
+    size_t spectrum_size = REVERB_MAX_PARTITIONS * REVERB_BIN_STRIDE;
+    for (int32 slot = 0; slot < REVERB_RESPONSE_SLOTS; slot++) {
+        reverb->responses[slot].real = arena_push_array(arena, float32, spectrum_size);
+        reverb->responses[slot].imag = arena_push_array(arena, float32, spectrum_size);
+        reverb->responses[slot].partition_count = 0;
+    }
+    atomic_init(&reverb->pending_response, NULL);
+    reverb->last_sent_response = NULL;
+    reverb->last_taken_response = NULL;
+
+    reverb->response = NULL;
+    reverb->history_real = arena_push_array(arena, float32, spectrum_size);
+    reverb->history_imag = arena_push_array(arena, float32, spectrum_size);
+    memset(reverb->history_real, 0, spectrum_size * sizeof(float32));
+    memset(reverb->history_imag, 0, spectrum_size * sizeof(float32));
+    reverb->history_position = 0;
+    reverb->fill = 0;
+    reverb->tail_done = 0;
+    reverb->input_peak = 0.0f;
+    reverb->silent_partitions = REVERB_MAX_PARTITIONS;
+    memset(reverb->input, 0, sizeof(reverb->input));
+    memset(reverb->output, 0, sizeof(reverb->output));
+    memset(reverb->accumulator_real, 0, sizeof(reverb->accumulator_real));
+    memset(reverb->accumulator_imag, 0, sizeof(reverb->accumulator_imag));
+}
+
+// A response slot the audio thread isn't using, emptied for loading into
+ImpulseResponse *reverb_begin_response(Reverb *reverb) {
+    ImpulseResponse *response = NULL;
+    for (int32 slot = 0; slot < REVERB_RESPONSE_SLOTS; slot++) {
+        response = &reverb->responses[slot];
+        if (response != reverb->last_sent_response && response != reverb->last_taken_response) break;
+    }
+    response->partition_count = 0;
+    response->energy = 0.0;
+    return response;
+}
+
+// Append up to REVERB_PARTITION_FRAMES frames of impulse. Returns false once
+// the response is full, the rest of the impulse is dropped.
+bool32 reverb_add_partition(Reverb *reverb, ImpulseResponse *response, const float32 *frames, int32 count) {
+    if (response->partition_count == REVERB_MAX_PARTITIONS) return 0;
+
+    // Zero padded to the FFT size, as overlap-save needs
+    float32 padded[REVERB_FFT_SIZE] = {0};
+    float32 work_real[REVERB_FFT_SIZE], work_imag[REVERB_FFT_SIZE];
+    for (int32 index = 0; index < count; index++) {
+        padded[index] = frames[index];
+        response->energy += (float64) frames[index] * frames[index];
+    }
+    size_t offset = (size_t) response->partition_count * REVERB_BIN_STRIDE;
+    fft_real(&reverb->fft, padded, response->real + offset, response->imag + offset, work_real, work_imag);
+    response->partition_count++;
+    return 1;
+}
+
+// Normalize the response to unit energy, so every impulse sits at about the
+// same level, and have the audio thread switch to it at its next block
+void reverb_end_response(Reverb *reverb, ImpulseResponse *response) {
+    float32 scale = 1.0f / REVERB_FFT_SIZE; // The inverse FFT isn't scaled
+    if (response->energy > 0.0) scale *= (float32) (1.0 / sqrt(response->energy));
+    size_t count = (size_t) response->partition_count * REVERB_BIN_STRIDE;
+    for (size_t index = 0; index < count; index++) {
+        response->real[index] *= scale;
+        response->imag[index] *= scale;
+    }
+
+    // Nothing back means the audio thread took the response we sent before
+    ImpulseResponse *untaken =
+        atomic_exchange_explicit(&reverb->pending_response, response, memory_order_acq_rel);
+    if (!untaken && reverb->last_sent_response) reverb->last_taken_response = reverb->last_sent_response;
+    reverb->last_sent_response = response;
+}
+
+// Use a WAV file as the impulse response, mixed to mono. The file is played
+// at the engine's rate whatever rate it was recorded at. Returns NULL on
+// success, otherwise what went wrong.
+const char *reverb_load_file(Reverb *reverb, const char *path) {
+    Sample sample = {0};
+    const char *error = sample_open(&sample, path);
+    if (error) return error;
+    if (sample.frame_count == 0) {
+        sample_close(&sample);
+        return "empty impulse response";
+    }
+
+    ImpulseResponse *response = reverb_begin_response(reverb);
+    float32 frames[REVERB_PARTITION_FRAMES];
+    for (uint64 first = 0; first < sample.frame_count; first += REVERB_PARTITION_FRAMES) {
+        uint64 count = sample.frame_count - first;
+        if (count > REVERB_PARTITION_FRAMES) count = REVERB_PARTITION_FRAMES;
+        sample_convert(&sample, first, (int32) count, frames);
+        if (!reverb_add_partition(reverb, response, frames, (int32) count)) break;
+    }
+    sample_close(&sample);
+    reverb_end_response(reverb, response);
+    return NULL;
+}
+
+// Use a synthetic impulse response instead of a file: noise that decays by
+// 60 dB over seconds, darkening as it goes
+void reverb_generate(Reverb *reverb, float32 seconds, float32 sample_rate) {
+    ImpulseResponse *response = reverb_begin_response(reverb);
+    int32 total_frames = (int32) (seconds * sample_rate);
+    float32 decay = expf(-6.9078f / (seconds * sample_rate)); // ln(1000) per decay time
+    float32 level = 1.0f;
+    float32 lowpass = 0.0f;
+    uint32 random = 0x9e3779b9;
+    float32 frames[REVERB_PARTITION_FRAMES];
+    for (int32 first = 0; first < total_frames; first += REVERB_PARTITION_FRAMES) {
+        int32 count = total_frames - first;
+        if (count > REVERB_PARTITION_FRAMES) count = REVERB_PARTITION_FRAMES;
+        for (int32 index = 0; index < count; index++) {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            float32 noise = (int32) random * (1.0f / 2147483648.0f);
+            float32 brightness = 0.2f + 0.8f * level;
+            lowpass += brightness * (noise - lowpass);
+            frames[index] = lowpass * level;
+            level *= decay;
+        }
+        if (!reverb_add_partition(reverb, response, frames, count)) break;
+    }
+    reverb_end_response(reverb, response);
+}
+
+//
+// Reverb, audio thread
+//
+
+// Switch to a newly loaded response if one is waiting. The history is input,
+// so the new tail rings out from what was already played into the reverb.
+void reverb_take_response(Reverb *reverb) {
+    ImpulseResponse *response = atomic_exchange_explicit(&reverb->pending_response, NULL, memory_order_acq_rel);
+    if (!response) return;
+    reverb->response = response;
+    memset(reverb->accumulator_real, 0, sizeof(reverb->accumulator_real));
+    memset(reverb->accumulator_imag, 0, sizeof(reverb->accumulator_imag));
+    reverb->tail_done = 0;
+}
+
+// Add the products of impulse partitions first + 1 to last (exclusive) with
+// the input spectra that line up with them for the next output partition
+void reverb_accumulate_tail(Reverb *reverb, int32 first, int32 last) {
+    ImpulseResponse *response = reverb->response;
+    for (int32 index = first; index < last; index++) {
+        int32 partition = index + 1;
+        int32 history = (reverb->history_position - index + REVERB_MAX_PARTITIONS) % REVERB_MAX_PARTITIONS;
+        size_t response_offset = (size_t) partition * REVERB_BIN_STRIDE;
+        size_t history_offset = (size_t) history * REVERB_BIN_STRIDE;
+        spectrum_multiply_add(reverb->accumulator_real, reverb->accumulator_imag,
+                              reverb->history_real + history_offset, reverb->history_imag + history_offset,
+                              response->real + response_offset, response->imag + response_offset);
+    }
+}
+
+// The current partition of input is complete: add its product with the first
+// impulse partition and turn the sum back into the next partition of output
+void reverb_finish_partition(Reverb *reverb) {
+    ImpulseResponse *response = reverb->response;
+    reverb->history_position = (reverb->history_position + 1) % REVERB_MAX_PARTITIONS;
+    size_t history_offset = (size_t) reverb->history_position * REVERB_BIN_STRIDE;
+    float32 *history_real = reverb->history_real + history_offset;
+    float32 *history_imag = reverb->history_imag + history_offset;
+    fft_real(&reverb->fft, reverb->input, history_real, history_imag, reverb->work_real, reverb->work_imag);
+    spectrum_multiply_add(reverb->accumulator_real, reverb->accumulator_imag,
+                          history_real, history_imag, response->real, response->imag);
+
+    // Rebuild the mirrored half of the spectrum, then inverse transform.
+    // Overlap-save: only the second half of the result is valid output.
+    float32 *work_real = reverb->work_real;
+    float32 *work_imag = reverb->work_imag;
+    for (int32 bin = 0; bin < REVERB_BINS; bin++) {
+        work_real[bin] = reverb->accumulator_real[bin];
+        work_imag[bin] = reverb->accumulator_imag[bin];
+    }
+    for (int32 bin = REVERB_BINS; bin < REVERB_FFT_SIZE; bin++) {
+        work_real[bin] = reverb->accumulator_real[REVERB_FFT_SIZE - bin];
+        work_imag[bin] = -reverb->accumulator_imag[REVERB_FFT_SIZE - bin];
+    }
+    fft(&reverb->fft, work_real, work_imag, 1);
+    memcpy(reverb->output, work_real + REVERB_PARTITION_FRAMES, sizeof(reverb->output));
+
+    memcpy(reverb->input, reverb->input + REVERB_PARTITION_FRAMES, REVERB_PARTITION_FRAMES * sizeof(float32));
+    memset(reverb->accumulator_real, 0, sizeof(reverb->accumulator_real));
+    memset(reverb->accumulator_imag, 0, sizeof(reverb->accumulator_imag));
+    reverb->fill = 0;
+    reverb->tail_done = 0;
+    if (reverb->input_peak >= EFFECTS_SILENCE) {
+        reverb->silent_partitions = 0;
+    } else if (reverb->silent_partitions <= REVERB_MAX_PARTITIONS) {
+        reverb->silent_partitions++; // Saturates past any response length
+    }
+    reverb->input_peak = 0.0f;
+}
+
+// Add the reverb of total_samples frames of input into out
+void reverb_process(Reverb *reverb, const float32 *input, float32 *out, int32 total_samples) {
+    reverb_take_response(reverb);
+    if (!reverb->response || reverb->response->partition_count == 0) return;
+
+    int32 tail_count = reverb->response->partition_count - 1;
+    int32 done = 0;
+    while (done < total_samples) {
+        int32 count = REVERB_PARTITION_FRAMES - reverb->fill;
+        if (count > total_samples - done) count = total_samples - done;
+
+        float32 *current = reverb->input + REVERB_PARTITION_FRAMES + reverb->fill;
+        float32 *output = reverb->output + reverb->fill;
+        float32 peak = reverb->input_peak;
+        for (int32 index = 0; index < count; index++) {
+            float32 value = input[done + index];
+            current[index] = value;
+            out[done + index] += output[index];
+            float32 magnitude = (value < 0.0f) ? -value : value;
+            peak = (magnitude > peak) ? magnitude : peak;
+        }
+        reverb->input_peak = peak;
+        reverb->fill += count;
+        done += count;
+
+        // Keep the older partitions' products in step with the input, so the
+        // work is spread evenly over the partition
+        int32 tail_due = (int32) ((int64) tail_count * reverb->fill / REVERB_PARTITION_FRAMES);
+        reverb_accumulate_tail(reverb, reverb->tail_done, tail_due);
+        reverb->tail_done = tail_due;
+
+        if (reverb->fill == REVERB_PARTITION_FRAMES) reverb_finish_partition(reverb);
+    }
+}
+
+//
+// Bus
+//
+
+void effects_init(Effects *effects, MemoryArena *arena, float32 sample_rate) {
+    delay_init(&effects->delay, arena, sample_rate);
+    reverb_init(&effects->reverb, arena);
+    effects->delay_send = 0.0f;
+    effects->reverb_send = 0.0f;
+}
+
+// Feed the sends from mix_bus and add the returns back onto it
+void effects_process(Effects *effects, float32 *mix_bus, MemoryArena *scratch, int32 total_samples) {
+    // Once the whole ring is silent the delay has nothing left to return
+    bool32 run_delay = effects->delay_send != 0.0f || effects->delay.silent_frames < DELAY_MAX_FRAMES;
+    // Likewise the reverb once every partition of input it still convolves is
+    Reverb *reverb = &effects->reverb;
+    int32 partitions = reverb->response ? reverb->response->partition_count : 0;
+    bool32 run_reverb = effects->reverb_send != 0.0f || reverb->silent_partitions <= partitions ||
+                        atomic_load_explicit(&reverb->pending_response, memory_order_relaxed);
+    if (!run_delay && !run_reverb) return;
+
+    // Both sends are taken from the dry bus before either effect adds to it
+    TemporaryMemory temporary = begin_temporary_memory(scratch);
+    float32 *delay_input = NULL;
+    float32 *reverb_input = NULL;
+    if (run_delay) {
+        delay_input = arena_push_array(scratch, float32, total_samples);
+        for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+            delay_input[sample_index] = mix_bus[sample_index] * effects->delay_send;
+        }
+    }
+    if (run_reverb) {
+        reverb_input = arena_push_array(scratch, float32, total_samples);
+        for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+            reverb_input[sample_index] = mix_bus[sample_index] * effects->reverb_send;
+        }
+    }
+    if (run_delay) delay_process(&effects->delay, delay_input, mix_bus, total_samples);
+    if (run_reverb) reverb_process(reverb, reverb_input, mix_bus, total_samples);
+    end_temporary_memory(temporary);
+}
+
+#endif
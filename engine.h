@@ -0,0 +1,296 @@
+#if !defined(ENGINE_H)
+#define ENGINE_H
+
+#include <stdatomic.h>
+#include "platform.h"
+#include "arena.h"
+#include "voice.h"
+#include "command_queue.h"
+#include "workers.h"
+#include "patch.h"
+#include "sampler.h"
+#include "effects.h"
+
+// Platform independent half of the audio engine. The platform layer owns the
+// device and output format; the engine turns a stream of timestamped
+// commands into float samples on the mix bus.
+//
+// Every command carries the sample frame it takes effect on. engine_render
+// splits its block at those frames, so notes start and stop on the exact
+// sample they were scheduled for no matter how large the device buffer is.
+//
+// Voices play a compiled patch, see patch.h. engine_load_patch compiles on
+// the main thread into one of PATCH_PROGRAM_SLOTS programs and hands it over
+// through pending_program; the audio thread swaps it in at the start of its
+// next block with one atomic exchange. Samples for sampler nodes are loaded
+// into sample_bank with sample_load, also on the main thread, before a patch
+// that plays them is compiled.
+//
+// After the voices, the block goes through the send/return effects in
+// effects.h. Their impulse responses are loaded on the main thread too.
+
+#define PATCH_PROGRAM_SLOTS 3
+
+typedef struct {
+    CommandQueue commands;
+
+    // Where the sample clock was at the start of the most recent block, and
+    // the platform's counter at that moment. Written by the audio thread,
+    // read by the main thread under clock_sequence (a seqlock).
+    _Atomic uint32 clock_sequence;
+    _Atomic uint64 clock_frame;
+    _Atomic uint64 clock_counter;
+
+    float32 sample_rate;
+    int32 block_frames;       // Device block size, used as the scheduling delay
+    uint64 last_command_time; // Main thread only, keeps the queue in time order
+
+    // A program is in use while it may be rendering or about to be: the last
+    // one the audio thread took, and the last one sent. Any third slot is
+    // free to compile into.
+    PatchProgram programs[PATCH_PROGRAM_SLOTS];
+    _Atomic(PatchProgram *) pending_program; // Sent, not yet taken by the audio thread
+    PatchProgram *last_sent_program;         // Main thread only
+    PatchProgram *last_taken_program;        // Main thread only
+    SampleBank *sample_bank;                 // Loaded by the main thread, streamed by its prefetch thread
+    Effects *effects;                        // Impulse responses loaded by the main thread, the rest audio thread
+
+    // Owned by the audio thread, only changed through commands
+    MemoryArena scratch; // Reset at the start of every block
+    WorkerPool *workers; // Helps render the voices, NULL to use the audio thread alone
+    uint64 sample_clock; // First frame of the next block
+    VoicePool voices;
+    PatchProgram *program; // What the voices play
+    WaveType wave_type;  // Wave type used by the next note on
+    float32 volume;
+} Engine;
+
+// The engine struct itself should come from the same arena, see arena.h
+void engine_init(Engine *engine, MemoryArena *arena, float32 sample_rate, int32 block_frames) {
+    command_queue_init(&engine->commands);
+    atomic_init(&engine->clock_sequence, 0);
+    atomic_init(&engine->clock_frame, 0);
+    atomic_init(&engine->clock_counter, 0);
+
+    engine->sample_rate = sample_rate;
+    engine->block_frames = block_frames;
+    engine->last_command_time = 0;
+
+    sub_arena(&engine->scratch, arena, ENGINE_SCRATCH_SIZE);
+    engine->workers = NULL;
+    engine->sample_clock = 0;
+    engine->sample_bank = arena_push_struct(arena, SampleBank);
+    sample_bank_init(engine->sample_bank, arena);
+    voice_pool_init(&engine->voices, sample_rate);
+    engine->voices.sample_bank = engine->sample_bank;
+    engine->effects = arena_push_struct(arena, Effects);
+    effects_init(engine->effects, arena, sample_rate);
+
+    // Start on the default patch, installed directly since nothing runs yet
+    Patch patch;
+    patch_default(&patch);
+    patch_compile(&patch, &engine->programs[0]);
+    atomic_init(&engine->pending_program, NULL);
+    engine->last_sent_program = NULL;
+    engine->last_taken_program = &engine->programs[0];
+    engine->program = &engine->programs[0];
+    engine->wave_type = SIN;
+    engine->volume = 0.15f;
+}
+
+//
+// Main thread
+//
+
+// Sample frame for a command issued now. Events are delayed by one block so
+// that anything arriving while a block plays lands at the same offset in the
+// next one: constant latency instead of up to a whole buffer of jitter.
+uint64 engine_schedule_time(Engine *engine, uint64 counter, uint64 counter_frequency) {
+    uint32 sequence;
+    uint64 frame, block_counter;
+    do {
+        sequence = atomic_load_explicit(&engine->clock_sequence, memory_order_acquire);
+        frame = atomic_load_explicit(&engine->clock_frame, memory_order_relaxed);
+        block_counter = atomic_load_explicit(&engine->clock_counter, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((sequence & 1) ||
+             sequence != atomic_load_explicit(&engine->clock_sequence, memory_order_relaxed));
+
+    int64 elapsed = (int64) (counter - block_counter);
+    if (elapsed < 0) elapsed = 0;
+    uint64 elapsed_frames = (uint64) ((float64) elapsed * engine->sample_rate / counter_frequency);
+    return frame + engine->block_frames + elapsed_frames;
+}
+
+// Queue a command for command.time. Times are clamped to never go backwards,
+// since the audio thread stops reading at the first command in the future.
+bool32 engine_send(Engine *engine, Command command) {
+    if (command.time < engine->last_command_time) command.time = engine->last_command_time;
+    if (!command_queue_push(&engine->commands, command)) return 0;
+    engine->last_command_time = command.time;
+    return 1;
+}
+
+// Compile patch and have the audio thread switch to it at its next block.
+// Returns NULL on success, otherwise what is wrong with the patch, in which
+// case the current patch keeps playing.
+const char *engine_load_patch(Engine *engine, Patch *patch) {
+    PatchProgram *program = NULL;
+    for (int32 slot = 0; slot < PATCH_PROGRAM_SLOTS; slot++) {
+        program = &engine->programs[slot];
+        if (program != engine->last_sent_program && program != engine->last_taken_program) break;
+    }
+
+    const char *error = patch_compile(patch, program);
+    if (error) return error;
+
+    // Nothing back means the audio thread took the program we sent before
+    PatchProgram *untaken = atomic_exchange_explicit(&engine->pending_program, program, memory_order_acq_rel);
+    if (!untaken && engine->last_sent_program) engine->last_taken_program = engine->last_sent_program;
+    engine->last_sent_program = program;
+    return NULL;
+}
+
+//
+// Audio thread
+//
+
+// Switch to a newly compiled program if one is waiting. Filters start from
+// the patch's settings with cleared state, samplers of sounding voices from
+// the start of their sample.
+void engine_take_program(Engine *engine) {
+    PatchProgram *program = atomic_exchange_explicit(&engine->pending_program, NULL, memory_order_acq_rel);
+    if (!program) return;
+
+    engine->program = program;
+    VoicePool *voices = &engine->voices;
+    for (int32 slot = 0; slot < program->filter_count; slot++) voices->filters[slot] = program->filters[slot];
+    memset(voices->filter_state1, 0, sizeof(voices->filter_state1));
+    memset(voices->filter_state2, 0, sizeof(voices->filter_state2));
+    for (int32 slot = 0; slot < PATCH_MAX_SAMPLERS; slot++) {
+        voices->samples[slot] = (slot < program->sampler_count) ? program->samples[slot] : NULL;
+    }
+    for (int32 voice = 0; voice < voices->active_count; voice++) {
+        voice_stop_samples(voices, voice);
+        voice_start_samples(voices, voice);
+    }
+}
+
+// Record the platform counter for the block that is about to be rendered
+void engine_publish_clock(Engine *engine, uint64 counter) {
+    uint32 sequence = atomic_load_explicit(&engine->clock_sequence, memory_order_relaxed);
+    atomic_store_explicit(&engine->clock_sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&engine->clock_frame, engine->sample_clock, memory_order_relaxed);
+    atomic_store_explicit(&engine->clock_counter, counter, memory_order_relaxed);
+    atomic_store_explicit(&engine->clock_sequence, sequence + 2, memory_order_release);
+}
+
+void engine_set_parameter(Engine *engine, int32 parameter, float32 value) {
+    Envelope *envelope = &engine->voices.envelope;
+    FilterSettings *filter = &engine->voices.filters[0]; // Parameters drive the patch's first filter
+    switch (parameter) {
+        case PARAMETER_VOLUME:
+            engine->volume = value;
+            break;
+        case PARAMETER_ATTACK:
+            envelope->attack_samples = (int32) (value * engine->sample_rate);
+            voice_pool_clamp_stage(&engine->voices, ENVELOPE_ATTACK, envelope->attack_samples);
+            break;
+        case PARAMETER_DECAY:
+            envelope->decay_samples = (int32) (value * engine->sample_rate);
+            envelope->decay_coefficient = envelope_coefficient(envelope->decay_samples);
+            voice_pool_clamp_stage(&engine->voices, ENVELOPE_DECAY, envelope->decay_samples);
+            break;
+        case PARAMETER_SUSTAIN:
+            envelope->sustain_level = value;
+            break;
+        case PARAMETER_RELEASE:
+            envelope->release_samples = (int32) (value * engine->sample_rate);
+            envelope->release_coefficient = envelope_coefficient(envelope->release_samples);
+            voice_pool_clamp_stage(&engine->voices, ENVELOPE_RELEASE, envelope->release_samples);
+            break;
+        case PARAMETER_FILTER_TYPE:
+            // The two structures keep different state, start the new one clean
+            if (filter_is_svf((FilterType) value) != filter_is_svf(filter->type)) {
+                memset(engine->voices.filter_state1, 0, sizeof(engine->voices.filter_state1));
+                memset(engine->voices.filter_state2, 0, sizeof(engine->voices.filter_state2));
+            }
+            filter->type = (FilterType) value;
+            break;
+        case PARAMETER_CUTOFF:
+            filter->cutoff = value;
+            break;
+        case PARAMETER_RESONANCE:
+            filter->resonance = value;
+            break;
+        case PARAMETER_KEY_TRACKING:
+            filter->key_tracking = value;
+            break;
+        case PARAMETER_DELAY_TIME:
+            delay_set_time(&engine->effects->delay, value * engine->sample_rate);
+            break;
+        case PARAMETER_DELAY_FEEDBACK:
+            engine->effects->delay.feedback = value;
+            break;
+        case PARAMETER_DELAY_SEND:
+            engine->effects->delay_send = value;
+            break;
+        case PARAMETER_REVERB_SEND:
+            engine->effects->reverb_send = value;
+            break;
+    }
+}
+
+void engine_apply_command(Engine *engine, Command *command) {
+    switch (command->type) {
+        case COMMAND_NOTE_ON:
+            voice_note_on(&engine->voices, command->note, command->value, engine->volume,
+                          engine->wave_type, engine->sample_rate);
+            break;
+        case COMMAND_NOTE_OFF:
+            voice_note_off(&engine->voices, command->note);
+            break;
+        case COMMAND_WAVE_TYPE:
+            engine->wave_type = (WaveType) command->wave_type;
+            break;
+        case COMMAND_PARAMETER:
+            engine_set_parameter(engine, command->parameter, command->value);
+            break;
+    }
+}
+
+// Render total_samples frames into mix_bus. The block is cut into sub-blocks
+// at command boundaries; with no commands pending it is one full-length run
+// through the vector kernels. Effects run once over the whole block, so their
+// parameters change on block boundaries.
+void engine_render(Engine *engine, float32 *mix_bus, int32 total_samples) {
+    arena_reset(&engine->scratch);
+    engine_take_program(engine);
+
+    uint64 block_start = engine->sample_clock;
+    int32 offset = 0;
+    while (offset < total_samples) {
+        // Apply everything due by this frame, then render up to the next command
+        int32 next = total_samples;
+        Command *command;
+        while ((command = command_queue_peek(&engine->commands))) {
+            if (command->time > block_start + offset) {
+                if (command->time < block_start + total_samples) {
+                    next = (int32) (command->time - block_start);
+                }
+                break;
+            }
+            engine_apply_command(engine, command);
+            command_queue_skip(&engine->commands);
+        }
+
+        generate_voices(&engine->voices, engine->program, mix_bus + offset, &engine->scratch, next - offset,
+                        engine->workers);
+        offset = next;
+    }
+    effects_process(engine->effects, mix_bus, &engine->scratch, total_samples);
+    engine->sample_clock += total_samples;
+}
+
+#endif
@@ -0,0 +1,101 @@
+#if !defined(ENVELOPE_H)
+#define ENVELOPE_H
+
+#include <math.h>
+#include "platform.h"
+
+// ADSR envelope rendered a segment at a time. Each stage has a known length
+// in samples, so the voice renderer cuts its block at stage boundaries and
+// hands whole runs to the ramp functions below instead of stepping a state
+// machine per sample. Attack is a linear ramp; decay and release are
+// exponential curves aimed slightly past their end level so they land on it
+// after exactly the stage length. Sustain is a constant gain and costs
+// nothing extra.
+
+#define ENVELOPE_LANES 8
+#define ENVELOPE_OVERSHOOT 0.001f // How far past the end level the exponential stages aim
+
+typedef enum {
+    ENVELOPE_ATTACK,
+    ENVELOPE_DECAY,
+    ENVELOPE_SUSTAIN,
+    ENVELOPE_RELEASE,
+    ENVELOPE_OFF, // Silent, the voice can be freed
+} EnvelopeStage;
+
+typedef struct {
+    int32 attack_samples;
+    int32 decay_samples;
+    float32 sustain_level;
+    int32 release_samples;
+
+    // Per sample multiplier for the exponential stages
+    float32 decay_coefficient;
+    float32 release_coefficient;
+} Envelope;
+
+float32 envelope_coefficient(int32 samples) {
+    if (samples <= 0) return 0.0f;
+    return (float32) pow(ENVELOPE_OVERSHOOT / (1.0 + ENVELOPE_OVERSHOOT), 1.0 / samples);
+}
+
+// Times in seconds, sustain as a gain
+void envelope_set(Envelope *envelope, float32 attack, float32 decay, float32 sustain, float32 release,
+                  float32 sample_rate) {
+    envelope->attack_samples = (int32) (attack * sample_rate);
+    envelope->decay_samples = (int32) (decay * sample_rate);
+    envelope->sustain_level = sustain;
+    envelope->release_samples = (int32) (release * sample_rate);
+    envelope->decay_coefficient = envelope_coefficient(envelope->decay_samples);
+    envelope->release_coefficient = envelope_coefficient(envelope->release_samples);
+}
+
+// The ramps add source * gain into mix_bus, with the gain following the
+// envelope curve, and return the gain after the last sample. They work
+// ENVELOPE_LANES samples at a time with a fixed size inner loop, which the
+// compiler turns into vector code.
+
+float32 envelope_linear(float32 *mix_bus, float32 *source, int32 total_samples, float32 level, float32 step) {
+    float32 lane_offsets[ENVELOPE_LANES];
+    for (int32 lane = 0; lane < ENVELOPE_LANES; lane++) lane_offsets[lane] = lane * step;
+
+    int32 sample_index = 0;
+    for (; sample_index + ENVELOPE_LANES <= total_samples; sample_index += ENVELOPE_LANES) {
+        for (int32 lane = 0; lane < ENVELOPE_LANES; lane++) {
+            mix_bus[sample_index + lane] += source[sample_index + lane] * (level + lane_offsets[lane]);
+        }
+        level += ENVELOPE_LANES * step;
+    }
+    for (; sample_index < total_samples; sample_index++) {
+        mix_bus[sample_index] += source[sample_index] * level;
+        level += step;
+    }
+    return level;
+}
+
+// level approaches target as target + (level - target) * coefficient^n
+float32 envelope_exponential(float32 *mix_bus, float32 *source, int32 total_samples, float32 level,
+                             float32 target, float32 coefficient) {
+    float32 lane_powers[ENVELOPE_LANES];
+    float32 power = 1.0f;
+    for (int32 lane = 0; lane < ENVELOPE_LANES; lane++) {
+        lane_powers[lane] = power;
+        power *= coefficient;
+    }
+
+    float32 delta = level - target;
+    int32 sample_index = 0;
+    for (; sample_index + ENVELOPE_LANES <= total_samples; sample_index += ENVELOPE_LANES) {
+        for (int32 lane = 0; lane < ENVELOPE_LANES; lane++) {
+            mix_bus[sample_index + lane] += source[sample_index + lane] * (target + delta * lane_powers[lane]);
+        }
+        delta *= power;
+    }
+    for (; sample_index < total_samples; sample_index++) {
+        mix_bus[sample_index] += source[sample_index] * (target + delta);
+        delta *= coefficient;
+    }
+    return target + delta;
+}
+
+#endif
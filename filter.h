@@ -0,0 +1,334 @@
+#if !defined(FILTER_H)
+#define FILTER_H
+
+#include <math.h>
+#include <string.h>
+#include "platform.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Per voice filters processed FILTER_LANES voices at a time. Voice state is
+// struct-of-arrays in the voice pool, so a group of consecutive voices is a
+// contiguous run of each state variable; the group's audio is interleaved
+// (sample-major, one lane per voice) so every sample step is one vector
+// operation across the group. With SSE2 the eight lanes are two registers,
+// two independent dependency chains per sample; elsewhere a plain loop over
+// the lanes does the same work.
+//
+// Two structures are available: the TPT state variable filter (Zavalishin /
+// Cytomic), which stays well behaved under fast modulation, and the RBJ
+// cookbook biquad in transposed direct form II. Both keep two state values
+// per voice. Coefficients are computed per lane once per block (control
+// rate) from cutoff and resonance values that are smoothed block to block.
+
+#define FILTER_LANES 8
+#define FILTER_SMOOTHING_SECONDS 0.01f // Time constant of the block to block smoothing
+#define FILTER_KEY_TRACKING_ROOT 261.63f // Key tracked cutoffs are relative to C4
+
+typedef enum {
+    FILTER_NONE,
+    FILTER_SVF_LOWPASS,
+    FILTER_SVF_HIGHPASS,
+    FILTER_SVF_BANDPASS,
+    FILTER_BIQUAD_LOWPASS,
+    FILTER_BIQUAD_HIGHPASS,
+    FILTER_BIQUAD_BANDPASS,
+    FILTER_TYPE_COUNT,
+} FilterType;
+
+typedef struct {
+    FilterType type;
+    float32 cutoff;       // Hz
+    float32 resonance;    // Q, 0.707 is flat
+    float32 key_tracking; // 0 fixed cutoff, 1 cutoff follows the note pitch
+
+    float32 smoothed_cutoff;
+    float32 smoothed_resonance;
+} FilterSettings;
+
+// Coefficients for one group. The SVF is run in state space form, with its
+// low, band and high pass outputs folded into h0..h2, so all three modes
+// share one loop and the recursion is a single multiply-add deep:
+//
+//   output = h0 * input + h1 * ic1 + h2 * ic2
+//   ic1    = k11 * ic1 + k12 * ic2 + g1 * input
+//   ic2    = k21 * ic1 + k22 * ic2 + g2 * input
+//
+// The biquad uses b0..b2 and a1, a2.
+typedef struct {
+    float32 k11[FILTER_LANES], k12[FILTER_LANES], g1[FILTER_LANES];
+    float32 k21[FILTER_LANES], k22[FILTER_LANES], g2[FILTER_LANES];
+    float32 h0[FILTER_LANES], h1[FILTER_LANES], h2[FILTER_LANES];
+} SvfCoefficients;
+
+typedef struct {
+    float32 b0[FILTER_LANES];
+    float32 b1[FILTER_LANES];
+    float32 b2[FILTER_LANES];
+    float32 a1[FILTER_LANES];
+    float32 a2[FILTER_LANES];
+} BiquadCoefficients;
+
+typedef union {
+    SvfCoefficients svf;
+    BiquadCoefficients biquad;
+} FilterCoefficients;
+
+void filter_settings_init(FilterSettings *settings) {
+    settings->type = FILTER_NONE;
+    settings->cutoff = 2000.0f;
+    settings->resonance = 0.707f;
+    settings->key_tracking = 0.0f;
+    settings->smoothed_cutoff = settings->cutoff;
+    settings->smoothed_resonance = settings->resonance;
+}
+
+bool32 filter_is_svf(FilterType type) {
+    return type >= FILTER_SVF_LOWPASS && type <= FILTER_SVF_BANDPASS;
+}
+
+// Move the smoothed values one block of block_seconds towards the targets
+void filter_smooth(FilterSettings *settings, float32 block_seconds) {
+    float32 amount = 1.0f - expf(-block_seconds / FILTER_SMOOTHING_SECONDS);
+    settings->smoothed_cutoff += amount * (settings->cutoff - settings->smoothed_cutoff);
+    settings->smoothed_resonance += amount * (settings->resonance - settings->smoothed_resonance);
+}
+
+// Cutoff for a voice playing frequency, kept below Nyquist
+float32 filter_voice_cutoff(FilterSettings *settings, float32 frequency, float32 sample_rate) {
+    float32 cutoff = settings->smoothed_cutoff;
+    if (settings->key_tracking != 0.0f && frequency > 0.0f) {
+        cutoff *= powf(frequency / FILTER_KEY_TRACKING_ROOT, settings->key_tracking);
+    }
+    float32 limit = 0.49f * sample_rate;
+    if (cutoff > limit) cutoff = limit;
+    if (cutoff < 10.0f) cutoff = 10.0f;
+    return cutoff;
+}
+
+void filter_coefficients(FilterCoefficients *coefficients, int32 lane, FilterType type,
+                         float32 cutoff, float32 resonance, float32 sample_rate) {
+    if (filter_is_svf(type)) {
+        SvfCoefficients *svf = &coefficients->svf;
+        float32 g = tanf(PI * cutoff / sample_rate);
+        float32 k = 1.0f / resonance;
+        float32 a1 = 1.0f / (1.0f + g * (g + k));
+        float32 a2 = g * a1;
+        float32 a3 = g * a2;
+
+        // Output = m0 * input + m1 * band + m2 * low
+        float32 m0 = (type == FILTER_SVF_HIGHPASS) ? 1.0f : 0.0f;
+        float32 m1 = (type == FILTER_SVF_HIGHPASS) ? -k : (type == FILTER_SVF_BANDPASS) ? 1.0f : 0.0f;
+        float32 m2 = (type == FILTER_SVF_HIGHPASS) ? -1.0f : (type == FILTER_SVF_LOWPASS) ? 1.0f : 0.0f;
+
+        // band = a1 * ic1 - a2 * ic2 + a2 * input
+        // low = a2 * ic1 + (1 - a3) * ic2 + a3 * input
+        // and each state moves to twice its output minus itself
+        svf->k11[lane] = 2.0f * a1 - 1.0f;
+        svf->k12[lane] = -2.0f * a2;
+        svf->g1[lane] = 2.0f * a2;
+        svf->k21[lane] = 2.0f * a2;
+        svf->k22[lane] = 1.0f - 2.0f * a3;
+        svf->g2[lane] = 2.0f * a3;
+        svf->h0[lane] = m0 + m1 * a2 + m2 * a3;
+        svf->h1[lane] = m1 * a1 + m2 * a2;
+        svf->h2[lane] = -m1 * a2 + m2 * (1.0f - a3);
+    } else {
+        BiquadCoefficients *biquad = &coefficients->biquad;
+        float32 w0 = TWO_PI * cutoff / sample_rate;
+        float32 cos_w0 = cosf(w0);
+        float32 alpha = sinf(w0) / (2.0f * resonance);
+        float32 a0 = 1.0f + alpha;
+        float32 b0, b1, b2;
+        if (type == FILTER_BIQUAD_HIGHPASS) {
+            b0 = (1.0f + cos_w0) / 2.0f;
+            b1 = -(1.0f + cos_w0);
+            b2 = b0;
+        } else if (type == FILTER_BIQUAD_BANDPASS) {
+            b0 = alpha; // Constant 0 dB peak gain
+            b1 = 0.0f;
+            b2 = -alpha;
+        } else {
+            b0 = (1.0f - cos_w0) / 2.0f;
+            b1 = 1.0f - cos_w0;
+            b2 = b0;
+        }
+        biquad->b0[lane] = b0 / a0;
+        biquad->b1[lane] = b1 / a0;
+        biquad->b2[lane] = b2 / a0;
+        biquad->a1[lane] = -2.0f * cos_w0 / a0;
+        biquad->a2[lane] = (1.0f - alpha) / a0;
+    }
+}
+
+// samples is total_samples * FILTER_LANES interleaved values, filtered in
+// place. state1 and state2 point at the group's FILTER_LANES state values.
+
+#if defined(__SSE2__)
+
+// Both halves of the group go through the same loop so their dependency
+// chains overlap
+void svf_process(float32 *samples, int32 total_samples, float32 *state1, float32 *state2,
+                 SvfCoefficients *c) {
+#define load_pair(name, array) __m128 name##_lo = _mm_loadu_ps(array), name##_hi = _mm_loadu_ps(array + 4)
+    load_pair(k11, c->k11); load_pair(k12, c->k12); load_pair(g1, c->g1);
+    load_pair(k21, c->k21); load_pair(k22, c->k22); load_pair(g2, c->g2);
+    load_pair(h0, c->h0); load_pair(h1, c->h1); load_pair(h2, c->h2);
+    load_pair(ic1, state1);
+    load_pair(ic2, state2);
+
+#define svf_step(half, v) {                                                                     \
+        __m128 input = _mm_loadu_ps(v);                                                         \
+        __m128 output = _mm_add_ps(_mm_mul_ps(h0_##half, input),                                \
+                                   _mm_add_ps(_mm_mul_ps(h1_##half, ic1_##half),                \
+                                              _mm_mul_ps(h2_##half, ic2_##half)));              \
+        __m128 next1 = _mm_add_ps(_mm_mul_ps(g1_##half, input),                                 \
+                                  _mm_add_ps(_mm_mul_ps(k11_##half, ic1_##half),                \
+                                             _mm_mul_ps(k12_##half, ic2_##half)));              \
+        __m128 next2 = _mm_add_ps(_mm_mul_ps(g2_##half, input),                                 \
+                                  _mm_add_ps(_mm_mul_ps(k21_##half, ic1_##half),                \
+                                             _mm_mul_ps(k22_##half, ic2_##half)));              \
+        ic1_##half = next1;                                                                     \
+        ic2_##half = next2;                                                                     \
+        _mm_storeu_ps(v, output);                                                               \
+    }
+
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        float32 *v = samples + sample_index * FILTER_LANES;
+        svf_step(lo, v);
+        svf_step(hi, v + 4);
+    }
+#undef svf_step
+
+    _mm_storeu_ps(state1, ic1_lo); _mm_storeu_ps(state1 + 4, ic1_hi);
+    _mm_storeu_ps(state2, ic2_lo); _mm_storeu_ps(state2 + 4, ic2_hi);
+}
+
+void biquad_process(float32 *samples, int32 total_samples, float32 *state1, float32 *state2,
+                    BiquadCoefficients *c) {
+    load_pair(b0, c->b0); load_pair(b1, c->b1); load_pair(b2, c->b2);
+    load_pair(a1, c->a1); load_pair(a2, c->a2);
+    load_pair(s1, state1);
+    load_pair(s2, state2);
+
+#define biquad_step(half, v) {                                                                  \
+        __m128 x = _mm_loadu_ps(v);                                                             \
+        __m128 y = _mm_add_ps(_mm_mul_ps(b0_##half, x), s1_##half);                             \
+        s1_##half = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1_##half, x), _mm_mul_ps(a1_##half, y)),  \
+                               s2_##half);                                                      \
+        s2_##half = _mm_sub_ps(_mm_mul_ps(b2_##half, x), _mm_mul_ps(a2_##half, y));             \
+        _mm_storeu_ps(v, y);                                                                    \
+    }
+
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        float32 *v = samples + sample_index * FILTER_LANES;
+        biquad_step(lo, v);
+        biquad_step(hi, v + 4);
+    }
+#undef biquad_step
+#undef load_pair
+
+    _mm_storeu_ps(state1, s1_lo); _mm_storeu_ps(state1 + 4, s1_hi);
+    _mm_storeu_ps(state2, s2_lo); _mm_storeu_ps(state2 + 4, s2_hi);
+}
+
+#else
+
+void svf_process(float32 *samples, int32 total_samples, float32 *state1, float32 *state2,
+                 SvfCoefficients *c) {
+    float32 ic1[FILTER_LANES], ic2[FILTER_LANES];
+    memcpy(ic1, state1, sizeof(ic1));
+    memcpy(ic2, state2, sizeof(ic2));
+
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        float32 *v = samples + sample_index * FILTER_LANES;
+        for (int32 lane = 0; lane < FILTER_LANES; lane++) {
+            float32 input = v[lane];
+            float32 next1 = c->k11[lane] * ic1[lane] + c->k12[lane] * ic2[lane] + c->g1[lane] * input;
+            float32 next2 = c->k21[lane] * ic1[lane] + c->k22[lane] * ic2[lane] + c->g2[lane] * input;
+            v[lane] = c->h0[lane] * input + c->h1[lane] * ic1[lane] + c->h2[lane] * ic2[lane];
+            ic1[lane] = next1;
+            ic2[lane] = next2;
+        }
+    }
+
+    memcpy(state1, ic1, sizeof(ic1));
+    memcpy(state2, ic2, sizeof(ic2));
+}
+
+void biquad_process(float32 *samples, int32 total_samples, float32 *state1, float32 *state2,
+                    BiquadCoefficients *c) {
+    float32 s1[FILTER_LANES], s2[FILTER_LANES];
+    memcpy(s1, state1, sizeof(s1));
+    memcpy(s2, state2, sizeof(s2));
+
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        float32 *v = samples + sample_index * FILTER_LANES;
+        for (int32 lane = 0; lane < FILTER_LANES; lane++) {
+            float32 x = v[lane];
+            float32 y = c->b0[lane] * x + s1[lane];
+            s1[lane] = c->b1[lane] * x - c->a1[lane] * y + s2[lane];
+            s2[lane] = c->b2[lane] * x - c->a2[lane] * y;
+            v[lane] = y;
+        }
+    }
+
+    memcpy(state1, s1, sizeof(s1));
+    memcpy(state2, s2, sizeof(s2));
+}
+
+#endif
+
+// Interleave FILTER_LANES separate buffers into one, and back. With SSE2
+// whole 4x4 tiles are transposed in registers.
+void filter_interleave(float32 *interleaved, float32 **buffers, int32 total_samples) {
+    int32 sample_index = 0;
+#if defined(__SSE2__)
+    for (; sample_index + 4 <= total_samples; sample_index += 4) {
+        for (int32 lane = 0; lane < FILTER_LANES; lane += 4) {
+            __m128 row0 = _mm_loadu_ps(buffers[lane + 0] + sample_index);
+            __m128 row1 = _mm_loadu_ps(buffers[lane + 1] + sample_index);
+            __m128 row2 = _mm_loadu_ps(buffers[lane + 2] + sample_index);
+            __m128 row3 = _mm_loadu_ps(buffers[lane + 3] + sample_index);
+            _MM_TRANSPOSE4_PS(row0, row1, row2, row3);
+            float32 *output = interleaved + sample_index * FILTER_LANES + lane;
+            _mm_storeu_ps(output + 0 * FILTER_LANES, row0);
+            _mm_storeu_ps(output + 1 * FILTER_LANES, row1);
+            _mm_storeu_ps(output + 2 * FILTER_LANES, row2);
+            _mm_storeu_ps(output + 3 * FILTER_LANES, row3);
+        }
+    }
+#endif
+    for (float32 *output = interleaved + sample_index * FILTER_LANES; sample_index < total_samples;
+         sample_index++, output += FILTER_LANES) {
+        for (int32 lane = 0; lane < FILTER_LANES; lane++) output[lane] = buffers[lane][sample_index];
+    }
+}
+
+void filter_deinterleave(float32 **buffers, float32 *interleaved, int32 total_samples) {
+    int32 sample_index = 0;
+#if defined(__SSE2__)
+    for (; sample_index + 4 <= total_samples; sample_index += 4) {
+        for (int32 lane = 0; lane < FILTER_LANES; lane += 4) {
+            float32 *input = interleaved + sample_index * FILTER_LANES + lane;
+            __m128 row0 = _mm_loadu_ps(input + 0 * FILTER_LANES);
+            __m128 row1 = _mm_loadu_ps(input + 1 * FILTER_LANES);
+            __m128 row2 = _mm_loadu_ps(input + 2 * FILTER_LANES);
+            __m128 row3 = _mm_loadu_ps(input + 3 * FILTER_LANES);
+            _MM_TRANSPOSE4_PS(row0, row1, row2, row3);
+            _mm_storeu_ps(buffers[lane + 0] + sample_index, row0);
+            _mm_storeu_ps(buffers[lane + 1] + sample_index, row1);
+            _mm_storeu_ps(buffers[lane + 2] + sample_index, row2);
+            _mm_storeu_ps(buffers[lane + 3] + sample_index, row3);
+        }
+    }
+#endif
+    for (float32 *input = interleaved + sample_index * FILTER_LANES; sample_index < total_samples;
+         sample_index++, input += FILTER_LANES) {
+        for (int32 lane = 0; lane < FILTER_LANES; lane++) buffers[lane][sample_index] = input[lane];
+    }
+}
+
+#endif
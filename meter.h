@@ -0,0 +1,165 @@
+#if !defined(METER_H)
+#define METER_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include "platform.h"
+
+// DSP load meter for the audio callback. The audio thread records each
+// callback with meter_record: a handful of relaxed atomic adds, no locks. Any
+// other thread can read the counters at any time with meter_read.
+//
+// Load is render time over the time the rendered audio lasts, so 100% means
+// the callback only just kept up. Late callbacks started more than one and a
+// half blocks after the previous one. Underruns are detected by comparing
+// the frames produced against the wall clock: if the device has played more
+// than a block of audio we never gave it, it must have played silence.
+
+#define METER_BUCKET_PERCENT 5
+#define METER_BUCKETS (100 / METER_BUCKET_PERCENT + 1) // The last bucket is everything over 100%
+#define METER_ANCHOR_SECONDS 10 // Re-anchor the underrun check so clock drift can't add up
+
+typedef struct {
+    // Written by the audio thread, read by anyone
+    _Atomic uint32 histogram[METER_BUCKETS];
+    _Atomic uint64 callbacks;
+    _Atomic uint64 render_ticks;
+    _Atomic uint64 budget_ticks;
+    _Atomic uint32 peak_load;  // Per mille, cleared by meter_take_peak
+    _Atomic uint32 overruns;   // Callbacks over 100% load
+    _Atomic uint32 late_callbacks;
+    _Atomic uint32 underruns;
+
+    // Audio thread only
+    uint64 counter_frequency;
+    uint64 last_start;     // 0 until the first callback after meter_restart
+    uint64 anchor_counter;
+    uint64 anchor_frames;
+    uint64 frames;
+    int32 last_frames;
+} DspMeter;
+
+typedef struct {
+    uint64 callbacks;
+    uint64 render_ticks;
+    uint64 budget_ticks;
+    uint32 overruns;
+    uint32 late_callbacks;
+    uint32 underruns;
+} MeterSnapshot;
+
+void meter_init(DspMeter *meter, uint64 counter_frequency) {
+    for (int32 bucket = 0; bucket < METER_BUCKETS; bucket++) atomic_init(&meter->histogram[bucket], 0);
+    atomic_init(&meter->callbacks, 0);
+    atomic_init(&meter->render_ticks, 0);
+    atomic_init(&meter->budget_ticks, 0);
+    atomic_init(&meter->peak_load, 0);
+    atomic_init(&meter->overruns, 0);
+    atomic_init(&meter->late_callbacks, 0);
+    atomic_init(&meter->underruns, 0);
+
+    meter->counter_frequency = counter_frequency;
+    meter->last_start = 0;
+    meter->frames = 0;
+    meter->last_frames = 0;
+}
+
+// Forget callback timing, for when the device is stopped or reopened. Only
+// call this while no callback can run.
+void meter_restart(DspMeter *meter) {
+    meter->last_start = 0;
+}
+
+// Audio thread: one callback that rendered frames between counter values
+// start and end
+void meter_record(DspMeter *meter, uint64 start, uint64 end, int32 frames, float32 sample_rate) {
+    uint64 render = end - start;
+    uint64 budget = (uint64) ((float64) frames * meter->counter_frequency / sample_rate);
+
+    uint32 load = (budget > 0) ? (uint32) (1000 * render / budget) : 0;
+    int32 bucket = load / (10 * METER_BUCKET_PERCENT);
+    if (bucket >= METER_BUCKETS) bucket = METER_BUCKETS - 1;
+
+    atomic_fetch_add_explicit(&meter->histogram[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&meter->callbacks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&meter->render_ticks, render, memory_order_relaxed);
+    atomic_fetch_add_explicit(&meter->budget_ticks, budget, memory_order_relaxed);
+    // Compare and swap, so a meter_take_peak that lands in between isn't undone
+    uint32 peak = atomic_load_explicit(&meter->peak_load, memory_order_relaxed);
+    while (load > peak && !atomic_compare_exchange_weak_explicit(&meter->peak_load, &peak, load,
+                                                                 memory_order_relaxed, memory_order_relaxed)) {
+    }
+    if (render > budget) atomic_fetch_add_explicit(&meter->overruns, 1, memory_order_relaxed);
+
+    if (meter->last_start == 0) {
+        meter->anchor_counter = start;
+        meter->anchor_frames = meter->frames;
+    } else {
+        uint64 period = (uint64) ((float64) meter->last_frames * meter->counter_frequency / sample_rate);
+        if (2 * (start - meter->last_start) > 3 * period) {
+            atomic_fetch_add_explicit(&meter->late_callbacks, 1, memory_order_relaxed);
+        }
+
+        float64 elapsed = (float64) (start - meter->anchor_counter) / meter->counter_frequency;
+        float64 played = elapsed * sample_rate;
+        float64 produced = (float64) (meter->frames - meter->anchor_frames);
+        if (played - produced > meter->last_frames) {
+            atomic_fetch_add_explicit(&meter->underruns, 1, memory_order_relaxed);
+            meter->anchor_counter = start;
+            meter->anchor_frames = meter->frames;
+        } else if (elapsed > METER_ANCHOR_SECONDS) {
+            meter->anchor_counter = start;
+            meter->anchor_frames = meter->frames;
+        }
+    }
+    meter->last_start = start;
+    meter->last_frames = frames;
+    meter->frames += frames;
+}
+
+//
+// Any thread
+//
+
+void meter_read(DspMeter *meter, MeterSnapshot *snapshot) {
+    snapshot->callbacks = atomic_load_explicit(&meter->callbacks, memory_order_relaxed);
+    snapshot->render_ticks = atomic_load_explicit(&meter->render_ticks, memory_order_relaxed);
+    snapshot->budget_ticks = atomic_load_explicit(&meter->budget_ticks, memory_order_relaxed);
+    snapshot->overruns = atomic_load_explicit(&meter->overruns, memory_order_relaxed);
+    snapshot->late_callbacks = atomic_load_explicit(&meter->late_callbacks, memory_order_relaxed);
+    snapshot->underruns = atomic_load_explicit(&meter->underruns, memory_order_relaxed);
+}
+
+// Average load in percent between two snapshots
+float32 meter_average_load(MeterSnapshot *from, MeterSnapshot *to) {
+    uint64 budget = to->budget_ticks - from->budget_ticks;
+    if (budget == 0) return 0;
+    return 100.0f * (float32) (to->render_ticks - from->render_ticks) / budget;
+}
+
+// Highest load in percent since the last call
+float32 meter_take_peak(DspMeter *meter) {
+    return atomic_exchange_explicit(&meter->peak_load, 0, memory_order_relaxed) / 10.0f;
+}
+
+void meter_dump(DspMeter *meter, FILE *file) {
+    MeterSnapshot totals = {0}, snapshot;
+    meter_read(meter, &snapshot);
+
+    fprintf(file, "DSP load over %llu callbacks: average %.1f%%\n",
+            (unsigned long long) snapshot.callbacks, meter_average_load(&totals, &snapshot));
+    fprintf(file, "Overruns %u, late callbacks %u, underruns %u\n",
+            snapshot.overruns, snapshot.late_callbacks, snapshot.underruns);
+    for (int32 bucket = 0; bucket < METER_BUCKETS; bucket++) {
+        uint32 count = atomic_load_explicit(&meter->histogram[bucket], memory_order_relaxed);
+        if (count == 0) continue;
+        if (bucket == METER_BUCKETS - 1) {
+            fprintf(file, "  >100%%    %u\n", count);
+        } else {
+            fprintf(file, "  %3d-%3d%% %u\n", bucket * METER_BUCKET_PERCENT,
+                    (bucket + 1) * METER_BUCKET_PERCENT, count);
+        }
+    }
+}
+
+#endif
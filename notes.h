@@ -1,118 +1,123 @@
 #if !defined(NOTES_H)
 #define NOTES_H
 
+#include <math.h>
 #include "platform.h"
 
+// Notes are MIDI note numbers: 0 is C-1, 60 is C4 and 69 is A4. A tuning is
+// a precomputed frequency for every note number, so turning a note into a
+// frequency is an array index. note_frequencies points at the active tuning
+// and can be swapped for any other table.
+
+#define MIDI_NOTE_COUNT 128
+#define NOTE_A4 69
+
+// 12 tone equal temperament with A4 = 440 Hz, 440 * 2^((note - 69) / 12).
+// Generated offline, rebuild at runtime with tuning_equal for other A4s.
+const float32 equal_temperament[MIDI_NOTE_COUNT] = {
+    8.17579892f, 8.66195722f, 9.177024f, 9.72271824f,  // 0
+    10.3008612f, 10.9133822f, 11.5623257f, 12.2498574f,  // 4
+    12.9782718f, 13.75f, 14.5676175f, 15.4338532f,  // 8
+    16.3515978f, 17.3239144f, 18.354048f, 19.4454365f,  // 12
+    20.6017223f, 21.8267645f, 23.1246514f, 24.4997147f,  // 16
+    25.9565436f, 27.5f, 29.1352351f, 30.8677063f,  // 20
+    32.7031957f, 34.6478289f, 36.708096f, 38.890873f,  // 24
+    41.2034446f, 43.6535289f, 46.2493028f, 48.9994295f,  // 28
+    51.9130872f, 55.0f, 58.2704702f, 61.7354127f,  // 32
+    65.4063913f, 69.2956577f, 73.416192f, 77.7817459f,  // 36
+    82.4068892f, 87.3070579f, 92.4986057f, 97.998859f,  // 40
+    103.826174f, 110.0f, 116.54094f, 123.470825f,  // 44
+    130.812783f, 138.591315f, 146.832384f, 155.563492f,  // 48
+    164.813778f, 174.614116f, 184.997211f, 195.997718f,  // 52
+    207.652349f, 220.0f, 233.081881f, 246.941651f,  // 56
+    261.625565f, 277.182631f, 293.664768f, 311.126984f,  // 60
+    329.627557f, 349.228231f, 369.994423f, 391.995436f,  // 64
+    415.304698f, 440.0f, 466.163762f, 493.883301f,  // 68
+    523.251131f, 554.365262f, 587.329536f, 622.253967f,  // 72
+    659.255114f, 698.456463f, 739.988845f, 783.990872f,  // 76
+    830.609395f, 880.0f, 932.327523f, 987.766603f,  // 80
+    1046.50226f, 1108.73052f, 1174.65907f, 1244.50793f,  // 84
+    1318.51023f, 1396.91293f, 1479.97769f, 1567.98174f,  // 88
+    1661.21879f, 1760.0f, 1864.65505f, 1975.53321f,  // 92
+    2093.00452f, 2217.46105f, 2349.31814f, 2489.01587f,  // 96
+    2637.02046f, 2793.82585f, 2959.95538f, 3135.96349f,  // 100
+    3322.43758f, 3520.0f, 3729.31009f, 3951.06641f,  // 104
+    4186.00904f, 4434.9221f, 4698.63629f, 4978.03174f,  // 108
+    5274.04091f, 5587.6517f, 5919.91076f, 6271.92698f,  // 112
+    6644.87516f, 7040.0f, 7458.62018f, 7902.13282f,  // 116
+    8372.01809f, 8869.84419f, 9397.27257f, 9956.06348f,  // 120
+    10548.0818f, 11175.3034f, 11839.8215f, 12543.854f,  // 124
+};
+
+typedef struct {
+    float32 frequency[MIDI_NOTE_COUNT];
+} Tuning;
+
+const float32 *note_frequencies = equal_temperament;
+
+// Equal temperament around any reference pitch for A4
+void tuning_equal(Tuning *tuning, float32 a4) {
+    for (int32 note = 0; note < MIDI_NOTE_COUNT; note++) {
+        tuning->frequency[note] = a4 * exp2((note - NOTE_A4) / 12.0);
+    }
+}
+
+// Octave repeating scale. cents holds the offset of each pitch class from C
+// (0 for C, 100 for C# in equal temperament, ...) and the scale is placed so
+// that A4 sounds at a4.
+void tuning_scale(Tuning *tuning, float32 a4, const float32 cents[12]) {
+    float64 c4 = a4 / exp2(cents[9] / 1200.0);
+    for (int32 note = 0; note < MIDI_NOTE_COUNT; note++) {
+        int32 octave = note / 12 - 5; // Relative to octave 4
+        tuning->frequency[note] = c4 * exp2(octave + cents[note % 12] / 1200.0);
+    }
+}
+
+// Make the table used by note_frequency. The table must outlive its use.
+void set_tuning(const Tuning *tuning) {
+    note_frequencies = tuning ? tuning->frequency : equal_temperament;
+}
+
+float32 note_frequency(int32 note) {
+    if (note < 0 || note >= MIDI_NOTE_COUNT) return 0.0;
+    return note_frequencies[note];
+}
+
+// Parse a note name like "C4", "C#4", "Db4" or "Bb-1" into a note number.
+// Returns -1 if the name isn't a note in the MIDI range.
+int32 parse_note_name(const char *name) {
+    // Semitones above C for A to G
+    local_persist const int32 letter_semitones[7] = {9, 11, 0, 2, 4, 5, 7};
+
+    char letter = *name++;
+    if (letter >= 'a' && letter <= 'g') letter -= 'a' - 'A';
+    if (letter < 'A' || letter > 'G') return -1;
+    int32 semitone = letter_semitones[letter - 'A'];
+
+    for (; *name == '#' || *name == 'b'; name++) {
+        semitone += (*name == '#') ? 1 : -1;
+    }
+
+    int32 sign = 1;
+    if (*name == '-') {
+        sign = -1;
+        name++;
+    }
+    if (*name < '0' || *name > '9') return -1;
+    int32 octave = 0;
+    for (; *name >= '0' && *name <= '9'; name++) {
+        octave = 10 * octave + (*name - '0');
+    }
+    if (*name != '\0') return -1;
+
+    int32 note = 12 * (sign * octave + 1) + semitone;
+    if (note < 0 || note >= MIDI_NOTE_COUNT) return -1;
+    return note;
+}
+
+// Frequency of a named note in the active tuning, 0 for an unknown name
 float32 get_frequency(char *note) {
-    if (strcmp(note, "C0") == 0) return 16.35;
-    else if (strcmp(note, "C#0")  == 0 || strcmp(note, "Db0") == 0) return 17.32;
-    else if (strcmp(note, "D0") == 0) return 18.35;
-    else if (strcmp(note, "D#0")  == 0 || strcmp(note, "Eb0") == 0) return 19.45;
-    else if (strcmp(note, "E0") == 0) return 20.60;
-    else if (strcmp(note, "F0") == 0) return 21.83;
-    else if (strcmp(note, "F#0")  == 0 || strcmp(note, "Gb0") == 0) return 23.12;
-    else if (strcmp(note, "G0") == 0) return 24.50;
-    else if (strcmp(note, "G#0")  == 0 || strcmp(note, "Ab0") == 0) return 25.96;
-    else if (strcmp(note, "A0") == 0) return 27.50;
-    else if (strcmp(note, "A#0")  == 0 || strcmp(note, "Bb0") == 0) return 29.14;
-    else if (strcmp(note, "B0") == 0) return 30.87;
-    else if (strcmp(note, "C1") == 0) return 32.70;
-    else if (strcmp(note, "C#1")  == 0 || strcmp(note, "Db1") == 0) return 34.65;
-    else if (strcmp(note, "D1") == 0) return 36.71;
-    else if (strcmp(note, "D#1")  == 0 || strcmp(note, "Eb1") == 0) return 38.89;
-    else if (strcmp(note, "E1") == 0) return 41.20;
-    else if (strcmp(note, "F1") == 0) return 43.65;
-    else if (strcmp(note, "F#1")  == 0 || strcmp(note, "Gb1") == 0) return 46.25;
-    else if (strcmp(note, "G1") == 0) return 49.00;
-    else if (strcmp(note, "G#1")  == 0 || strcmp(note, "Ab1") == 0) return 51.91;
-    else if (strcmp(note, "A1") == 0) return 55.00;
-    else if (strcmp(note, "A#1")  == 0 || strcmp(note, "Bb1") == 0) return 58.27;
-    else if (strcmp(note, "B1") == 0) return 61.74;
-    else if (strcmp(note, "C2") == 0) return 65.41;
-    else if (strcmp(note, "C#2")  == 0 || strcmp(note, "Db2") == 0) return 69.30;
-    else if (strcmp(note, "D2") == 0) return 73.42;
-    else if (strcmp(note, "D#2")  == 0 || strcmp(note, "Eb2") == 0) return 77.78;
-    else if (strcmp(note, "E2") == 0) return 82.41;
-    else if (strcmp(note, "F2") == 0) return 87.31;
-    else if (strcmp(note, "F#2")  == 0 || strcmp(note, "Gb2") == 0) return 92.50;
-    else if (strcmp(note, "G2") == 0) return 98.00;
-    else if (strcmp(note, "G#2")  == 0 || strcmp(note, "Ab2") == 0) return 103.83;
-    else if (strcmp(note, "A2") == 0) return 110.00;
-    else if (strcmp(note, "A#2")  == 0 || strcmp(note, "Bb2") == 0) return 116.54;
-    else if (strcmp(note, "B2") == 0) return 123.47;
-    else if (strcmp(note, "C3") == 0) return 130.81;
-    else if (strcmp(note, "C#3")  == 0 || strcmp(note, "Db3") == 0) return 138.59;
-    else if (strcmp(note, "D3") == 0) return 146.83;
-    else if (strcmp(note, "D#3")  == 0 || strcmp(note, "Eb3") == 0) return 155.56;
-    else if (strcmp(note, "E3") == 0) return 164.81;
-    else if (strcmp(note, "F3") == 0) return 174.61;
-    else if (strcmp(note, "F#3")  == 0 || strcmp(note, "Gb3") == 0) return 185.00;
-    else if (strcmp(note, "G3") == 0) return 196.00;
-    else if (strcmp(note, "G#3")  == 0 || strcmp(note, "Ab3") == 0) return 207.65;
-    else if (strcmp(note, "A3") == 0) return 220.00;
-    else if (strcmp(note, "A#3")  == 0 || strcmp(note, "Bb3") == 0) return 233.08;
-    else if (strcmp(note, "B3") == 0) return 246.94;
-    else if (strcmp(note, "C4") == 0) return 261.63;
-    else if (strcmp(note, "C#4")  == 0 || strcmp(note, "Db4") == 0) return 277.18;
-    else if (strcmp(note, "D4") == 0) return 293.66;
-    else if (strcmp(note, "D#4")  == 0 || strcmp(note, "Eb4") == 0) return 311.13;
-    else if (strcmp(note, "E4") == 0) return 329.63;
-    else if (strcmp(note, "F4") == 0) return 349.23;
-    else if (strcmp(note, "F#4")  == 0 || strcmp(note, "Gb4") == 0) return 369.99;
-    else if (strcmp(note, "G4") == 0) return 392.00;
-    else if (strcmp(note, "G#4")  == 0 || strcmp(note, "Ab4") == 0) return 415.30;
-    else if (strcmp(note, "A4") == 0) return 440.00;
-    else if (strcmp(note, "A#4")  == 0 || strcmp(note, "Bb4") == 0) return 466.16;
-    else if (strcmp(note, "B4") == 0) return 493.88;
-    else if (strcmp(note, "C5") == 0) return 523.25;
-    else if (strcmp(note, "C#5")  == 0 || strcmp(note, "Db5") == 0) return 554.37;
-    else if (strcmp(note, "D5") == 0) return 587.33;
-    else if (strcmp(note, "D#5")  == 0 || strcmp(note, "Eb5") == 0) return 622.25;
-    else if (strcmp(note, "E5") == 0) return 659.25;
-    else if (strcmp(note, "F5") == 0) return 698.46;
-    else if (strcmp(note, "F#5")  == 0 || strcmp(note, "Gb5") == 0) return 739.99;
-    else if (strcmp(note, "G5") == 0) return 783.99;
-    else if (strcmp(note, "G#5")  == 0 || strcmp(note, "Ab5") == 0) return 830.61;
-    else if (strcmp(note, "A5") == 0) return 880.00;
-    else if (strcmp(note, "A#5")  == 0 || strcmp(note, "Bb5") == 0) return 932.33;
-    else if (strcmp(note, "B5") == 0) return 987.77;
-    else if (strcmp(note, "C6") == 0) return 1046.50;
-    else if (strcmp(note, "C#6")  == 0 || strcmp(note, "Db6") == 0) return 1108.73;
-    else if (strcmp(note, "D6") == 0) return 1174.66;
-    else if (strcmp(note, "D#6")  == 0 || strcmp(note, "Eb6") == 0) return 1244.51;
-    else if (strcmp(note, "E6") == 0) return 1318.51;
-    else if (strcmp(note, "F6") == 0) return 1396.91;
-    else if (strcmp(note, "F#6")  == 0 || strcmp(note, "Gb6") == 0) return 1479.98;
-    else if (strcmp(note, "G6") == 0) return 1567.98;
-    else if (strcmp(note, "G#6")  == 0 || strcmp(note, "Ab6") == 0) return 1661.22;
-    else if (strcmp(note, "A6") == 0) return 1760.00;
-    else if (strcmp(note, "A#6")  == 0 || strcmp(note, "Bb6") == 0) return 1864.66;
-    else if (strcmp(note, "B6") == 0) return 1975.53;
-    else if (strcmp(note, "C7") == 0) return 2093.00;
-    else if (strcmp(note, "C#7")  == 0 || strcmp(note, "Db7") == 0) return 2217.46;
-    else if (strcmp(note, "D7") == 0) return 2349.32;
-    else if (strcmp(note, "D#7")  == 0 || strcmp(note, "Eb7") == 0) return 2489.02;
-    else if (strcmp(note, "E7") == 0) return 2637.02;
-    else if (strcmp(note, "F7") == 0) return 2793.83;
-    else if (strcmp(note, "F#7")  == 0 || strcmp(note, "Gb7") == 0) return 2959.96;
-    else if (strcmp(note, "G7") == 0) return 3135.96;
-    else if (strcmp(note, "G#7")  == 0 || strcmp(note, "Ab7") == 0) return 3322.44;
-    else if (strcmp(note, "A7") == 0) return 3520.00;
-    else if (strcmp(note, "A#7")  == 0 || strcmp(note, "Bb7") == 0) return 3729.31;
-    else if (strcmp(note, "B7") == 0) return 3951.07;
-    else if (strcmp(note, "C8") == 0) return 4186.01;
-    else if (strcmp(note, "C#8")  == 0 || strcmp(note, "Db8") == 0) return 4434.92;
-    else if (strcmp(note, "D8") == 0) return 4698.63;
-    else if (strcmp(note, "D#8")  == 0 || strcmp(note, "Eb8") == 0) return 4978.03;
-    else if (strcmp(note, "E8") == 0) return 5274.04;
-    else if (strcmp(note, "F8") == 0) return 5587.65;
-    else if (strcmp(note, "F#8")  == 0 || strcmp(note, "Gb8") == 0) return 5919.91;
-    else if (strcmp(note, "G8") == 0) return 6271.93;
-    else if (strcmp(note, "G#8")  == 0 || strcmp(note, "Ab8") == 0) return 6644.88;
-    else if (strcmp(note, "A8") == 0) return 7040.00;
-    else if (strcmp(note, "A#8")  == 0 || strcmp(note, "Bb8") == 0) return 7458.62;
-    else if (strcmp(note, "B8") == 0) return 7902.13;
-    else return 0.0;
+    return note_frequency(parse_note_name(note));
 }
 
 #endif
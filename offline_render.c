@@ -0,0 +1,339 @@
+#define _GNU_SOURCE // pthread_setaffinity_np in workers.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "platform.h"
+#include "arena.h"
+#include "notes.h"
+#include "engine.h"
+#include "output.h"
+#include "wav.h"
+
+// Headless entry point: drives the same engine as sdl_platform.c in a tight
+// loop and streams the result to a WAV file. No audio device or display is
+// needed, so it runs on build machines and measures the DSP without the
+// sound card's clock in the way.
+//
+// Usage: offline_render.out [-o out.wav] [-r rate] [-d seconds] [-w sin|tri|squ|saw]
+//                           [-b block_frames] [-f lp|hp|bp|blp|bhp|bbp] [-c cutoff] [-q resonance]
+//                           [-p default|stack] [-t threads] [-s sample.wav] [-k root_note]
+//                           [--reverb ir.wav|seconds] [--reverb-send gain]
+//                           [--delay seconds] [--delay-feedback gain] [--delay-send gain]
+//                           [--output-rate rate] [--resampler low|medium|high]
+//                           [--float] [--dither] [note:start:length ...]
+// Notes are names from notes.h with start and length in seconds, for example
+// C4:0:1 E4:0.5:1. With no notes a C major chord is held for the whole render.
+// -f picks a state variable filter (lp, hp, bp) or biquad (blp, bhp, bbp).
+// -p picks the voice patch, see patch.h. -t adds worker threads; the output is identical for any thread count.
+// -s plays a WAV file instead of the oscillator, recorded at the note given by -k (C4 by default), see sampler.h.
+// --reverb convolves with an impulse response file, or a generated one that many seconds long, and
+// --delay adds an echo, each with a send of 0.3 unless given; see effects.h.
+// --output-rate writes the file at another rate than the engine's -r, through resampler.h, like a
+// device running at its own rate. --resampler sets the quality of that and of sample playback.
+
+#define CHANNELS 2
+#define BLOCK_FRAMES 512
+#define MAX_BLOCK_FRAMES 4096
+#define MAX_EVENTS 4096
+
+float32 tone_volume = 0.15f;
+
+float64 get_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+int compare_commands(const void *a, const void *b) {
+    uint64 time_a = ((Command *) a)->time;
+    uint64 time_b = ((Command *) b)->time;
+    return (time_a > time_b) - (time_a < time_b);
+}
+
+// Parse "C4:0.5:1" into a note on and a note off. Returns false if the note
+// name is unknown or the fields are missing.
+bool32 parse_note(char *arg, int32 note, float32 sample_rate, Command *on, Command *off) {
+    char name[8];
+    float32 start, length;
+    if (sscanf(arg, "%7[^:]:%f:%f", name, &start, &length) != 3) return 0;
+
+    int32 note_number = parse_note_name(name);
+    if (note_number < 0) return 0;
+
+    memset(on, 0, sizeof(*on));
+    on->type = COMMAND_NOTE_ON;
+    on->note = note;
+    on->value = note_frequency(note_number);
+    on->time = (uint64) (start * sample_rate);
+
+    memset(off, 0, sizeof(*off));
+    off->type = COMMAND_NOTE_OFF;
+    off->note = note;
+    off->time = (uint64) ((start + length) * sample_rate);
+    return 1;
+}
+
+int32 main(int32 argc, char* argv[]) {
+    char *output_path = "render.wav";
+    float32 sample_rate = 44100.0f;
+    float32 seconds = 4.0f;
+    int32 block_frames = BLOCK_FRAMES;
+    int32 wav_format = WAV_FORMAT_PCM;
+    OutputFormat output_format = OUTPUT_S16;
+    bool32 dithered = 0;
+    WaveType wave_type = SIN;
+    FilterType filter_type = FILTER_NONE;
+    float32 cutoff = 0.0f;
+    float32 resonance = 0.0f;
+    int32 thread_count = 0;
+    bool32 stack = 0;
+    char *sample_path = NULL;
+    char *root_note = "C4";
+    char *reverb = NULL;
+    float32 reverb_send = 0.3f;
+    float32 delay_seconds = 0.0f;
+    float32 delay_feedback = 0.4f;
+    float32 delay_send = 0.3f;
+    float32 output_rate = 0.0f;
+    ResampleQuality resample_quality = RESAMPLE_MEDIUM;
+
+    static Command events[MAX_EVENTS];
+    int32 event_count = 0;
+
+    for (int32 arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc) {
+            output_path = argv[++arg];
+        } else if (strcmp(argv[arg], "-r") == 0 && arg + 1 < argc) {
+            sample_rate = atof(argv[++arg]);
+        } else if (strcmp(argv[arg], "-d") == 0 && arg + 1 < argc) {
+            seconds = atof(argv[++arg]);
+        } else if (strcmp(argv[arg], "-b") == 0 && arg + 1 < argc) {
+            block_frames = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--float") == 0) {
+            wav_format = WAV_FORMAT_FLOAT;
+            output_format = OUTPUT_F32;
+        } else if (strcmp(argv[arg], "--dither") == 0) {
+            dithered = 1;
+        } else if (strcmp(argv[arg], "-w") == 0 && arg + 1 < argc) {
+            char *name = argv[++arg];
+            if (strcmp(name, "tri") == 0) wave_type = TRI;
+            else if (strcmp(name, "squ") == 0) wave_type = SQU;
+            else if (strcmp(name, "saw") == 0) wave_type = SAW;
+            else wave_type = SIN;
+        } else if (strcmp(argv[arg], "-f") == 0 && arg + 1 < argc) {
+            char *names[FILTER_TYPE_COUNT] = {"none", "lp", "hp", "bp", "blp", "bhp", "bbp"};
+            char *name = argv[++arg];
+            for (int32 type = 0; type < FILTER_TYPE_COUNT; type++) {
+                if (strcmp(name, names[type]) == 0) filter_type = (FilterType) type;
+            }
+        } else if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc) {
+            cutoff = atof(argv[++arg]);
+        } else if (strcmp(argv[arg], "-q") == 0 && arg + 1 < argc) {
+            resonance = atof(argv[++arg]);
+        } else if (strcmp(argv[arg], "-p") == 0 && arg + 1 < argc) {
+            stack = strcmp(argv[++arg], "stack") == 0;
+        } else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc) {
+            thread_count = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "-s") == 0 && arg + 1 < argc) {
+            sample_path = argv[++arg];
+        } else if (strcmp(argv[arg], "-k") == 0 && arg + 1 < argc) {
+            root_note = argv[++arg];
+        } else if (strcmp(argv[arg], "--reverb") == 0 && arg + 1 < argc) {
+            reverb = argv[++arg];
+        } else if (strcmp(argv[arg], "--reverb-send") == 0 && arg + 1 < argc) {
+            reverb_send = atof(argv[++arg]);
+        } else if (strcmp(argv[arg], "--delay") == 0 && arg + 1 < argc) {
+            delay_seconds = atof(argv[++arg]);
+        } else if (strcmp(argv[arg], "--delay-feedback") == 0 && arg + 1 < argc) {
+            delay_feedback = atof(argv[++arg]);
+        } else if (strcmp(argv[arg], "--delay-send") == 0 && arg + 1 < argc) {
+            delay_send = atof(argv[++arg]);
+        } else if (strcmp(argv[arg], "--output-rate") == 0 && arg + 1 < argc) {
+            output_rate = atof(argv[++arg]);
+        } else if (strcmp(argv[arg], "--resampler") == 0 && arg + 1 < argc) {
+            if (!resample_quality_from_name(argv[++arg], &resample_quality)) {
+                printf("Unknown resampler quality '%s', expected low, medium or high\n", argv[arg]);
+                return 1;
+            }
+        } else if (event_count + 2 <= MAX_EVENTS) {
+            int32 note = event_count / 2;
+            if (!parse_note(argv[arg], note, sample_rate, &events[event_count], &events[event_count + 1])) {
+                printf("Bad note '%s', expected name:start:length\n", argv[arg]);
+                return 1;
+            }
+            event_count += 2;
+        }
+    }
+    if (block_frames < 1 || block_frames > MAX_BLOCK_FRAMES) {
+        printf("Block size must be between 1 and %d frames\n", MAX_BLOCK_FRAMES);
+        return 1;
+    }
+    if (parse_note_name(root_note) < 0) {
+        printf("Bad root note '%s'\n", root_note);
+        return 1;
+    }
+
+    if (event_count == 0) {
+        char *chord[] = {"C4", "E4", "G4"};
+        for (int32 note = 0; note < (int32) array_count(chord); note++) {
+            char arg[32];
+            snprintf(arg, sizeof(arg), "%s:0:%f", chord[note], seconds);
+            parse_note(arg, note, sample_rate, &events[event_count], &events[event_count + 1]);
+            event_count += 2;
+        }
+    }
+    // Every note has its own id, so the order of events on the same frame
+    // doesn't matter
+    qsort(events, event_count, sizeof(Command), compare_commands);
+
+    wavetable_init();
+    oscillator_simd_init();
+    resample_tables_init();
+
+    void *engine_memory = reserve_memory(ENGINE_MEMORY_SIZE);
+    if (!engine_memory) {
+        printf("Could not reserve %d bytes for the engine\n", ENGINE_MEMORY_SIZE);
+        return 1;
+    }
+    MemoryArena arena;
+    arena_init(&arena, engine_memory, ENGINE_MEMORY_SIZE);
+
+    Engine *engine = arena_push_struct(&arena, Engine);
+    engine_init(engine, &arena, sample_rate, block_frames);
+    engine->volume = tone_volume;
+    engine->wave_type = wave_type;
+    engine->voices.sample_quality = resample_quality;
+    if (stack) {
+        Patch patch;
+        patch_stack(&patch);
+        engine_load_patch(engine, &patch);
+        engine_take_program(engine);
+    }
+    if (sample_path) {
+        Sample *sample;
+        const char *error = sample_load(engine->sample_bank, sample_path,
+                                        note_frequency(parse_note_name(root_note)), &sample);
+        if (error) {
+            printf("Could not load %s: %s\n", sample_path, error);
+            return 1;
+        }
+        Patch patch;
+        patch_sampler_voice(&patch, sample);
+        engine_load_patch(engine, &patch);
+        engine_take_program(engine);
+    }
+    FilterSettings *filter = &engine->voices.filters[0];
+    if (filter_type != FILTER_NONE || !stack) engine_set_parameter(engine, PARAMETER_FILTER_TYPE, filter_type);
+    if (cutoff > 0) filter->cutoff = filter->smoothed_cutoff = cutoff;
+    if (resonance > 0) filter->resonance = filter->smoothed_resonance = resonance;
+
+    if (reverb) {
+        char *end;
+        float32 reverb_seconds = strtof(reverb, &end);
+        if (*end == 0 && reverb_seconds > 0) {
+            reverb_generate(&engine->effects->reverb, reverb_seconds, sample_rate);
+        } else {
+            const char *error = reverb_load_file(&engine->effects->reverb, reverb);
+            if (error) {
+                printf("Could not load %s: %s\n", reverb, error);
+                return 1;
+            }
+        }
+        engine_set_parameter(engine, PARAMETER_REVERB_SEND, reverb_send);
+    }
+    if (delay_seconds > 0) {
+        engine_set_parameter(engine, PARAMETER_DELAY_TIME, delay_seconds);
+        engine->effects->delay.smoothed_time = engine->effects->delay.time; // No glide from the default
+        engine_set_parameter(engine, PARAMETER_DELAY_FEEDBACK, delay_feedback);
+        engine_set_parameter(engine, PARAMETER_DELAY_SEND, delay_send);
+    }
+
+    WorkerPool *workers = NULL;
+    if (thread_count > 0) {
+        workers = arena_push_struct(&arena, WorkerPool);
+        worker_pool_start(workers, thread_count);
+        engine->workers = workers;
+    }
+
+    float32 *mix_bus = arena_push_array(&arena, float32, MAX_BLOCK_FRAMES);
+    float32 *output = arena_push_array(&arena, float32, MAX_BLOCK_FRAMES * CHANNELS);
+
+    // Engine rate to file rate, when they differ
+    if (output_rate <= 0) output_rate = sample_rate;
+    Resampler *resampler = NULL;
+    float32 *resampled = NULL;
+    if (output_rate != sample_rate) {
+        resampler = arena_push_struct(&arena, Resampler);
+        resampler_init(resampler, sample_rate, output_rate, resample_quality);
+        resampled = arena_push_array(&arena, float32, MAX_BLOCK_FRAMES);
+    }
+
+    Dither dither;
+    dither_init(&dither, dithered);
+
+    WavWriter wav;
+    if (!wav_open(&wav, output_path, wav_format, CHANNELS, output_rate)) {
+        printf("Could not open %s for writing\n", output_path);
+        return 1;
+    }
+
+    // Counted in file frames, block_frames of them at a time like a device
+    uint64 total_frames = (uint64) (seconds * output_rate);
+    uint64 written_frames = 0;
+    int32 next_event = 0;
+    float64 render_seconds = 0;
+    float64 start = get_seconds();
+
+    while (written_frames < total_frames) {
+        int32 frames = block_frames;
+        if (total_frames - written_frames < (uint64) frames) {
+            frames = (int32) (total_frames - written_frames);
+        }
+        int32 engine_frames = frames;
+        if (resampler) {
+            int32 most = resampler_max_output(resampler, MAX_BLOCK_FRAMES);
+            if (frames > most) frames = most;
+            engine_frames = resampler_input_needed(resampler, frames);
+        }
+
+        // Feed the queue with everything due in this block. Anything that
+        // doesn't fit waits for the next one, the queue keeps it in order.
+        uint64 block_end = engine->sample_clock + engine_frames;
+        while (next_event < event_count && events[next_event].time < block_end) {
+            if (!engine_send(engine, events[next_event])) break;
+            next_event++;
+        }
+
+        // Stands in for the prefetch thread, so streams never run dry here
+        sample_bank_update(engine->sample_bank);
+
+        // Same rules as the real-time callback: no heap use while rendering
+        float64 block_start = get_seconds();
+        audio_thread_begin();
+        engine_render(engine, mix_bus, engine_frames);
+        float32 *bus = mix_bus;
+        if (resampler) {
+            resampler_process(resampler, mix_bus, engine_frames, resampled, frames);
+            bus = resampled;
+        }
+        write_output(output, output_format, bus, frames, CHANNELS, &dither);
+        audio_thread_end();
+        render_seconds += get_seconds() - block_start;
+
+        wav_write(&wav, output, frames);
+        written_frames += frames;
+    }
+    wav_close(&wav, output_rate);
+    if (workers) worker_pool_stop(workers);
+    uint32 underruns = atomic_load(&engine->sample_bank->underruns);
+    free(engine_memory);
+
+    float64 elapsed = get_seconds() - start;
+    float64 audio_seconds = total_frames / output_rate;
+    printf("Rendered %.2f s of audio to %s in %.3f s\n", audio_seconds, output_path, elapsed);
+    printf("Speed: %.1fx real time overall, %.1fx real time for rendering alone\n",
+           audio_seconds / elapsed, audio_seconds / render_seconds);
+    if (underruns) printf("Sample streams ran dry for %u frames\n", underruns);
+    return 0;
+}
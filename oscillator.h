@@ -0,0 +1,167 @@
+#if !defined(OSCILLATOR_H)
+#define OSCILLATOR_H
+
+#include <math.h>
+#include "platform.h"
+
+// Oscillator phase is a 32 bit fixed-point fraction of a cycle: 0 is the
+// start of the cycle and the accumulator wraps by unsigned overflow, so the
+// pitch never drifts no matter how long a voice plays.
+#define PHASE_TO_FLOAT (1.0f / 4294967296.0f)
+
+#define WAVETABLE_BITS 11
+#define WAVETABLE_SIZE (1 << WAVETABLE_BITS)
+#define WAVETABLE_FRACTION_BITS (32 - WAVETABLE_BITS)
+#define WAVETABLE_FRACTION_MASK ((1u << WAVETABLE_FRACTION_BITS) - 1)
+#define WAVETABLE_FRACTION_SCALE (1.0f / (float32) (1u << WAVETABLE_FRACTION_BITS))
+
+typedef enum WaveType {SIN, TRI, SQU, SAW, WAVE_TYPE_COUNT} WaveType;
+
+// One cycle of each wave type, plus a guard point equal to the first sample
+// so interpolation never has to wrap the index.
+float32 wavetables[WAVE_TYPE_COUNT][WAVETABLE_SIZE + 1];
+
+void wavetable_init(void) {
+    for (int32 index = 0; index <= WAVETABLE_SIZE; index++) {
+        float32 x = (float32) (index % WAVETABLE_SIZE) / WAVETABLE_SIZE;
+        wavetables[SIN][index] = sinf(TWO_PI * x);
+        wavetables[TRI][index] = 1.0f - 4.0f * fabsf(x - 0.5f);
+        wavetables[SQU][index] = (x < 0.5f) ? 1.0f : -1.0f;
+        wavetables[SAW][index] = 2.0f * x - 1.0f;
+    }
+}
+
+uint32 phase_increment(float32 frequency, float32 sample_rate) {
+    return (uint32) ((float64) frequency / sample_rate * 4294967296.0 + 0.5);
+}
+
+// Add one voice into the mix bus by reading its table with linear
+// interpolation. Every wave type goes through this same loop; only the table
+// pointer differs. Returns the advanced phase.
+uint32 generate_wavetable(const float32 *table, uint32 phase, uint32 increment, float32 amplitude,
+                          float32 *mix_bus, int32 total_samples) {
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        uint32 index = phase >> WAVETABLE_FRACTION_BITS;
+        float32 fraction = (phase & WAVETABLE_FRACTION_MASK) * WAVETABLE_FRACTION_SCALE;
+        float32 a = table[index];
+        float32 b = table[index + 1];
+        mix_bus[sample_index] += amplitude * (a + fraction * (b - a));
+        phase += increment;
+    }
+    return phase;
+}
+
+// Direct evaluation of each wave type. These are the reference the table and
+// vector paths are measured against.
+
+uint32 generate_sine(uint32 phase, uint32 increment, float32 amplitude,
+                     float32 *mix_bus, int32 total_samples) {
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        mix_bus[sample_index] += amplitude * sinf(TWO_PI * (phase * PHASE_TO_FLOAT));
+        phase += increment;
+    }
+    return phase;
+}
+
+uint32 generate_triangle(uint32 phase, uint32 increment, float32 amplitude,
+                         float32 *mix_bus, int32 total_samples) {
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        float32 x = phase * PHASE_TO_FLOAT;
+        mix_bus[sample_index] += amplitude * (1.0f - 4.0f * fabsf(x - 0.5f));
+        phase += increment;
+    }
+    return phase;
+}
+
+uint32 generate_sawtooth(uint32 phase, uint32 increment, float32 amplitude,
+                         float32 *mix_bus, int32 total_samples) {
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        float32 x = phase * PHASE_TO_FLOAT;
+        mix_bus[sample_index] += amplitude * (2.0f * x - 1.0f);
+        phase += increment;
+    }
+    return phase;
+}
+
+uint32 generate_square(uint32 phase, uint32 increment, float32 amplitude,
+                       float32 *mix_bus, int32 total_samples) {
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        mix_bus[sample_index] += (phase < 0x80000000u) ? amplitude : -amplitude;
+        phase += increment;
+    }
+    return phase;
+}
+
+// Band-limited triangle, square and sawtooth. The naive shapes jump (or bend,
+// for the triangle) between two samples, and everything above Nyquist in that
+// jump folds back down as inharmonic whistles on high notes. Here the samples
+// within one sample of a jump get a polynomial residual (polyBLEP), placed by
+// the fractional phase, and the triangle's corners get its integral
+// (polyBLAMP). That costs a few multiplies per sample and needs no state, so
+// it vectorizes the same way as the naive shapes.
+//
+// Only the nearest jump is smoothed, so the residual is capped at a quarter
+// of a cycle either side. That is exact for notes below a quarter of the
+// sample rate; above it the fundamental is all there is below Nyquist anyway.
+
+float32 blep_inverse_dt(uint32 increment) {
+    if (increment > 0x40000000u) increment = 0x40000000u;
+    return 1.0f / ((increment ? increment : 1) * PHASE_TO_FLOAT);
+}
+
+// 1 at a jump, falling to 0 one sample away. distance is in cycles.
+float32 blep_residual(float32 distance, float32 inverse_dt) {
+    float32 residual = 1.0f - distance * inverse_dt;
+    return (residual > 0.0f) ? residual : 0.0f;
+}
+
+// Distance in cycles to the nearest multiple of half a cycle
+float32 half_cycle_distance(float32 x) {
+    float32 offset = (x < 0.5f) ? x : x - 0.5f;
+    return (offset < 0.25f) ? offset : 0.5f - offset;
+}
+
+uint32 generate_triangle_blep(uint32 phase, uint32 increment, float32 amplitude,
+                              float32 *mix_bus, int32 total_samples) {
+    float32 inverse_dt = blep_inverse_dt(increment);
+    float32 bend = 8.0f / 6.0f * increment * PHASE_TO_FLOAT; // Slope change per sample at a corner, over 6
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        float32 x = phase * PHASE_TO_FLOAT;
+        float32 value = 1.0f - 4.0f * fabsf(x - 0.5f);
+        float32 residual = blep_residual(half_cycle_distance(x), inverse_dt);
+        float32 corner = bend * residual * residual * residual;
+        value += (value < 0.0f) ? corner : -corner;
+        mix_bus[sample_index] += amplitude * value;
+        phase += increment;
+    }
+    return phase;
+}
+
+uint32 generate_sawtooth_blep(uint32 phase, uint32 increment, float32 amplitude,
+                              float32 *mix_bus, int32 total_samples) {
+    float32 inverse_dt = blep_inverse_dt(increment);
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        float32 x = phase * PHASE_TO_FLOAT;
+        float32 value = 2.0f * x - 1.0f;
+        float32 residual = blep_residual((x < 0.5f) ? x : 1.0f - x, inverse_dt);
+        value += (x < 0.5f) ? residual * residual : -residual * residual;
+        mix_bus[sample_index] += amplitude * value;
+        phase += increment;
+    }
+    return phase;
+}
+
+uint32 generate_square_blep(uint32 phase, uint32 increment, float32 amplitude,
+                            float32 *mix_bus, int32 total_samples) {
+    float32 inverse_dt = blep_inverse_dt(increment);
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        float32 x = phase * PHASE_TO_FLOAT;
+        float32 residual = blep_residual(half_cycle_distance(x), inverse_dt);
+        float32 value = (phase < 0x80000000u) ? 1.0f : -1.0f;
+        mix_bus[sample_index] += amplitude * value * (1.0f - residual * residual);
+        phase += increment;
+    }
+    return phase;
+}
+
+#endif
@@ -0,0 +1,373 @@
+#if !defined(OSCILLATOR_SIMD_H)
+#define OSCILLATOR_SIMD_H
+
+#include "platform.h"
+#include "oscillator.h"
+
+// Vector versions of the generate_* functions. Each one renders 4 (SSE2) or 8
+// (AVX2) samples per iteration: the fixed-point phase for every lane is kept
+// in an integer register, converted to a float in [0, 1) and shaped in float.
+// The ISA is picked at runtime by oscillator_simd_init, so the binary doesn't
+// need to be built with -mavx2.
+
+typedef uint32 GenerateFunction(uint32 phase, uint32 increment, float32 amplitude,
+                                float32 *mix_bus, int32 total_samples);
+
+// Odd polynomial for sin(2*pi*t) with t in [-0.25, 0.25] (Taylor to t^11,
+// error below 1e-7).
+#define SINE_C1  6.28318530718f
+#define SINE_C3 -41.3417022404f
+#define SINE_C5  81.6052492761f
+#define SINE_C7 -76.7058597531f
+#define SINE_C9  42.0586939449f
+#define SINE_C11 -15.0946425768f
+
+// Scalar fallback: the table oscillator, fixed to one wave type.
+uint32 generate_sine_table(uint32 phase, uint32 increment, float32 amplitude,
+                           float32 *mix_bus, int32 total_samples) {
+    return generate_wavetable(wavetables[SIN], phase, increment, amplitude, mix_bus, total_samples);
+}
+
+uint32 generate_triangle_table(uint32 phase, uint32 increment, float32 amplitude,
+                               float32 *mix_bus, int32 total_samples) {
+    return generate_wavetable(wavetables[TRI], phase, increment, amplitude, mix_bus, total_samples);
+}
+
+uint32 generate_square_table(uint32 phase, uint32 increment, float32 amplitude,
+                             float32 *mix_bus, int32 total_samples) {
+    return generate_wavetable(wavetables[SQU], phase, increment, amplitude, mix_bus, total_samples);
+}
+
+uint32 generate_sawtooth_table(uint32 phase, uint32 increment, float32 amplitude,
+                               float32 *mix_bus, int32 total_samples) {
+    return generate_wavetable(wavetables[SAW], phase, increment, amplitude, mix_bus, total_samples);
+}
+
+// Voices play band-limited triangle, square and sawtooth, see
+// generate_*_blep in oscillator.h. The naive kernels stay for comparison.
+GenerateFunction *generators[WAVE_TYPE_COUNT] = {
+    generate_sine_table, generate_triangle_blep, generate_square_blep, generate_sawtooth_blep,
+};
+const char *oscillator_path = "scalar";
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define SIMD_SSE2 __attribute__((target("sse2")))
+#define SIMD_AVX2 __attribute__((target("avx2,fma")))
+
+#define BLEP_NEAR_MARGIN 1 // Increments past a vector's lanes that still count as near a jump
+
+//
+// SSE2, 4 samples per iteration
+//
+
+// Top 24 bits of the phase, scaled to [0, 1)
+SIMD_SSE2 static inline __m128 phase_to_unit_sse2(__m128i phases) {
+    __m128i top = _mm_srli_epi32(phases, 8);
+    return _mm_mul_ps(_mm_cvtepi32_ps(top), _mm_set1_ps(1.0f / 16777216.0f));
+}
+
+SIMD_SSE2 static inline __m128 sine_sse2(__m128 x) {
+    // sin(2*pi*x) = -sin(2*pi*t) with t = x - 0.5 in [-0.5, 0.5). Fold t into
+    // [-0.25, 0.25] using sin(pi - a) = sin(a), keeping the sign.
+    __m128 sign_mask = _mm_set1_ps(-0.0f);
+    __m128 t = _mm_sub_ps(x, _mm_set1_ps(0.5f));
+    __m128 sign = _mm_and_ps(t, sign_mask);
+    __m128 a = _mm_andnot_ps(sign_mask, t);
+    __m128 u = _mm_or_ps(_mm_min_ps(a, _mm_sub_ps(_mm_set1_ps(0.5f), a)), sign);
+
+    __m128 u2 = _mm_mul_ps(u, u);
+    __m128 p = _mm_set1_ps(SINE_C11);
+    p = _mm_add_ps(_mm_mul_ps(p, u2), _mm_set1_ps(SINE_C9));
+    p = _mm_add_ps(_mm_mul_ps(p, u2), _mm_set1_ps(SINE_C7));
+    p = _mm_add_ps(_mm_mul_ps(p, u2), _mm_set1_ps(SINE_C5));
+    p = _mm_add_ps(_mm_mul_ps(p, u2), _mm_set1_ps(SINE_C3));
+    p = _mm_add_ps(_mm_mul_ps(p, u2), _mm_set1_ps(SINE_C1));
+    return _mm_xor_ps(_mm_mul_ps(p, u), sign_mask);
+}
+
+SIMD_SSE2 static inline __m128 triangle_sse2(__m128 x) {
+    __m128 a = _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(x, _mm_set1_ps(0.5f)));
+    return _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(_mm_set1_ps(4.0f), a));
+}
+
+SIMD_SSE2 static inline __m128 sawtooth_sse2(__m128 x) {
+    return _mm_sub_ps(_mm_add_ps(x, x), _mm_set1_ps(1.0f));
+}
+
+SIMD_SSE2 static inline __m128 square_sse2(__m128 x) {
+    __m128 first_half = _mm_cmplt_ps(x, _mm_set1_ps(0.5f));
+    return _mm_or_ps(_mm_and_ps(first_half, _mm_set1_ps(1.0f)),
+                     _mm_andnot_ps(first_half, _mm_set1_ps(-1.0f)));
+}
+
+// The leftover samples at the end of a block go through the scalar reference
+#define DEFINE_GENERATE_SSE2(name, shape, reference)                                        \
+    SIMD_SSE2 uint32 name(uint32 phase, uint32 increment, float32 amplitude,               \
+                          float32 *mix_bus, int32 total_samples) {                         \
+        __m128i phases = _mm_setr_epi32(phase, phase + increment, phase + 2 * increment,   \
+                                        phase + 3 * increment);                            \
+        __m128i step = _mm_set1_epi32(4 * increment);                                      \
+        __m128 amp = _mm_set1_ps(amplitude);                                               \
+        int32 sample_index = 0;                                                            \
+        for (; sample_index + 4 <= total_samples; sample_index += 4) {                     \
+            float32 *out = mix_bus + sample_index;                                         \
+            __m128 value = _mm_mul_ps(amp, shape(phase_to_unit_sse2(phases)));             \
+            _mm_storeu_ps(out, _mm_add_ps(_mm_loadu_ps(out), value));                      \
+            phases = _mm_add_epi32(phases, step);                                          \
+        }                                                                                  \
+        phase += (uint32) sample_index * increment;                                        \
+        return reference(phase, increment, amplitude, mix_bus + sample_index,              \
+                         total_samples - sample_index);                                    \
+    }
+
+DEFINE_GENERATE_SSE2(generate_sine_sse2, sine_sse2, generate_sine)
+DEFINE_GENERATE_SSE2(generate_triangle_sse2, triangle_sse2, generate_triangle)
+DEFINE_GENERATE_SSE2(generate_square_sse2, square_sse2, generate_square)
+DEFINE_GENERATE_SSE2(generate_sawtooth_sse2, sawtooth_sse2, generate_sawtooth)
+
+// Band-limited shapes, see generate_*_blep in oscillator.h. Distance to the
+// nearest jump falls out of the naive shapes: it is linear in 1 - |saw| for
+// the sawtooth and 1 - |triangle| for the square and triangle, so the
+// residual is one multiply add from a value already computed. near_scale and
+// near_offset fold in the increment, see DEFINE_GENERATE_BLEP_SSE2. bend,
+// the triangle's slope change at a corner, is unused by the other shapes.
+
+SIMD_SSE2 static inline __m128 blep_residual_sse2(__m128 shape, __m128 near_scale, __m128 near_offset) {
+    __m128 magnitude = _mm_andnot_ps(_mm_set1_ps(-0.0f), shape);
+    return _mm_max_ps(_mm_add_ps(_mm_mul_ps(magnitude, near_scale), near_offset), _mm_setzero_ps());
+}
+
+SIMD_SSE2 static inline __m128 triangle_blep_sse2(__m128 x, __m128 near_scale, __m128 near_offset, __m128 bend) {
+    __m128 triangle = triangle_sse2(x);
+    __m128 residual = blep_residual_sse2(triangle, near_scale, near_offset);
+    __m128 corner = _mm_mul_ps(bend, _mm_mul_ps(_mm_mul_ps(residual, residual), residual));
+    // Up at the bottom corner, down at the top one
+    __m128 sign = _mm_and_ps(triangle, _mm_set1_ps(-0.0f));
+    return _mm_sub_ps(triangle, _mm_xor_ps(corner, sign));
+}
+
+SIMD_SSE2 static inline __m128 sawtooth_blep_sse2(__m128 x, __m128 near_scale, __m128 near_offset, __m128 bend) {
+    (void) bend;
+    __m128 sawtooth = sawtooth_sse2(x);
+    __m128 residual = blep_residual_sse2(sawtooth, near_scale, near_offset);
+    __m128 sign = _mm_and_ps(sawtooth, _mm_set1_ps(-0.0f));
+    return _mm_sub_ps(sawtooth, _mm_xor_ps(_mm_mul_ps(residual, residual), sign));
+}
+
+// The square is +1 where x - 0.5 is negative, so its sign is that of
+// x - 0.5 flipped: flip it into r^2 - 1 instead of multiplying by the square
+SIMD_SSE2 static inline __m128 square_blep_sse2(__m128 x, __m128 near_scale, __m128 near_offset, __m128 bend) {
+    (void) bend;
+    __m128 t = _mm_sub_ps(x, _mm_set1_ps(0.5f));
+    __m128 triangle = _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(_mm_set1_ps(4.0f), _mm_andnot_ps(_mm_set1_ps(-0.0f), t)));
+    __m128 residual = blep_residual_sse2(triangle, near_scale, near_offset);
+    return _mm_xor_ps(_mm_sub_ps(_mm_mul_ps(residual, residual), _mm_set1_ps(1.0f)), _mm_and_ps(t, _mm_set1_ps(-0.0f)));
+}
+
+// distance is 1 - |shape| times distance_scale cycles, so the residual
+// 1 - distance / dt is near_offset + near_scale * |shape|.
+//
+// The residual is zero except within one increment of a jump, a vector or
+// two per jump, so every other vector takes the naive shape. Whether one is
+// near a jump is a scalar test on its first lane's phase. The jumps are at
+// multiples of 2^32 >> edge_shift; shifting the phase left by edge_shift
+// puts them all at 0, and ahead is then the distance to the next one plus
+// an increment.
+#define DEFINE_GENERATE_BLEP_SSE2(name, shape, naive, distance_scale, edge_shift, reference) \
+    SIMD_SSE2 uint32 name(uint32 phase, uint32 increment, float32 amplitude,               \
+                          float32 *mix_bus, int32 total_samples) {                         \
+        __m128i phases = _mm_setr_epi32(phase, phase + increment, phase + 2 * increment,   \
+                                        phase + 3 * increment);                            \
+        __m128i step = _mm_set1_epi32(4 * increment);                                      \
+        __m128 amp = _mm_set1_ps(amplitude);                                               \
+        float32 near = (distance_scale) * blep_inverse_dt(increment);                      \
+        __m128 near_scale = _mm_set1_ps(near);                                             \
+        __m128 near_offset = _mm_set1_ps(1.0f - near);                                     \
+        __m128 bend = _mm_set1_ps(8.0f / 6.0f * increment * PHASE_TO_FLOAT);               \
+        uint32 edge_increment = increment << (edge_shift);                                 \
+        uint64 near_span = (uint64) (4 + BLEP_NEAR_MARGIN) * increment << (edge_shift);    \
+        uint32 lane_phase = phase;                                                         \
+        int32 sample_index = 0;                                                            \
+        for (; sample_index + 4 <= total_samples; sample_index += 4) {                     \
+            float32 *out = mix_bus + sample_index;                                         \
+            __m128 x = phase_to_unit_sse2(phases);                                         \
+            uint32 ahead = edge_increment - (lane_phase << (edge_shift));                  \
+            __m128 value = (ahead < near_span) ? shape(x, near_scale, near_offset, bend) : naive(x); \
+            _mm_storeu_ps(out, _mm_add_ps(_mm_loadu_ps(out), _mm_mul_ps(amp, value)));     \
+            phases = _mm_add_epi32(phases, step);                                          \
+            lane_phase += 4 * increment;                                                   \
+        }                                                                                  \
+        phase += (uint32) sample_index * increment;                                        \
+        return reference(phase, increment, amplitude, mix_bus + sample_index,              \
+                         total_samples - sample_index);                                    \
+    }
+
+DEFINE_GENERATE_BLEP_SSE2(generate_triangle_blep_sse2, triangle_blep_sse2, triangle_sse2, 0.25f, 1,
+                          generate_triangle_blep)
+DEFINE_GENERATE_BLEP_SSE2(generate_square_blep_sse2, square_blep_sse2, square_sse2, 0.25f, 1, generate_square_blep)
+DEFINE_GENERATE_BLEP_SSE2(generate_sawtooth_blep_sse2, sawtooth_blep_sse2, sawtooth_sse2, 0.5f, 0,
+                          generate_sawtooth_blep)
+
+//
+// AVX2, 8 samples per iteration
+//
+
+SIMD_AVX2 static inline __m256 phase_to_unit_avx2(__m256i phases) {
+    __m256i top = _mm256_srli_epi32(phases, 8);
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(top), _mm256_set1_ps(1.0f / 16777216.0f));
+}
+
+SIMD_AVX2 static inline __m256 sine_avx2(__m256 x) {
+    __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    __m256 t = _mm256_sub_ps(x, _mm256_set1_ps(0.5f));
+    __m256 sign = _mm256_and_ps(t, sign_mask);
+    __m256 a = _mm256_andnot_ps(sign_mask, t);
+    __m256 u = _mm256_or_ps(_mm256_min_ps(a, _mm256_sub_ps(_mm256_set1_ps(0.5f), a)), sign);
+
+    __m256 u2 = _mm256_mul_ps(u, u);
+    __m256 p = _mm256_set1_ps(SINE_C11);
+    p = _mm256_fmadd_ps(p, u2, _mm256_set1_ps(SINE_C9));
+    p = _mm256_fmadd_ps(p, u2, _mm256_set1_ps(SINE_C7));
+    p = _mm256_fmadd_ps(p, u2, _mm256_set1_ps(SINE_C5));
+    p = _mm256_fmadd_ps(p, u2, _mm256_set1_ps(SINE_C3));
+    p = _mm256_fmadd_ps(p, u2, _mm256_set1_ps(SINE_C1));
+    return _mm256_xor_ps(_mm256_mul_ps(p, u), sign_mask);
+}
+
+SIMD_AVX2 static inline __m256 triangle_avx2(__m256 x) {
+    __m256 a = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(x, _mm256_set1_ps(0.5f)));
+    return _mm256_fnmadd_ps(_mm256_set1_ps(4.0f), a, _mm256_set1_ps(1.0f));
+}
+
+SIMD_AVX2 static inline __m256 sawtooth_avx2(__m256 x) {
+    return _mm256_fmadd_ps(x, _mm256_set1_ps(2.0f), _mm256_set1_ps(-1.0f));
+}
+
+SIMD_AVX2 static inline __m256 square_avx2(__m256 x) {
+    __m256 first_half = _mm256_cmp_ps(x, _mm256_set1_ps(0.5f), _CMP_LT_OQ);
+    return _mm256_blendv_ps(_mm256_set1_ps(-1.0f), _mm256_set1_ps(1.0f), first_half);
+}
+
+// The leftovers go to the scalar reference, which is SSE code. gcc may tail
+// call it without clearing the upper halves of the ymm registers, and then
+// every SSE instruction after it, in the reference and in the caller, pays
+// for the dirty state. So the kernels clear them first.
+#define DEFINE_GENERATE_AVX2(name, shape, reference)                                        \
+    SIMD_AVX2 uint32 name(uint32 phase, uint32 increment, float32 amplitude,               \
+                          float32 *mix_bus, int32 total_samples) {                         \
+        __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);                          \
+        __m256i phases = _mm256_add_epi32(_mm256_set1_epi32(phase),                        \
+                                          _mm256_mullo_epi32(lane, _mm256_set1_epi32(increment))); \
+        __m256i step = _mm256_set1_epi32(8 * increment);                                   \
+        __m256 amp = _mm256_set1_ps(amplitude);                                            \
+        int32 sample_index = 0;                                                            \
+        for (; sample_index + 8 <= total_samples; sample_index += 8) {                     \
+            float32 *out = mix_bus + sample_index;                                         \
+            __m256 value = shape(phase_to_unit_avx2(phases));                              \
+            _mm256_storeu_ps(out, _mm256_fmadd_ps(amp, value, _mm256_loadu_ps(out)));      \
+            phases = _mm256_add_epi32(phases, step);                                       \
+        }                                                                                  \
+        phase += (uint32) sample_index * increment;                                        \
+        _mm256_zeroupper();                                                                \
+        return reference(phase, increment, amplitude, mix_bus + sample_index,              \
+                         total_samples - sample_index);                                    \
+    }
+
+DEFINE_GENERATE_AVX2(generate_sine_avx2, sine_avx2, generate_sine)
+DEFINE_GENERATE_AVX2(generate_triangle_avx2, triangle_avx2, generate_triangle)
+DEFINE_GENERATE_AVX2(generate_square_avx2, square_avx2, generate_square)
+DEFINE_GENERATE_AVX2(generate_sawtooth_avx2, sawtooth_avx2, generate_sawtooth)
+
+SIMD_AVX2 static inline __m256 blep_residual_avx2(__m256 shape, __m256 near_scale, __m256 near_offset) {
+    __m256 magnitude = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), shape);
+    return _mm256_max_ps(_mm256_fmadd_ps(magnitude, near_scale, near_offset), _mm256_setzero_ps());
+}
+
+SIMD_AVX2 static inline __m256 triangle_blep_avx2(__m256 x, __m256 near_scale, __m256 near_offset, __m256 bend) {
+    __m256 triangle = triangle_avx2(x);
+    __m256 residual = blep_residual_avx2(triangle, near_scale, near_offset);
+    __m256 corner = _mm256_mul_ps(bend, _mm256_mul_ps(_mm256_mul_ps(residual, residual), residual));
+    __m256 sign = _mm256_and_ps(triangle, _mm256_set1_ps(-0.0f));
+    return _mm256_sub_ps(triangle, _mm256_xor_ps(corner, sign));
+}
+
+SIMD_AVX2 static inline __m256 sawtooth_blep_avx2(__m256 x, __m256 near_scale, __m256 near_offset, __m256 bend) {
+    (void) bend;
+    __m256 sawtooth = sawtooth_avx2(x);
+    __m256 residual = blep_residual_avx2(sawtooth, near_scale, near_offset);
+    __m256 sign = _mm256_and_ps(sawtooth, _mm256_set1_ps(-0.0f));
+    return _mm256_sub_ps(sawtooth, _mm256_xor_ps(_mm256_mul_ps(residual, residual), sign));
+}
+
+SIMD_AVX2 static inline __m256 square_blep_avx2(__m256 x, __m256 near_scale, __m256 near_offset, __m256 bend) {
+    (void) bend;
+    __m256 t = _mm256_sub_ps(x, _mm256_set1_ps(0.5f));
+    __m256 triangle = _mm256_fnmadd_ps(_mm256_set1_ps(4.0f), _mm256_andnot_ps(_mm256_set1_ps(-0.0f), t),
+                                       _mm256_set1_ps(1.0f));
+    __m256 residual = blep_residual_avx2(triangle, near_scale, near_offset);
+    return _mm256_xor_ps(_mm256_fmsub_ps(residual, residual, _mm256_set1_ps(1.0f)),
+                         _mm256_and_ps(t, _mm256_set1_ps(-0.0f)));
+}
+
+#define DEFINE_GENERATE_BLEP_AVX2(name, shape, naive, distance_scale, edge_shift, reference) \
+    SIMD_AVX2 uint32 name(uint32 phase, uint32 increment, float32 amplitude,               \
+                          float32 *mix_bus, int32 total_samples) {                         \
+        __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);                          \
+        __m256i phases = _mm256_add_epi32(_mm256_set1_epi32(phase),                        \
+                                          _mm256_mullo_epi32(lane, _mm256_set1_epi32(increment))); \
+        __m256i step = _mm256_set1_epi32(8 * increment);                                   \
+        __m256 amp = _mm256_set1_ps(amplitude);                                            \
+        float32 near = (distance_scale) * blep_inverse_dt(increment);                      \
+        __m256 near_scale = _mm256_set1_ps(near);                                          \
+        __m256 near_offset = _mm256_set1_ps(1.0f - near);                                  \
+        __m256 bend = _mm256_set1_ps(8.0f / 6.0f * increment * PHASE_TO_FLOAT);            \
+        uint32 edge_increment = increment << (edge_shift);                                 \
+        uint64 near_span = (uint64) (8 + BLEP_NEAR_MARGIN) * increment << (edge_shift);    \
+        uint32 lane_phase = phase;                                                         \
+        int32 sample_index = 0;                                                            \
+        for (; sample_index + 8 <= total_samples; sample_index += 8) {                     \
+            float32 *out = mix_bus + sample_index;                                         \
+            __m256 x = phase_to_unit_avx2(phases);                                         \
+            uint32 ahead = edge_increment - (lane_phase << (edge_shift));                  \
+            __m256 value = (ahead < near_span) ? shape(x, near_scale, near_offset, bend) : naive(x); \
+            _mm256_storeu_ps(out, _mm256_fmadd_ps(amp, value, _mm256_loadu_ps(out)));      \
+            phases = _mm256_add_epi32(phases, step);                                       \
+            lane_phase += 8 * increment;                                                   \
+        }                                                                                  \
+        phase += (uint32) sample_index * increment;                                        \
+        _mm256_zeroupper();                                                                \
+        return reference(phase, increment, amplitude, mix_bus + sample_index,              \
+                         total_samples - sample_index);                                    \
+    }
+
+DEFINE_GENERATE_BLEP_AVX2(generate_triangle_blep_avx2, triangle_blep_avx2, triangle_avx2, 0.25f, 1,
+                          generate_triangle_blep)
+DEFINE_GENERATE_BLEP_AVX2(generate_square_blep_avx2, square_blep_avx2, square_avx2, 0.25f, 1, generate_square_blep)
+DEFINE_GENERATE_BLEP_AVX2(generate_sawtooth_blep_avx2, sawtooth_blep_avx2, sawtooth_avx2, 0.5f, 0,
+                          generate_sawtooth_blep)
+
+#endif
+
+// Point generators at the widest kernels this CPU supports
+void oscillator_simd_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        generators[SIN] = generate_sine_avx2;
+        generators[TRI] = generate_triangle_blep_avx2;
+        generators[SQU] = generate_square_blep_avx2;
+        generators[SAW] = generate_sawtooth_blep_avx2;
+        oscillator_path = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        generators[SIN] = generate_sine_sse2;
+        generators[TRI] = generate_triangle_blep_sse2;
+        generators[SQU] = generate_square_blep_sse2;
+        generators[SAW] = generate_sawtooth_blep_sse2;
+        oscillator_path = "sse2";
+    }
+#endif
+}
+
+#endif
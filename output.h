@@ -0,0 +1,149 @@
+#if !defined(OUTPUT_H)
+#define OUTPUT_H
+
+#include <math.h>
+#include "platform.h"
+
+// Final stage: the one place the float mix bus is clipped, converted and
+// interleaved, straight into the device (or file) buffer. The mono bus is
+// copied to every channel. Stereo, the common case, goes through SSE2
+// kernels; other channel counts and block tails use the scalar loops.
+//
+// S16 output can have TPDF dither added: the sum of two uniform values of
+// half an LSB each, from a xorshift generator per lane.
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+typedef enum {
+    OUTPUT_S16,
+    OUTPUT_F32,
+} OutputFormat;
+
+typedef struct {
+    uint32 state[4]; // One xorshift32 state per SSE lane, never zero
+    bool32 enabled;
+} Dither;
+
+void dither_init(Dither *dither, bool32 enabled) {
+    dither->state[0] = 0x9e3779b9;
+    dither->state[1] = 0x7f4a7c15;
+    dither->state[2] = 0x85ebca6b;
+    dither->state[3] = 0xc2b2ae35;
+    dither->enabled = enabled;
+}
+
+// Triangular noise in [-1, 1) LSB from the two 16 bit halves of one draw
+float32 dither_next(Dither *dither) {
+    uint32 x = dither->state[0];
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    dither->state[0] = x;
+    return (float32) ((x & 0xffff) + (x >> 16)) * (1.0f / 65536.0f) - 1.0f;
+}
+
+int16 convert_s16(float32 sval, Dither *dither) {
+    sval *= 32767.0f;
+    if (dither && dither->enabled) sval += dither_next(dither);
+    if (sval > 32767.0f) sval = 32767.0f;
+    if (sval < -32768.0f) sval = -32768.0f;
+    return (int16) lrintf(sval);
+}
+
+#if defined(__SSE2__)
+
+// 4 frames of interleaved stereo S16 per iteration. Returns how many frames
+// were written, the caller finishes the tail.
+int32 write_s16_stereo_sse2(int16 *output, float32 *mix_bus, int32 total_samples, Dither *dither) {
+    __m128 scale = _mm_set1_ps(32767.0f);
+    __m128 low = _mm_set1_ps(-32768.0f);
+    __m128 high = _mm_set1_ps(32767.0f);
+    bool32 dithered = dither && dither->enabled;
+    __m128i state = dithered ? _mm_loadu_si128((__m128i *) dither->state) : _mm_setzero_si128();
+
+    int32 sample_index = 0;
+    for (; sample_index + 4 <= total_samples; sample_index += 4) {
+        __m128 sval = _mm_mul_ps(_mm_loadu_ps(mix_bus + sample_index), scale);
+        if (dithered) {
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+            state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+            __m128i halves = _mm_add_epi32(_mm_and_si128(state, _mm_set1_epi32(0xffff)),
+                                           _mm_srli_epi32(state, 16));
+            __m128 noise = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(halves), _mm_set1_ps(1.0f / 65536.0f)),
+                                      _mm_set1_ps(1.0f));
+            sval = _mm_add_ps(sval, noise);
+        }
+        sval = _mm_min_ps(_mm_max_ps(sval, low), high);
+
+        // Round, pack to 16 bits and duplicate each sample into L and R
+        __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(sval), _mm_setzero_si128());
+        _mm_storeu_si128((__m128i *) (output + 2 * sample_index), _mm_unpacklo_epi16(packed, packed));
+    }
+    if (dithered) _mm_storeu_si128((__m128i *) dither->state, state);
+    return sample_index;
+}
+
+int32 write_f32_stereo_sse2(float32 *output, float32 *mix_bus, int32 total_samples) {
+    __m128 low = _mm_set1_ps(-1.0f);
+    __m128 high = _mm_set1_ps(1.0f);
+
+    int32 sample_index = 0;
+    for (; sample_index + 4 <= total_samples; sample_index += 4) {
+        __m128 sval = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(mix_bus + sample_index), low), high);
+        _mm_storeu_ps(output + 2 * sample_index, _mm_unpacklo_ps(sval, sval));
+        _mm_storeu_ps(output + 2 * sample_index + 4, _mm_unpackhi_ps(sval, sval));
+    }
+    return sample_index;
+}
+
+#endif
+
+void write_s16(int16 *output, float32 *mix_bus, int32 total_samples, int32 channels, Dither *dither) {
+    int32 sample_index = 0;
+#if defined(__SSE2__)
+    if (channels == 2) sample_index = write_s16_stereo_sse2(output, mix_bus, total_samples, dither);
+#endif
+    output += sample_index * channels;
+
+    for (; sample_index < total_samples; sample_index++) {
+        int16 sample_value = convert_s16(mix_bus[sample_index], dither);
+
+        // Write the sample_value to the buffer for each channel
+        for (int32 channel = 0; channel < channels; channel++) {
+            *output++ = sample_value;
+        }
+    }
+}
+
+void write_f32(float32 *output, float32 *mix_bus, int32 total_samples, int32 channels) {
+    int32 sample_index = 0;
+#if defined(__SSE2__)
+    if (channels == 2) sample_index = write_f32_stereo_sse2(output, mix_bus, total_samples);
+#endif
+    output += sample_index * channels;
+
+    for (; sample_index < total_samples; sample_index++) {
+        float32 sval = mix_bus[sample_index];
+        if (sval > 1.0f) sval = 1.0f;
+        if (sval < -1.0f) sval = -1.0f;
+
+        for (int32 channel = 0; channel < channels; channel++) {
+            *output++ = sval;
+        }
+    }
+}
+
+// Convert one block of the mix bus into output, in format
+void write_output(void *output, OutputFormat format, float32 *mix_bus, int32 total_samples,
+                  int32 channels, Dither *dither) {
+    if (format == OUTPUT_F32) {
+        write_f32((float32 *) output, mix_bus, total_samples, channels);
+    } else {
+        write_s16((int16 *) output, mix_bus, total_samples, channels, dither);
+    }
+}
+
+#endif
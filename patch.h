@@ -0,0 +1,338 @@
+#if !defined(PATCH_H)
+#define PATCH_H
+
+#include <string.h>
+#include "platform.h"
+#include "oscillator.h"
+#include "filter.h"
+#include "sampler.h"
+
+// Per voice patches. A Patch is a graph of nodes built on the main thread;
+// patch_compile turns it into a PatchProgram, a flat list of instructions in
+// dependency order that read and write numbered buffers. The audio thread
+// renders a group of voices by walking that list once, see
+// patch_render_group in voice.h, so adding node types never grows a switch
+// in the callback.
+//
+// Compiling drops nodes that don't reach the output, rejects cycles, and
+// assigns buffers by liveness: a buffer goes back to the free list after its
+// last reader, single input nodes whose input has no other reader run in
+// place, and an envelope feeding the output adds straight into the bus.
+// A program that is one oscillator through filters into that envelope is
+// marked plain; while its filters are off the voices skip the instruction
+// list and render the way they did before patches, see generate_plain_voice.
+
+#define PATCH_MAX_NODES 16
+#define PATCH_MAX_INPUTS 4
+#define PATCH_MAX_OSCILLATORS 4 // Each oscillator keeps a phase per voice
+#define PATCH_MAX_FILTERS 2     // Each filter keeps its state per voice
+#define PATCH_MAX_SAMPLERS 2    // Each sampler keeps a position and a stream per voice
+#define PATCH_BUS -1            // Instruction output that adds into the voice bus
+#define PATCH_VOICE_WAVE -1     // Oscillator wave type that follows the engine's wave type
+
+typedef enum {
+    NODE_OSCILLATOR, // No inputs, plays the note's frequency times ratio
+    NODE_SAMPLER,    // No inputs, plays a sample transposed to the note times ratio, see sampler.h
+    NODE_MIXER,      // Sum of the inputs, each times its gain
+    NODE_FILTER,     // Per voice filter, see filter.h
+    NODE_DRIVE,      // Soft clipper, level is the drive
+    NODE_ENVELOPE,   // Times the voice's ADSR. Exactly one per patch, it decides when the voice ends.
+    NODE_OUTPUT,     // Added into the voice bus. Exactly one per patch.
+} NodeType;
+
+typedef struct {
+    NodeType type;
+    int32 inputs[PATCH_MAX_INPUTS]; // Node indices
+    float32 gains[PATCH_MAX_INPUTS];
+    int32 input_count;
+    int32 wave_type;       // Oscillator, or PATCH_VOICE_WAVE
+    float32 ratio;         // Oscillator frequency relative to the note
+    float32 level;         // Oscillator or sampler gain, drive amount
+    FilterSettings filter; // Starting settings of a filter
+    Sample *sample;        // What a sampler plays
+} PatchNode;
+
+typedef struct {
+    PatchNode nodes[PATCH_MAX_NODES];
+    int32 node_count;
+} Patch;
+
+typedef struct {
+    NodeType type;
+    int32 inputs[PATCH_MAX_INPUTS]; // Buffer indices
+    float32 gains[PATCH_MAX_INPUTS];
+    int32 input_count;
+    int32 output; // Buffer index or PATCH_BUS
+    int32 slot;   // Oscillator phase, filter state or sampler position this instruction owns
+    int32 wave_type;
+    float32 ratio;
+    float32 level;
+    Sample *sample;
+} PatchInstruction;
+
+typedef struct {
+    PatchInstruction instructions[PATCH_MAX_NODES];
+    int32 instruction_count;
+    int32 buffer_count;
+    int32 oscillator_count;
+    int32 filter_count;
+    int32 sampler_count;
+    bool32 plain; // Oscillator, in place filters, envelope into the bus
+    FilterSettings filters[PATCH_MAX_FILTERS]; // Starting settings, by slot
+    Sample *samples[PATCH_MAX_SAMPLERS];       // By slot
+} PatchProgram;
+
+//
+// Building. Every function returns the new node's index, or -1 if the patch
+// is full or an input is -1, so failures carry through to patch_compile.
+//
+
+void patch_init(Patch *patch) {
+    patch->node_count = 0;
+}
+
+int32 patch_add(Patch *patch, NodeType type) {
+    if (patch->node_count == PATCH_MAX_NODES) return -1;
+    int32 index = patch->node_count++;
+    PatchNode *node = &patch->nodes[index];
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->ratio = 1.0f;
+    node->level = 1.0f;
+    filter_settings_init(&node->filter);
+    return index;
+}
+
+// Add input to a mixer (or any node) with gain. Returns false if it doesn't fit.
+bool32 patch_connect(Patch *patch, int32 node, int32 input, float32 gain) {
+    if (node < 0 || input < 0) return 0;
+    PatchNode *target = &patch->nodes[node];
+    if (target->input_count == PATCH_MAX_INPUTS) return 0;
+    target->inputs[target->input_count] = input;
+    target->gains[target->input_count] = gain;
+    target->input_count++;
+    return 1;
+}
+
+int32 patch_oscillator(Patch *patch, int32 wave_type, float32 ratio, float32 level) {
+    int32 node = patch_add(patch, NODE_OSCILLATOR);
+    if (node < 0) return -1;
+    patch->nodes[node].wave_type = wave_type;
+    patch->nodes[node].ratio = ratio;
+    patch->nodes[node].level = level;
+    return node;
+}
+
+int32 patch_sampler(Patch *patch, Sample *sample, float32 ratio, float32 level) {
+    int32 node = patch_add(patch, NODE_SAMPLER);
+    if (node < 0) return -1;
+    patch->nodes[node].sample = sample;
+    patch->nodes[node].ratio = ratio;
+    patch->nodes[node].level = level;
+    return node;
+}
+
+int32 patch_mixer(Patch *patch) {
+    return patch_add(patch, NODE_MIXER);
+}
+
+// Node of type with input as its only input
+int32 patch_unary(Patch *patch, NodeType type, int32 input) {
+    if (input < 0) return -1;
+    int32 node = patch_add(patch, type);
+    if (node < 0) return -1;
+    patch_connect(patch, node, input, 1.0f);
+    return node;
+}
+
+int32 patch_filter(Patch *patch, int32 input, FilterType type, float32 cutoff, float32 resonance) {
+    int32 node = patch_unary(patch, NODE_FILTER, input);
+    if (node < 0) return -1;
+    FilterSettings *filter = &patch->nodes[node].filter;
+    filter->type = type;
+    filter->cutoff = filter->smoothed_cutoff = cutoff;
+    filter->resonance = filter->smoothed_resonance = resonance;
+    return node;
+}
+
+int32 patch_drive(Patch *patch, int32 input, float32 amount) {
+    int32 node = patch_unary(patch, NODE_DRIVE, input);
+    if (node >= 0) patch->nodes[node].level = amount;
+    return node;
+}
+
+int32 patch_envelope(Patch *patch, int32 input) {
+    return patch_unary(patch, NODE_ENVELOPE, input);
+}
+
+int32 patch_output(Patch *patch, int32 input) {
+    return patch_unary(patch, NODE_OUTPUT, input);
+}
+
+// Oscillator, filter, envelope: what the engine plays without a custom patch.
+// The filter starts out off and is driven by the filter parameters.
+void patch_default(Patch *patch) {
+    patch_init(patch);
+    int32 oscillator = patch_oscillator(patch, PATCH_VOICE_WAVE, 1.0f, 1.0f);
+    int32 filter = patch_filter(patch, oscillator, FILTER_NONE, 2000.0f, 0.707f);
+    patch_output(patch, patch_envelope(patch, filter));
+}
+
+// A fatter voice: the note, a slightly sharp sawtooth and a square an octave
+// down, through a resonant low pass and some drive
+void patch_stack(Patch *patch) {
+    patch_init(patch);
+    int32 mixer = patch_mixer(patch);
+    patch_connect(patch, mixer, patch_oscillator(patch, PATCH_VOICE_WAVE, 1.0f, 1.0f), 0.5f);
+    patch_connect(patch, mixer, patch_oscillator(patch, SAW, 1.005f, 1.0f), 0.4f);
+    patch_connect(patch, mixer, patch_oscillator(patch, SQU, 0.5f, 1.0f), 0.3f);
+    int32 filter = patch_filter(patch, mixer, FILTER_SVF_LOWPASS, 1200.0f, 1.5f);
+    patch_output(patch, patch_envelope(patch, patch_drive(patch, filter, 2.0f)));
+}
+
+// The default patch with a sample in place of the oscillator
+void patch_sampler_voice(Patch *patch, Sample *sample) {
+    patch_init(patch);
+    int32 sampler = patch_sampler(patch, sample, 1.0f, 1.0f);
+    int32 filter = patch_filter(patch, sampler, FILTER_NONE, 2000.0f, 0.707f);
+    patch_output(patch, patch_envelope(patch, filter));
+}
+
+//
+// Compiling
+//
+
+// Depth first walk from node, appending each node after its inputs. Returns
+// false on a cycle.
+bool32 patch_visit(Patch *patch, int32 node, int32 *marks, int32 *order, int32 *order_count) {
+    if (marks[node] == 2) return 1;
+    if (marks[node] == 1) return 0;
+    marks[node] = 1;
+    for (int32 input = 0; input < patch->nodes[node].input_count; input++) {
+        if (!patch_visit(patch, patch->nodes[node].inputs[input], marks, order, order_count)) return 0;
+    }
+    marks[node] = 2;
+    order[(*order_count)++] = node;
+    return 1;
+}
+
+// Compile patch into program. Returns NULL on success, otherwise what is
+// wrong with the patch. Main thread only.
+const char *patch_compile(Patch *patch, PatchProgram *program) {
+    int32 output = -1;
+    for (int32 node = 0; node < patch->node_count; node++) {
+        PatchNode *source = &patch->nodes[node];
+        for (int32 input = 0; input < source->input_count; input++) {
+            if (source->inputs[input] < 0 || source->inputs[input] >= patch->node_count) return "bad input";
+        }
+        bool32 generator = source->type == NODE_OSCILLATOR || source->type == NODE_SAMPLER;
+        bool32 unary = !generator && source->type != NODE_MIXER;
+        if (generator && source->input_count != 0) return "oscillators and samplers take no input";
+        if (source->type == NODE_OSCILLATOR && source->wave_type != PATCH_VOICE_WAVE &&
+            (source->wave_type < 0 || source->wave_type >= WAVE_TYPE_COUNT)) return "bad wave type";
+        if (source->type == NODE_SAMPLER && !source->sample) return "sampler without a sample";
+        if (source->type == NODE_MIXER && source->input_count == 0) return "mixer without inputs";
+        if (unary && source->input_count != 1) return "node needs exactly one input";
+        if (source->type == NODE_OUTPUT) {
+            if (output >= 0) return "more than one output";
+            output = node;
+        }
+    }
+    if (output < 0) return "no output";
+
+    int32 marks[PATCH_MAX_NODES] = {0};
+    int32 order[PATCH_MAX_NODES];
+    int32 order_count = 0;
+    if (!patch_visit(patch, output, marks, order, &order_count)) return "cycle";
+
+    // Readers of each node and the position of the last one
+    int32 readers[PATCH_MAX_NODES] = {0};
+    int32 last_read[PATCH_MAX_NODES];
+    int32 envelopes = 0, oscillators = 0, filters = 0, samplers = 0;
+    for (int32 index = 0; index < order_count; index++) {
+        PatchNode *node = &patch->nodes[order[index]];
+        last_read[order[index]] = index;
+        for (int32 input = 0; input < node->input_count; input++) {
+            readers[node->inputs[input]]++;
+            last_read[node->inputs[input]] = index;
+        }
+        if (node->type == NODE_ENVELOPE) envelopes++;
+        if (node->type == NODE_OSCILLATOR) oscillators++;
+        if (node->type == NODE_FILTER) filters++;
+        if (node->type == NODE_SAMPLER) samplers++;
+    }
+    if (envelopes != 1) return "needs exactly one envelope";
+    if (oscillators > PATCH_MAX_OSCILLATORS) return "too many oscillators";
+    if (filters > PATCH_MAX_FILTERS) return "too many filters";
+    if (samplers > PATCH_MAX_SAMPLERS) return "too many samplers";
+
+    // An envelope read only by the output adds into the bus itself
+    int32 fused_envelope = patch->nodes[output].inputs[0];
+    if (patch->nodes[fused_envelope].type != NODE_ENVELOPE || readers[fused_envelope] != 1) fused_envelope = -1;
+
+    int32 buffer_of[PATCH_MAX_NODES];
+    bool32 buffer_free[PATCH_MAX_NODES] = {0};
+    memset(program, 0, sizeof(*program));
+
+    for (int32 index = 0; index < order_count; index++) {
+        int32 node_index = order[index];
+        PatchNode *node = &patch->nodes[node_index];
+        if (node_index == output && fused_envelope >= 0) continue;
+
+        PatchInstruction *instruction = &program->instructions[program->instruction_count++];
+        instruction->type = node->type;
+        instruction->input_count = node->input_count;
+        instruction->wave_type = node->wave_type;
+        instruction->ratio = node->ratio;
+        instruction->level = node->level;
+        for (int32 input = 0; input < node->input_count; input++) {
+            instruction->inputs[input] = buffer_of[node->inputs[input]];
+            instruction->gains[input] = node->gains[input];
+        }
+        if (node->type == NODE_OSCILLATOR) instruction->slot = program->oscillator_count++;
+        if (node->type == NODE_FILTER) {
+            instruction->slot = program->filter_count;
+            program->filters[program->filter_count++] = node->filter;
+        }
+        if (node->type == NODE_SAMPLER) {
+            instruction->slot = program->sampler_count;
+            instruction->sample = node->sample;
+            program->samples[program->sampler_count++] = node->sample;
+        }
+
+        // Output buffer, taken before the inputs are released so nothing but
+        // the in place cases below ever aliases
+        bool32 in_place = (node->type == NODE_FILTER || node->type == NODE_DRIVE) &&
+                          readers[node->inputs[0]] == 1;
+        if (node->type == NODE_OUTPUT || node_index == fused_envelope) {
+            instruction->output = PATCH_BUS;
+        } else if (in_place) {
+            instruction->output = instruction->inputs[0];
+        } else {
+            int32 buffer = 0;
+            while (buffer < program->buffer_count && !buffer_free[buffer]) buffer++;
+            if (buffer == program->buffer_count) program->buffer_count++;
+            buffer_free[buffer] = 0;
+            instruction->output = buffer;
+        }
+        buffer_of[node_index] = instruction->output;
+
+        for (int32 input = 0; input < node->input_count; input++) {
+            int32 source = node->inputs[input];
+            if (last_read[source] == index && buffer_of[source] >= 0 && !(in_place && input == 0)) {
+                buffer_free[buffer_of[source]] = 1;
+            }
+        }
+    }
+
+    PatchInstruction *first = &program->instructions[0];
+    PatchInstruction *last = &program->instructions[program->instruction_count - 1];
+    program->plain = first->type == NODE_OSCILLATOR && last->type == NODE_ENVELOPE && last->output == PATCH_BUS;
+    for (int32 index = 1; index < program->instruction_count - 1; index++) {
+        PatchInstruction *instruction = &program->instructions[index];
+        if (instruction->type != NODE_FILTER || instruction->output != first->output) program->plain = 0;
+    }
+    return NULL;
+}
+
+#endif
@@ -31,6 +31,9 @@ typedef double float64;
 #define assert(expression)
 #endif
 
+#define PI 3.14159265359f
+#define TWO_PI 6.28318530718f
+
 #define array_count(array) (sizeof(array) / sizeof((array)[0]))
 
 #endif
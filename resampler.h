@@ -0,0 +1,291 @@
+#if !defined(RESAMPLER_H)
+#define RESAMPLER_H
+
+#include <math.h>
+#include <string.h>
+#include "platform.h"
+#include "oscillator_simd.h"
+
+// Polyphase windowed-sinc resampling, used between the engine and a device
+// running at a different rate, and by the sampler to play a file at any
+// pitch. The engine always renders at its own rate; nothing is left for SDL
+// to convert.
+//
+// Each output frame is a dot product of taps input frames with one row of a
+// precomputed table: a Kaiser windowed sinc for a read point somewhere
+// between two input frames. The table has RESAMPLE_PHASES rows per frame and
+// the coefficients are interpolated between the two nearest rows, so any
+// ratio works, including one that changes every note. More taps buy a
+// flatter passband and less aliasing for more work per frame and more
+// latency, see resample_tiers.
+//
+// Playing a sample faster than its own rate is downsampling it, so the
+// sampler has a table per tier for each half octave of pitching up, each
+// with its cutoff that much lower, and picks one by the step it plays at.
+//
+// The dot product is the whole inner loop; resample_tables_init picks an
+// SSE2 or AVX2 kernel for it at runtime.
+
+#define RESAMPLE_PHASE_BITS 8
+#define RESAMPLE_PHASES (1 << RESAMPLE_PHASE_BITS)
+#define RESAMPLE_MAX_TAPS 128
+#define RESAMPLER_MAX_INPUT 4096 // Most input frames one resampler_process call may take
+#define RESAMPLE_PITCH_LEVELS 7  // Sampler tables per tier, half an octave apart, up to three octaves up
+
+typedef enum {
+    RESAMPLE_LOW,
+    RESAMPLE_MEDIUM,
+    RESAMPLE_HIGH,
+    RESAMPLE_QUALITY_COUNT,
+} ResampleQuality;
+
+typedef struct {
+    const char *name;
+    int32 taps;      // A multiple of 8, at full bandwidth
+    float32 cutoff;  // Fraction of the lower rate's Nyquist frequency
+    float32 beta;    // Kaiser window shape, higher trades transition width for stopband depth
+} ResampleTier;
+
+ResampleTier resample_tiers[RESAMPLE_QUALITY_COUNT] = {
+    {"low", 8, 0.80f, 5.0f},
+    {"medium", 32, 0.90f, 7.0f},
+    {"high", 64, 0.94f, 9.0f},
+};
+
+typedef struct {
+    int32 taps;
+    // RESAMPLE_PHASES + 1 rows of taps coefficients. Row p is the filter for
+    // a read point p / RESAMPLE_PHASES of the way from frame f to f + 1, and
+    // its taps apply to frames f - taps / 2 + 1 to f + taps / 2.
+    _Alignas(32) float32 coefficients[(RESAMPLE_PHASES + 1) * RESAMPLE_MAX_TAPS];
+} ResampleTable;
+
+// Streaming state for a fixed rate conversion, e.g. engine to device
+typedef struct {
+    ResampleTable table;
+    uint64 step;     // Input frames per output frame, 32.32 fixed point
+    uint64 position; // Next read point in frames, 32.32 fixed point
+    int32 filled;    // Frames held in frames
+    float32 frames[RESAMPLER_MAX_INPUT + RESAMPLE_MAX_TAPS];
+} Resampler;
+
+typedef float32 ResampleDotFunction(const float32 *frames, const float32 *row, float32 fraction, int32 taps);
+
+// Tables for the sampler per tier. Level 0 is full bandwidth, for steps up
+// to 1; level l is for steps up to resample_level_steps[l], 2^(l / 2), and
+// cuts off that much lower. Above the last level's step aliasing comes back.
+ResampleTable resample_tables[RESAMPLE_QUALITY_COUNT][RESAMPLE_PITCH_LEVELS];
+uint64 resample_level_steps[RESAMPLE_PITCH_LEVELS]; // 32.32 fixed point
+
+//
+// Tables
+//
+
+// Modified Bessel function of the first kind, order zero, by its series
+float64 bessel_i0(float64 x) {
+    float64 sum = 1.0, term = 1.0;
+    for (int32 k = 1; k < 32; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+// bandwidth scales the tier's cutoff, below 1 when downsampling so nothing
+// above the output's Nyquist frequency folds back. The filter gets longer to
+// match, so its transition band stays as narrow at the output rate.
+void resample_table_build(ResampleTable *table, ResampleQuality quality, float32 bandwidth) {
+    ResampleTier *tier = &resample_tiers[quality];
+    int32 taps = ((int32) ceilf(tier->taps / bandwidth) + 7) & ~7;
+    if (taps > RESAMPLE_MAX_TAPS) taps = RESAMPLE_MAX_TAPS;
+    int32 half = taps / 2;
+    float64 cutoff = tier->cutoff * bandwidth;
+    float64 window_scale = 1.0 / bessel_i0(tier->beta);
+    table->taps = taps;
+    for (int32 phase = 0; phase <= RESAMPLE_PHASES; phase++) {
+        float32 *row = table->coefficients + phase * taps;
+        float64 t = (float64) phase / RESAMPLE_PHASES;
+        float64 sum = 0.0;
+        for (int32 tap = 0; tap < taps; tap++) {
+            float64 x = tap - (half - 1) - t; // Distance from the read point
+            float64 sinc = (x == 0.0) ? 1.0 : sin(PI * cutoff * x) / (PI * cutoff * x);
+            float64 edge = x / half;
+            float64 window = (edge * edge < 1.0) ? bessel_i0(tier->beta * sqrt(1.0 - edge * edge)) * window_scale : 0.0;
+            row[tap] = (float32) (sinc * window);
+            sum += row[tap];
+        }
+        // Unity gain at DC for every phase
+        for (int32 tap = 0; tap < taps; tap++) row[tap] = (float32) (row[tap] / sum);
+    }
+}
+
+//
+// Dot product kernels: frames against row, interpolated fraction of the way
+// to the next row
+//
+
+float32 resample_dot_scalar(const float32 *frames, const float32 *row, float32 fraction, int32 taps) {
+    const float32 *next = row + taps;
+    float32 sum = 0.0f;
+    for (int32 tap = 0; tap < taps; tap++) {
+        sum += frames[tap] * (row[tap] + fraction * (next[tap] - row[tap]));
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+SIMD_SSE2 float32 resample_dot_sse2(const float32 *frames, const float32 *row, float32 fraction, int32 taps) {
+    const float32 *next = row + taps;
+    __m128 weight = _mm_set1_ps(fraction);
+    __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+    for (int32 tap = 0; tap < taps; tap += 8) {
+        __m128 row0 = _mm_loadu_ps(row + tap), row1 = _mm_loadu_ps(row + tap + 4);
+        __m128 c0 = _mm_add_ps(row0, _mm_mul_ps(weight, _mm_sub_ps(_mm_loadu_ps(next + tap), row0)));
+        __m128 c1 = _mm_add_ps(row1, _mm_mul_ps(weight, _mm_sub_ps(_mm_loadu_ps(next + tap + 4), row1)));
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(frames + tap), c0));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(frames + tap + 4), c1));
+    }
+    __m128 sum = _mm_add_ps(sum0, sum1);
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+SIMD_AVX2 float32 resample_dot_avx2(const float32 *frames, const float32 *row, float32 fraction, int32 taps) {
+    const float32 *next = row + taps;
+    __m256 weight = _mm256_set1_ps(fraction);
+    __m256 sum = _mm256_setzero_ps();
+    for (int32 tap = 0; tap < taps; tap += 8) {
+        __m256 row0 = _mm256_loadu_ps(row + tap);
+        __m256 coefficient = _mm256_fmadd_ps(weight, _mm256_sub_ps(_mm256_loadu_ps(next + tap), row0), row0);
+        sum = _mm256_fmadd_ps(_mm256_loadu_ps(frames + tap), coefficient, sum);
+    }
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    return _mm_cvtss_f32(half);
+}
+
+#endif
+
+ResampleDotFunction *resample_dot = resample_dot_scalar;
+const char *resample_path = "scalar";
+
+// Build the sampler's tables and point resample_dot at the widest kernel
+// this CPU supports
+void resample_tables_init(void) {
+    for (int32 level = 0; level < RESAMPLE_PITCH_LEVELS; level++) {
+        float64 step = pow(2.0, level * 0.5);
+        resample_level_steps[level] = (uint64) (step * 4294967296.0);
+        for (int32 quality = 0; quality < RESAMPLE_QUALITY_COUNT; quality++) {
+            resample_table_build(&resample_tables[quality][level], (ResampleQuality) quality, (float32) (1.0 / step));
+        }
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        resample_dot = resample_dot_avx2;
+        resample_path = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        resample_dot = resample_dot_sse2;
+        resample_path = "sse2";
+    }
+#endif
+}
+
+// The sampler's table for reading at step input frames per output frame,
+// 32.32 fixed point
+const ResampleTable *resample_table_for_step(ResampleQuality quality, uint64 step) {
+    int32 level = 0;
+    while (level < RESAMPLE_PITCH_LEVELS - 1 && step > resample_level_steps[level]) level++;
+    return &resample_tables[quality][level];
+}
+
+// Table row and the fraction of the way to the next one for a 32.32 fixed
+// point read point
+const float32 *resample_row(const ResampleTable *table, uint64 position, float32 *fraction) {
+    uint32 below_frame = (uint32) position;
+    uint32 phase = below_frame >> (32 - RESAMPLE_PHASE_BITS);
+    *fraction = (below_frame << RESAMPLE_PHASE_BITS) * (1.0f / 4294967296.0f);
+    return table->coefficients + phase * table->taps;
+}
+
+bool32 resample_quality_from_name(const char *name, ResampleQuality *quality) {
+    for (int32 index = 0; index < RESAMPLE_QUALITY_COUNT; index++) {
+        if (strcmp(name, resample_tiers[index].name) == 0) {
+            *quality = (ResampleQuality) index;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//
+// Streaming
+//
+
+// Set up for input_rate to output_rate, on the main thread since it builds
+// a table
+void resampler_init(Resampler *resampler, float32 input_rate, float32 output_rate, ResampleQuality quality) {
+    float32 bandwidth = (output_rate < input_rate) ? output_rate / input_rate : 1.0f;
+    resample_table_build(&resampler->table, quality, bandwidth);
+    resampler->step = (uint64) ((float64) input_rate / output_rate * 4294967296.0 + 0.5);
+
+    // Start on silence, with the read point where the first output needs
+    // nothing before the buffer
+    int32 half = resampler->table.taps / 2;
+    resampler->filled = resampler->table.taps;
+    memset(resampler->frames, 0, sizeof(resampler->frames));
+    resampler->position = (uint64) (half - 1) << 32;
+}
+
+// Delay through the resampler in input frames
+int32 resampler_latency(Resampler *resampler) {
+    return resampler->table.taps / 2 + 1;
+}
+
+// New input frames resampler_process needs for output_frames of output
+int32 resampler_input_needed(Resampler *resampler, int32 output_frames) {
+    if (output_frames <= 0) return 0;
+    uint64 last = (resampler->position + (uint64) (output_frames - 1) * resampler->step) >> 32;
+    int64 needed = (int64) last + resampler->table.taps / 2 + 1 - resampler->filled;
+    return (needed > 0) ? (int32) needed : 0;
+}
+
+// Most output frames whose input fits in max_input frames
+int32 resampler_max_output(Resampler *resampler, int32 max_input) {
+    int64 last = (int64) resampler->filled + max_input - resampler->table.taps / 2 - 1;
+    if (last < 0 || ((uint64) last << 32) < resampler->position) return 0;
+    return (int32) ((((uint64) last << 32) - resampler->position) / resampler->step) + 1;
+}
+
+// Take input_frames of input, exactly resampler_input_needed(output_frames)
+// of them, and write output_frames of output
+void resampler_process(Resampler *resampler, const float32 *input, int32 input_frames,
+                       float32 *output, int32 output_frames) {
+    assert(input_frames <= RESAMPLER_MAX_INPUT && resampler->filled + input_frames <= (int32) array_count(resampler->frames));
+    memcpy(resampler->frames + resampler->filled, input, input_frames * sizeof(float32));
+    resampler->filled += input_frames;
+
+    const ResampleTable *table = &resampler->table;
+    int32 taps = table->taps;
+    int32 half = taps / 2;
+    uint64 position = resampler->position;
+    for (int32 sample_index = 0; sample_index < output_frames; sample_index++) {
+        int32 frame = (int32) (position >> 32);
+        assert(frame + half < resampler->filled);
+        float32 fraction;
+        const float32 *row = resample_row(table, position, &fraction);
+        output[sample_index] = resample_dot(resampler->frames + frame - (half - 1), row, fraction, taps);
+        position += resampler->step;
+    }
+
+    // Keep only what the next read point still reaches back to
+    int32 first = (int32) (position >> 32) - (half - 1);
+    memmove(resampler->frames, resampler->frames + first, (resampler->filled - first) * sizeof(float32));
+    resampler->filled -= first;
+    resampler->position = position - ((uint64) first << 32);
+}
+
+#endif
@@ -0,0 +1,453 @@
+#if !defined(SAMPLER_H)
+#define SAMPLER_H
+
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "platform.h"
+#include "arena.h"
+#include "command_queue.h"
+#include "workers.h"
+#include "wav.h"
+#include "resampler.h"
+
+// Sample playback. A WAV file is memory mapped rather than read, so loading
+// takes the same time for a 1 MB file as for a 10 GB one: parse the header,
+// copy the attack (the first SAMPLE_ATTACK_FRAMES frames) into engine
+// memory, done. Nothing else of the file is touched until a voice needs it.
+//
+// The audio thread never reads the mapping, since any read of it may fault
+// and wait on the disk. A voice plays the attack from engine memory and,
+// once past it, reads a SampleStream: a ring of frames in engine memory that
+// the prefetch thread keeps topped up from the mapping, one ring per voice
+// and single producer, single consumer. The prefetch thread takes the page
+// faults, and asks the kernel to read ahead of itself.
+//
+// Voices claim a stream on note on and give it back when they end; the
+// prefetch thread frees it. It tops the rings up every
+// SAMPLE_PREFETCH_SECONDS while any stream is in use, and once none is it
+// parks on a semaphore until the next claim posts to it, so an idle engine
+// has nothing polling. If the ring runs dry, because the disk can't keep
+// up or every stream is taken, the voice plays silence for the missing frames
+// rather than wait.
+//
+// Playback is polyphase sinc interpolation, see resampler.h, at the quality
+// the caller picks. Samples are mono in the engine; the channels of a stereo
+// file are averaged.
+// Loaded samples stay mapped for the life of the engine.
+
+#define SAMPLE_MAX_FILES 16
+#define SAMPLE_ATTACK_FRAMES 32768  // Preloaded, about 0.7 s at 44.1 kHz
+#define SAMPLE_STREAM_FRAMES 16384  // Ring per streaming voice, a power of two
+#define SAMPLE_MAX_STREAMS 64       // Voices that can play past their attack at once
+#define SAMPLE_PREFETCH_SECONDS 0.002
+#define SAMPLE_PATH_SIZE 256
+
+typedef struct {
+    char path[SAMPLE_PATH_SIZE];
+    void *mapping;
+    size_t mapping_size;
+    const uint8 *data; // First frame, inside the mapping
+    int32 format;      // WAV_FORMAT_PCM (16 bit) or WAV_FORMAT_FLOAT
+    int32 channels;
+    int32 bytes_per_frame;
+    uint64 frame_count;
+    float32 sample_rate;
+    float32 root_frequency; // Pitch of the recording, a note at this frequency plays it at its own rate
+    float32 *attack;        // First attack_frames frames, converted
+    int32 attack_frames;
+} Sample;
+
+typedef enum {
+    STREAM_FREE,     // Audio thread may claim it
+    STREAM_PLAYING,  // Prefetch thread fills it, a voice reads it
+    STREAM_STOPPING, // Voice is done, prefetch thread will free it
+} StreamState;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) _Atomic int32 state;
+    Sample *sample;
+    float32 *frames; // SAMPLE_STREAM_FRAMES, frame f lives at f % SAMPLE_STREAM_FRAMES
+
+    // Frames below write_frame are in the ring (prefetch thread writes it),
+    // frames below read_frame are no longer needed (voice writes it)
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64 write_frame;
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64 read_frame;
+} SampleStream;
+
+typedef struct {
+    Sample samples[SAMPLE_MAX_FILES];
+    int32 sample_count; // Main thread only
+    SampleStream streams[SAMPLE_MAX_STREAMS];
+    _Atomic uint32 underruns; // Frames a voice needed that weren't in its ring yet
+    bool32 streaming;         // Voices may claim streams, set before the audio starts
+
+    pthread_t thread;
+    bool32 thread_running;
+    _Atomic bool32 quit;
+    Semaphore wake;
+    _Atomic bool32 parked; // Prefetch thread is, or is about to be, waiting on wake
+} SampleBank;
+
+// Rings and attack memory come from arena, see arena.h
+void sample_bank_init(SampleBank *bank, MemoryArena *arena) {
+    memset(bank, 0, sizeof(*bank));
+    for (int32 index = 0; index < SAMPLE_MAX_FILES; index++) {
+        bank->samples[index].attack = arena_push_array(arena, float32, SAMPLE_ATTACK_FRAMES);
+    }
+    for (int32 index = 0; index < SAMPLE_MAX_STREAMS; index++) {
+        SampleStream *stream = &bank->streams[index];
+        atomic_init(&stream->state, STREAM_FREE);
+        atomic_init(&stream->write_frame, 0);
+        atomic_init(&stream->read_frame, 0);
+        stream->frames = arena_push_array(arena, float32, SAMPLE_STREAM_FRAMES);
+    }
+    atomic_init(&bank->underruns, 0);
+    bank->streaming = 1;
+    atomic_init(&bank->quit, 0);
+    atomic_init(&bank->parked, 0);
+}
+
+//
+// Loading, main thread
+//
+
+uint32 wav_read_u16(const uint8 *bytes) {
+    return bytes[0] | (bytes[1] << 8);
+}
+
+uint32 wav_read_u32(const uint8 *bytes) {
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32) bytes[3] << 24);
+}
+
+// Convert count frames starting at first into mono floats. Touches the
+// mapping, so never call it on the audio thread. The data chunk is only
+// guaranteed 2 byte alignment, so values are copied out rather than cast.
+void sample_convert(Sample *sample, uint64 first, int32 count, float32 *out) {
+    const uint8 *frame = sample->data + first * sample->bytes_per_frame;
+    float32 scale = 1.0f / sample->channels;
+    if (sample->format == WAV_FORMAT_FLOAT) {
+        for (int32 index = 0; index < count; index++, frame += sample->bytes_per_frame) {
+            float32 sum = 0.0f;
+            for (int32 channel = 0; channel < sample->channels; channel++) {
+                float32 value;
+                memcpy(&value, frame + channel * sizeof(float32), sizeof(value));
+                sum += value;
+            }
+            out[index] = sum * scale;
+        }
+    } else {
+        scale *= 1.0f / 32768.0f;
+        for (int32 index = 0; index < count; index++, frame += sample->bytes_per_frame) {
+            int32 sum = 0;
+            for (int32 channel = 0; channel < sample->channels; channel++) {
+                int16 value;
+                memcpy(&value, frame + channel * sizeof(int16), sizeof(value));
+                sum += value;
+            }
+            out[index] = sum * scale;
+        }
+    }
+}
+
+// Find the fmt and data chunks. Returns NULL on success, otherwise what is
+// wrong with the file.
+const char *sample_parse(Sample *sample, const uint8 *bytes, size_t size) {
+    if (size < 12 || memcmp(bytes, "RIFF", 4) != 0 || memcmp(bytes + 8, "WAVE", 4) != 0) return "not a WAV file";
+
+    bool32 found_format = 0;
+    size_t offset = 12;
+    while (offset + 8 <= size) {
+        const uint8 *chunk = bytes + offset;
+        size_t chunk_size = wav_read_u32(chunk + 4);
+        size_t available = size - offset - 8;
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            if (chunk_size < 16 || chunk_size > available) return "bad fmt chunk";
+            int32 format = wav_read_u16(chunk + 8);
+            int32 bits = wav_read_u16(chunk + 22);
+            // WAVE_FORMAT_EXTENSIBLE keeps the real format at the start of its sub format GUID
+            if (format == 0xfffe && chunk_size >= 40) format = wav_read_u16(chunk + 32);
+            sample->format = format;
+            sample->channels = wav_read_u16(chunk + 10);
+            sample->sample_rate = (float32) wav_read_u32(chunk + 12);
+            sample->bytes_per_frame = wav_read_u16(chunk + 20);
+            if (!((format == WAV_FORMAT_PCM && bits == 16) || (format == WAV_FORMAT_FLOAT && bits == 32))) {
+                return "only 16 bit PCM and 32 bit float are supported";
+            }
+            if (sample->channels < 1 || sample->bytes_per_frame != sample->channels * bits / 8) return "bad fmt chunk";
+            found_format = 1;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!found_format) return "data before fmt";
+            if (chunk_size > available) chunk_size = available; // Truncated file, play what is there
+            sample->data = chunk + 8;
+            sample->frame_count = chunk_size / sample->bytes_per_frame;
+            return NULL;
+        }
+        offset += 8 + chunk_size + (chunk_size & 1);
+    }
+    return "no data chunk";
+}
+
+// Map path and find its frames. Returns NULL on success, otherwise what went
+// wrong, in which case nothing is left mapped.
+const char *sample_open(Sample *sample, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return "could not open file";
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size == 0) {
+        close(fd);
+        return "could not read file";
+    }
+    void *mapping = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file
+    if (mapping == MAP_FAILED) return "could not map file";
+
+    const char *error = sample_parse(sample, (const uint8 *) mapping, status.st_size);
+    if (error) {
+        munmap(mapping, status.st_size);
+        return error;
+    }
+    madvise(mapping, status.st_size, MADV_SEQUENTIAL);
+    snprintf(sample->path, sizeof(sample->path), "%s", path);
+    sample->mapping = mapping;
+    sample->mapping_size = status.st_size;
+    return NULL;
+}
+
+void sample_close(Sample *sample) {
+    if (sample->mapping) munmap(sample->mapping, sample->mapping_size);
+    sample->mapping = NULL;
+}
+
+// Map path and preload its attack. root_frequency is the pitch the file was
+// recorded at. Returns NULL on success, otherwise what went wrong.
+const char *sample_load(SampleBank *bank, const char *path, float32 root_frequency, Sample **result) {
+    if (bank->sample_count == SAMPLE_MAX_FILES) return "too many samples";
+
+    Sample *sample = &bank->samples[bank->sample_count];
+    float32 *attack = sample->attack;
+    memset(sample, 0, sizeof(*sample));
+    sample->attack = attack;
+    const char *error = sample_open(sample, path);
+    if (error) return error;
+
+    sample->root_frequency = root_frequency;
+    sample->attack_frames = (sample->frame_count < SAMPLE_ATTACK_FRAMES) ? (int32) sample->frame_count
+                                                                         : SAMPLE_ATTACK_FRAMES;
+    sample_convert(sample, 0, sample->attack_frames, sample->attack);
+
+    bank->sample_count++;
+    *result = sample;
+    return NULL;
+}
+
+//
+// Prefetching
+//
+
+// Top up one playing stream from its mapping
+void sample_stream_fill(SampleStream *stream) {
+    Sample *sample = stream->sample;
+    uint64 write = atomic_load_explicit(&stream->write_frame, memory_order_relaxed);
+    uint64 read = atomic_load_explicit(&stream->read_frame, memory_order_acquire);
+    if (write < read) write = read; // The voice ran dry and moved on, skip what it missed
+    uint64 end = read + SAMPLE_STREAM_FRAMES;
+    if (end > sample->frame_count) end = sample->frame_count;
+    if (write >= end) return;
+
+    // At most two runs, the second one after the ring wraps
+    while (write < end) {
+        uint64 position = write % SAMPLE_STREAM_FRAMES;
+        uint64 count = end - write;
+        if (count > SAMPLE_STREAM_FRAMES - position) count = SAMPLE_STREAM_FRAMES - position;
+        sample_convert(sample, write, (int32) count, stream->frames + position);
+        write += count;
+    }
+    atomic_store_explicit(&stream->write_frame, end, memory_order_release);
+
+    // Have the kernel start reading the next ring's worth
+    uint64 ahead = end + SAMPLE_STREAM_FRAMES;
+    if (ahead > sample->frame_count) ahead = sample->frame_count;
+    if (ahead > end) {
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t) (sample->data + end * sample->bytes_per_frame) & ~(page - 1);
+        uintptr_t stop = (uintptr_t) (sample->data + ahead * sample->bytes_per_frame);
+        madvise((void *) start, stop - start, MADV_WILLNEED);
+    }
+}
+
+// One pass of the prefetch thread: fill every playing stream and free the
+// stopped ones. offline_render calls this itself before each block instead
+// of running the thread, so the rings are always full and the output is
+// the same every time. Returns the number of streams that were playing.
+int32 sample_bank_update(SampleBank *bank) {
+    int32 playing = 0;
+    for (int32 index = 0; index < SAMPLE_MAX_STREAMS; index++) {
+        SampleStream *stream = &bank->streams[index];
+        int32 state = atomic_load_explicit(&stream->state, memory_order_acquire);
+        if (state == STREAM_PLAYING) {
+            sample_stream_fill(stream);
+            playing++;
+        } else if (state == STREAM_STOPPING) {
+            atomic_store_explicit(&stream->state, STREAM_FREE, memory_order_release);
+        }
+    }
+    return playing;
+}
+
+bool32 sample_bank_idle(SampleBank *bank) {
+    for (int32 index = 0; index < SAMPLE_MAX_STREAMS; index++) {
+        if (atomic_load(&bank->streams[index].state) != STREAM_FREE) return 0;
+    }
+    return 1;
+}
+
+void *sample_prefetch_main(void *argument) {
+    SampleBank *bank = (SampleBank *) argument;
+    struct timespec interval = {0, (long) (SAMPLE_PREFETCH_SECONDS * 1e9)};
+    while (!atomic_load_explicit(&bank->quit, memory_order_acquire)) {
+        if (sample_bank_update(bank) > 0) {
+            nanosleep(&interval, NULL);
+            continue;
+        }
+
+        // Nothing to fill. Same handshake as the worker pool: raise parked
+        // before looking at the streams again, so a claim that we miss here
+        // is one that sees parked and posts.
+        atomic_store(&bank->parked, 1);
+        if (sample_bank_idle(bank) && !atomic_load(&bank->quit)) {
+            semaphore_wait(&bank->wake);
+        } else if (!atomic_exchange(&bank->parked, 0)) {
+            semaphore_wait(&bank->wake); // Consume the post that raced with us
+        }
+    }
+    return NULL;
+}
+
+// Start the prefetch thread. Returns false if it could not be created.
+bool32 sample_bank_start(SampleBank *bank) {
+    atomic_store(&bank->quit, 0);
+    atomic_store(&bank->parked, 0);
+    if (!semaphore_init(&bank->wake)) return 0;
+    bank->thread_running = pthread_create(&bank->thread, NULL, sample_prefetch_main, bank) == 0;
+    if (!bank->thread_running) semaphore_destroy(&bank->wake);
+    return bank->thread_running;
+}
+
+// For when the prefetch thread can't run: nothing would refill a ring past
+// the attack, so unmap every sample and have voices claim no streams
+void sample_bank_disable(SampleBank *bank) {
+    for (int32 index = 0; index < bank->sample_count; index++) sample_close(&bank->samples[index]);
+    bank->sample_count = 0;
+    bank->streaming = 0;
+}
+
+void sample_bank_stop(SampleBank *bank) {
+    if (!bank->thread_running) return;
+    atomic_store(&bank->quit, 1);
+    semaphore_post(&bank->wake);
+    pthread_join(bank->thread, NULL);
+    semaphore_destroy(&bank->wake);
+    bank->thread_running = 0;
+}
+
+//
+// Playback, audio thread
+//
+
+// A stream that will deliver sample from the end of its attack, -1 if the
+// attack is all there is or no stream is free. Wakes the prefetch thread if
+// it is parked, one semaphore post per idle to playing transition; a claim
+// while streams are already playing costs no syscall.
+int32 sample_stream_claim(SampleBank *bank, Sample *sample) {
+    if (!bank->streaming || sample->frame_count <= (uint64) sample->attack_frames) return -1;
+    for (int32 index = 0; index < SAMPLE_MAX_STREAMS; index++) {
+        SampleStream *stream = &bank->streams[index];
+        if (atomic_load_explicit(&stream->state, memory_order_acquire) != STREAM_FREE) continue;
+        stream->sample = sample;
+        atomic_store_explicit(&stream->write_frame, sample->attack_frames, memory_order_relaxed);
+        atomic_store_explicit(&stream->read_frame, sample->attack_frames, memory_order_relaxed);
+        atomic_store(&stream->state, STREAM_PLAYING); // Ordered before the parked check
+        if (atomic_load(&bank->parked) && atomic_exchange(&bank->parked, 0)) semaphore_post(&bank->wake);
+        return index;
+    }
+    return -1;
+}
+
+void sample_stream_release(SampleBank *bank, int32 index) {
+    if (index >= 0) atomic_store_explicit(&bank->streams[index].state, STREAM_STOPPING, memory_order_release);
+}
+
+// Playback position step per output sample, 32.32 fixed point frames, for a
+// note whose oscillator increment (see phase_increment) is increment
+uint64 sample_step(Sample *sample, uint32 increment, float32 sample_rate) {
+    float64 frequency = increment * (1.0 / 4294967296.0) * sample_rate;
+    return (uint64) (frequency / sample->root_frequency * sample->sample_rate / sample_rate * 4294967296.0);
+}
+
+// One frame from wherever it is: the attack, the ring, or silence past
+// either end or where the ring hasn't caught up. Counts the frames the ring
+// should have had in missing.
+float32 sample_frame(Sample *sample, SampleStream *stream, uint64 written, int64 frame, uint32 *missing) {
+    if (frame < 0 || (uint64) frame >= sample->frame_count) return 0.0f;
+    if (frame < sample->attack_frames) return sample->attack[frame];
+    if (!stream) return 0.0f; // Attack only, no stream was free
+    if ((uint64) frame >= written) {
+        (*missing)++;
+        return 0.0f;
+    }
+    return stream->frames[frame % SAMPLE_STREAM_FRAMES];
+}
+
+// Add total_samples of sample, read from position at step (both 32.32 fixed
+// point frames) through table, into out. stream may be NULL. Returns the new
+// position.
+uint64 sample_render(SampleBank *bank, const ResampleTable *table, Sample *sample, SampleStream *stream,
+                     uint64 position, uint64 step, float32 amplitude, float32 *out, int32 total_samples) {
+    uint64 written = stream ? atomic_load_explicit(&stream->write_frame, memory_order_acquire) : 0;
+    uint32 missing = 0;
+    int32 taps = table->taps;
+    int32 before = taps / 2 - 1; // Frames read before the one at the read point
+    float32 gathered[RESAMPLE_MAX_TAPS];
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        int64 first = (int64) (position >> 32) - before;
+
+        // Read in place when every tap is in the attack or one unwrapped run
+        // of the ring, otherwise frame by frame
+        const float32 *frames = gathered;
+        uint64 ring_start = (uint64) first % SAMPLE_STREAM_FRAMES;
+        if (first >= 0 && first + taps <= sample->attack_frames) {
+            frames = sample->attack + first;
+        } else if (stream && first >= sample->attack_frames && (uint64) (first + taps) <= written &&
+                   ring_start + taps <= SAMPLE_STREAM_FRAMES) {
+            frames = stream->frames + ring_start;
+        } else {
+            for (int32 tap = 0; tap < taps; tap++) {
+                gathered[tap] = sample_frame(sample, stream, written, first + tap, &missing);
+            }
+        }
+
+        float32 fraction;
+        const float32 *row = resample_row(table, position, &fraction);
+        out[sample_index] += amplitude * resample_dot(frames, row, fraction, taps);
+        position += step;
+    }
+
+    // Everything before the first frame the next block reads may be reused
+    if (stream) {
+        uint64 done = position >> 32;
+        done = (done > (uint64) before) ? done - before : 0;
+        if (done > atomic_load_explicit(&stream->read_frame, memory_order_relaxed)) {
+            atomic_store_explicit(&stream->read_frame, done, memory_order_release);
+        }
+    }
+    if (missing) atomic_fetch_add_explicit(&bank->underruns, missing, memory_order_relaxed);
+    return position;
+}
+
+#endif
@@ -0,0 +1,125 @@
+#if !defined(SCOPE_H)
+#define SCOPE_H
+
+#include <stdatomic.h>
+#include "platform.h"
+#include "command_queue.h"
+#include "effects.h"
+
+// Output tap for the oscilloscope and spectrum views. The audio thread
+// averages every SCOPE_DECIMATION frames it has just written to the device
+// into one and appends it to a ring; the UI copies the newest frames out
+// whenever it redraws.
+//
+// The audio thread never waits on the UI. There is no read index: the writer
+// just keeps going around the ring, and a reader that was lapped while it
+// copied sees that on the claimed counter, drops the copy and tries again on
+// its next frame. Claimed is moved past a write before the frames are stored
+// and written after, the same way engine.h publishes its clock.
+
+#define SCOPE_RING_FRAMES 8192 // Must be a power of two
+#define SCOPE_DECIMATION 2
+
+// The spectrum reuses the reverb's FFT
+#define SPECTRUM_SIZE REVERB_FFT_SIZE
+#define SPECTRUM_BINS (SPECTRUM_SIZE / 2 + 1)
+#define SPECTRUM_FLOOR_DB -100.0f
+
+typedef struct {
+    // Written by the audio thread, read by the UI
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32 claimed; // Frames that are, or are about to be, in the ring
+    _Atomic uint32 written;                           // Frames that are in the ring
+
+    // Audio thread only, a decimated frame in progress
+    float32 pending_sum;
+    int32 pending_count;
+
+    _Alignas(CACHE_LINE_SIZE) _Atomic float32 frames[SCOPE_RING_FRAMES];
+} ScopeFeed;
+
+typedef struct {
+    FftTables fft;
+    float32 window[SPECTRUM_SIZE];
+    float32 window_gain; // Scales a full scale sine to 0 dB
+    float32 real[SPECTRUM_SIZE];
+    float32 imag[SPECTRUM_SIZE];
+} Spectrum;
+
+void scope_init(ScopeFeed *scope) {
+    atomic_init(&scope->claimed, 0);
+    atomic_init(&scope->written, 0);
+    scope->pending_sum = 0.0f;
+    scope->pending_count = 0;
+    for (int32 index = 0; index < SCOPE_RING_FRAMES; index++) atomic_init(&scope->frames[index], 0.0f);
+}
+
+// Audio thread: append total_samples frames of output
+void scope_write(ScopeFeed *scope, const float32 *samples, int32 total_samples) {
+    uint32 written = atomic_load_explicit(&scope->written, memory_order_relaxed);
+    uint32 count = (uint32) ((scope->pending_count + total_samples) / SCOPE_DECIMATION);
+    atomic_store_explicit(&scope->claimed, written + count, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    float32 sum = scope->pending_sum;
+    int32 pending = scope->pending_count;
+    for (int32 index = 0; index < total_samples; index++) {
+        sum += samples[index];
+        if (++pending == SCOPE_DECIMATION) {
+            atomic_store_explicit(&scope->frames[written & (SCOPE_RING_FRAMES - 1)],
+                                  sum * (1.0f / SCOPE_DECIMATION), memory_order_relaxed);
+            written++;
+            sum = 0.0f;
+            pending = 0;
+        }
+    }
+    scope->pending_sum = sum;
+    scope->pending_count = pending;
+    atomic_store_explicit(&scope->written, written, memory_order_release);
+}
+
+// UI thread: copy the newest count frames into out, oldest first. Returns 0
+// if there aren't that many yet or the audio thread overwrote some of them
+// mid copy. position gets the frame count the copy ends at, so the caller can
+// tell whether anything new arrived since last time.
+bool32 scope_read(ScopeFeed *scope, float32 *out, int32 count, uint32 *position) {
+    uint32 end = atomic_load_explicit(&scope->written, memory_order_acquire);
+    if (end < (uint32) count) return 0;
+    uint32 start = end - count;
+    for (int32 index = 0; index < count; index++) {
+        out[index] = atomic_load_explicit(&scope->frames[(start + index) & (SCOPE_RING_FRAMES - 1)],
+                                          memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&scope->claimed, memory_order_relaxed) - start > SCOPE_RING_FRAMES) return 0;
+    *position = end;
+    return 1;
+}
+
+// Hann window, normalized so a full scale sine reads 0 dB in its bin
+void spectrum_init(Spectrum *spectrum) {
+    fft_init(&spectrum->fft);
+    float64 sum = 0.0;
+    for (int32 index = 0; index < SPECTRUM_SIZE; index++) {
+        spectrum->window[index] = (float32) (0.5 - 0.5 * cos(TWO_PI * index / SPECTRUM_SIZE));
+        sum += spectrum->window[index];
+    }
+    spectrum->window_gain = (float32) (2.0 / sum);
+}
+
+// Level in dB of each bin of the SPECTRUM_SIZE frames, from DC to Nyquist
+void spectrum_analyze(Spectrum *spectrum, const float32 *frames, float32 *decibels) {
+    for (int32 index = 0; index < SPECTRUM_SIZE; index++) {
+        spectrum->real[index] = frames[index] * spectrum->window[index];
+        spectrum->imag[index] = 0.0f;
+    }
+    fft(&spectrum->fft, spectrum->real, spectrum->imag, -1);
+
+    float32 floor_power = powf(10.0f, SPECTRUM_FLOOR_DB / 10.0f);
+    float32 gain = spectrum->window_gain * spectrum->window_gain;
+    for (int32 bin = 0; bin < SPECTRUM_BINS; bin++) {
+        float32 power = gain * (spectrum->real[bin] * spectrum->real[bin] + spectrum->imag[bin] * spectrum->imag[bin]);
+        decibels[bin] = (power > floor_power) ? 10.0f * log10f(power) : SPECTRUM_FLOOR_DB;
+    }
+}
+
+#endif
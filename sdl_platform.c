@@ -1,216 +1,479 @@
+#define _GNU_SOURCE // pthread_setaffinity_np in workers.h
 #include <stdio.h>
 #include <stdbool.h>
 #include <SDL2/SDL.h>
 #include "platform.h"
+#include "arena.h"
 #include "notes.h"
+#include "engine.h"
+#include "output.h"
+#include "meter.h"
+#include "scope.h"
 
 #define SECONDS 6
 #define CHANNELS 2
-#define PI 3.14159265359f
-#define TWO_PI 6.28318530718f
+#define DEFAULT_BUFFER_FRAMES 4096
+#define LOW_LATENCY_BUFFER_FRAMES 128
+#define MAX_BLOCK_FRAMES 4096 // Largest block the engine renders in one go
+#define FRAME_MS 16 // How often the scope and spectrum redraw
 
-float32 samples_per_second = 44100.0;
-float32 tone_hz = 440.0;
-float32 tone_volume = 5000;
+float32 samples_per_second = 44100.0; // Engine rate, the device may run at another
+float32 tone_volume = 0.15f; // Per voice amplitude on the float mix bus
 
 
 typedef struct {
-    float32 theta;
-    int16 *buffer;
-} SineState;
-
-SineState get_sine_state(int16 *buffer) {
-    SineState result;
-    result.theta = 0;
-    result.buffer = buffer;
-    return result;
-}
+    void *user_data;
+    Engine engine;
+    float32 *mix_bus; // MAX_BLOCK_FRAMES long
+
+    // Output format, taken from obtained_spec when the device is opened
+    OutputFormat format;
+    int32 channels;
+    int32 block_frames;
+    float32 device_rate;
+    Dither dither;
+
+    // Engine rate to device rate, when they differ
+    bool32 resampling;
+    ResampleQuality resample_quality;
+    Resampler resampler;
+    float32 *resampled; // MAX_BLOCK_FRAMES long
+
+    DspMeter meter;
+    ScopeFeed scope; // What was just played, for the UI
+} AudioData;
+
 
-void generate_sine(SineState *audio_data, int32 len) {
-    int16 *sample_write = audio_data->buffer;
-    int16 sample_value;
-    float32 angle_add = TWO_PI * tone_hz / samples_per_second;
+// Voices play the engine's compiled patch, see patch.h; load a different one
+// with engine_load_patch
+void audio_callback(void *userdata, Uint8 *stream, int32 len) {
+    AudioData *audio_data = (AudioData *) userdata;
+    uint64 start_counter = SDL_GetPerformanceCounter();
+    audio_thread_begin();
 
-    int32 bytes_per_sample = sizeof(uint16) * CHANNELS;
+    int32 bytes_per_value = (audio_data->format == OUTPUT_F32) ? sizeof(float32) : sizeof(int16);
+    int32 bytes_per_sample = bytes_per_value * audio_data->channels;
     int32 total_samples = len / bytes_per_sample;
 
-    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
-        float32 sval = tone_volume * sinf(audio_data->theta);
-        audio_data->theta += angle_add;
-        if (audio_data->theta > TWO_PI) {
-            audio_data->theta -= TWO_PI;
+    // SDL normally asks for exactly one obtained_spec.samples block, but
+    // render in block_frames pieces so a larger request can't overrun mix_bus
+    engine_publish_clock(&audio_data->engine, start_counter);
+    int32 frames;
+    for (int32 offset = 0; offset < total_samples; offset += frames) {
+        frames = total_samples - offset;
+        if (frames > audio_data->block_frames) frames = audio_data->block_frames;
+
+        float32 *output = audio_data->mix_bus;
+        if (audio_data->resampling) {
+            // As many device frames as the engine frames behind them fit in mix_bus
+            Resampler *resampler = &audio_data->resampler;
+            int32 most = resampler_max_output(resampler, MAX_BLOCK_FRAMES);
+            if (frames > most) frames = most;
+            int32 engine_frames = resampler_input_needed(resampler, frames);
+            engine_render(&audio_data->engine, audio_data->mix_bus, engine_frames);
+            resampler_process(resampler, audio_data->mix_bus, engine_frames, audio_data->resampled, frames);
+            output = audio_data->resampled;
+        } else {
+            engine_render(&audio_data->engine, audio_data->mix_bus, frames);
         }
-        sample_value = (int16) sval;
 
-        // Write the sample_value to the buffer for each channel
-        for (int32 channel = 0; channel < CHANNELS; channel++) {
-            *sample_write++ = sample_value;
-        }
+        write_output(stream + offset * bytes_per_sample, audio_data->format, output,
+                     frames, audio_data->channels, &audio_data->dither);
+        scope_write(&audio_data->scope, output, frames);
     }
-}
 
-typedef struct {
-    float32 level;
-    int32 sign;
-    int16 *buffer;
-} TriangleState;
-
-TriangleState get_triangle_state(int16 *buffer) {
-    TriangleState result;
-    result.level = 0;
-    result.sign = 1;
-    result.buffer = buffer;
-    return result;
+    audio_thread_end();
+    meter_record(&audio_data->meter, start_counter, SDL_GetPerformanceCounter(), total_samples,
+                 audio_data->device_rate);
 }
 
-void generate_triangle(TriangleState *audio_state, int32 len) {
-    int16 *sample_write = audio_state->buffer;
+// Open the default output with whatever rate, format and buffer size the
+// device prefers, then size the engine to match. Only S16 and F32 output are
+// written, so any other format is retried with SDL converting for us. The
+// engine keeps its own rate; if the device's differs we resample, SDL never
+// does. Reopening asks for the rate, format and channels the device had
+// before.
+SDL_AudioDeviceID open_audio_device(AudioData *audio_data, int32 buffer_frames, int32 allowed_changes) {
+    SDL_AudioSpec wanted_spec;
+    SDL_AudioSpec obtained_spec;
 
-    int32 bytes_per_sample = sizeof(uint16) * CHANNELS;
-    int32 total_samples = len / bytes_per_sample;
+    SDL_zero(wanted_spec);
+    bool reopening = audio_data->device_rate > 0;
+    wanted_spec.freq = reopening ? audio_data->device_rate : audio_data->engine.sample_rate;
+    wanted_spec.format = (reopening && audio_data->format == OUTPUT_F32) ? AUDIO_F32SYS : AUDIO_S16SYS;
+    wanted_spec.channels = reopening ? audio_data->channels : CHANNELS;
+    wanted_spec.samples = buffer_frames;
+    wanted_spec.callback = audio_callback;
+    wanted_spec.userdata = audio_data;
 
-    int32 period = samples_per_second / tone_hz;
-    int32 half_period = period / 2;
-    int32 volume_steps_per_sample = 2 * tone_volume / half_period;
-    int16 sample_value = audio_state->level;
-    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+    int32 iscapture = 0;
+    const char* device_name = SDL_GetAudioDeviceName(0, iscapture);
+    SDL_AudioDeviceID device = SDL_OpenAudioDevice(device_name, iscapture, &wanted_spec,
+                                                   &obtained_spec, allowed_changes);
+    if (device != 0 && obtained_spec.format != AUDIO_S16SYS && obtained_spec.format != AUDIO_F32SYS) {
+        SDL_CloseAudioDevice(device);
+        allowed_changes &= ~SDL_AUDIO_ALLOW_FORMAT_CHANGE;
+        device = SDL_OpenAudioDevice(device_name, iscapture, &wanted_spec,
+                                     &obtained_spec, allowed_changes);
+    }
+    if (device == 0) {
+        printf("SDL_OpenAudioDevice error: %s\n", SDL_GetError());
+        return 0;
+    }
 
-        // Create the triangle wav
-        if (sample_value <= -tone_volume) audio_state->sign = 1;
-        if (sample_value >= tone_volume) audio_state->sign = -1;
-        sample_value += audio_state->sign * volume_steps_per_sample;
+    // The device is still paused, so the engine can be resized safely
+    audio_data->format = (obtained_spec.format == AUDIO_F32SYS) ? OUTPUT_F32 : OUTPUT_S16;
+    audio_data->channels = obtained_spec.channels;
+    audio_data->block_frames = obtained_spec.samples;
+    if (audio_data->block_frames > MAX_BLOCK_FRAMES) audio_data->block_frames = MAX_BLOCK_FRAMES;
+    audio_data->device_rate = obtained_spec.freq;
+
+    // The engine schedules in its own frames, a device block's worth of them
+    float32 engine_rate = audio_data->engine.sample_rate;
+    audio_data->engine.block_frames = (int32) ceilf(obtained_spec.samples * engine_rate / obtained_spec.freq);
+    audio_data->resampling = obtained_spec.freq != (int32) engine_rate;
+    float32 resampler_ms = 0.0f;
+    if (audio_data->resampling) {
+        resampler_init(&audio_data->resampler, engine_rate, obtained_spec.freq, audio_data->resample_quality);
+        resampler_ms = 1000.0f * resampler_latency(&audio_data->resampler) / engine_rate;
+    }
 
-        // Write the sample_value to the buffer for each channel
-        for (int32 channel = 0; channel < CHANNELS; channel++) {
-            *sample_write++ = sample_value;
-        }
+    // A key press waits up to one block to be scheduled and then one more
+    // buffer before it is heard
+    float32 buffer_ms = 1000.0f * obtained_spec.samples / obtained_spec.freq;
+    printf("Audio device: %d Hz, %d channels, %s, %d frame buffer\n", obtained_spec.freq,
+           obtained_spec.channels, (obtained_spec.format == AUDIO_F32SYS) ? "f32" : "s16",
+           obtained_spec.samples);
+    if (audio_data->resampling) {
+        printf("Resampling from the engine's %.0f Hz, %s quality, %.1f ms, %s kernel\n", engine_rate,
+               resample_tiers[audio_data->resample_quality].name, resampler_ms, resample_path);
     }
-    audio_state->level = sample_value;
+    printf("Output latency %.1f ms, key to sound %.1f ms\n", buffer_ms + resampler_ms,
+           2.0f * buffer_ms + resampler_ms);
+    return device;
 }
 
-typedef struct {
-    float32 level;
-    int16 *buffer;
-} SawtoothState;
-
-SawtoothState get_sawtooth_state(int16 *buffer) {
-    SawtoothState result;
-    result.level = 0;
-    result.buffer = buffer;
-    return result;
+// Main thread side: stamp a command and hand it to the audio thread
+void send_command(AudioData *audio_data, Command command) {
+    command.time = engine_schedule_time(&audio_data->engine, SDL_GetPerformanceCounter(),
+                                        SDL_GetPerformanceFrequency());
+    if (!engine_send(&audio_data->engine, command)) {
+        printf("Command queue full, dropping command %d\n", command.type);
+    }
 }
 
-void generate_sawtooth(SawtoothState *audio_state, int32 len) {
-    int16 *sample_write = audio_state->buffer;
+void play_note(AudioData *audio_data, int32 note) {
+    Command command = {0};
+    command.type = COMMAND_NOTE_ON;
+    command.note = note;
+    command.value = note_frequency(note);
+    send_command(audio_data, command);
+}
 
-    int32 bytes_per_sample = sizeof(uint16) * CHANNELS;
-    int32 total_samples = len / bytes_per_sample;
+void stop_note(AudioData *audio_data, int32 note) {
+    Command command = {0};
+    command.type = COMMAND_NOTE_OFF;
+    command.note = note;
+    send_command(audio_data, command);
+}
 
-    int32 period = samples_per_second / tone_hz;
-    int32 half_period = period / 2;
-    int32 volume_steps_per_sample = 2*tone_volume / period;
-    int16 sample_value = audio_state->level;
-    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+void set_wave_type(AudioData *audio_data, WaveType wave_type) {
+    Command command = {0};
+    command.type = COMMAND_WAVE_TYPE;
+    command.wave_type = wave_type;
+    send_command(audio_data, command);
+}
 
-        if (sample_value >= tone_volume) sample_value = -tone_volume;
-        sample_value += volume_steps_per_sample;
+void set_parameter(AudioData *audio_data, Parameter parameter, float32 value) {
+    Command command = {0};
+    command.type = COMMAND_PARAMETER;
+    command.parameter = parameter;
+    command.value = value;
+    send_command(audio_data, command);
+}
 
-        // Write the sample_value to the buffer for each channel
-        for (int32 channel = 0; channel < CHANNELS; channel++) {
-            *sample_write++ = sample_value;
-        }
+// C major scale on the home row, -1 for keys that don't play a note
+int32 key_note(SDL_Keycode key) {
+    switch (key) {
+        case SDLK_a: return 60; // C4
+        case SDLK_s: return 62; // D4
+        case SDLK_d: return 64; // E4
+        case SDLK_f: return 65; // F4
+        case SDLK_g: return 67; // G4
+        case SDLK_h: return 69; // A4
+        case SDLK_j: return 71; // B4
+        case SDLK_k: return 72; // C5
+        default: return -1;
     }
-    audio_state->level = sample_value;
 }
 
+//
+// Display
+//
+
+// Everything is drawn at VIEW_WIDTH by VIEW_HEIGHT into a canvas texture that
+// is stretched over the window. The canvas keeps its contents between
+// frames, so a key press only redraws that key and the views only redraw
+// when the audio thread has written something new.
+
+#define VIEW_WIDTH 1400
+#define VIEW_HEIGHT 800
+#define KEYBOARD_KEYS 8
+#define SCOPE_VIEW_FRAMES 2048  // Read from the feed per redraw, the trigger is looked for in the first half
+#define SCOPE_WIDTH_FRAMES 1024 // Shown across the scope
+#define SPECTRUM_LOW_HZ 40.0f
+
+int32 keyboard_notes[KEYBOARD_KEYS] = {60, 62, 64, 65, 67, 69, 71, 72}; // key_note's white keys, left to right
+bool keyboard_black_keys[KEYBOARD_KEYS] = {true, true, false, true, true, true, false, false}; // To the right
+
+SDL_Rect scope_rect = {40, 40, 640, 380};
+SDL_Rect spectrum_rect = {720, 40, 640, 380};
+SDL_Rect keyboard_rect = {380, 480, 640, 280};
+
 typedef struct {
-    float32 level;
-    int32 last;
-    int32 sign;
-    int16 *buffer;
-} SquareState;
-
-SquareState get_square_state(int16 *buffer) {
-    SquareState result;
-    result.level = 0;
-    result.last = 0;
-    result.sign = 1;
-    result.buffer = buffer;
-    return result;
+    SDL_Renderer *renderer;
+    SDL_Texture *canvas; // NULL if the renderer can't draw to textures, then every frame is drawn whole
+    bool redraw_all;     // The canvas was lost or never drawn
+    bool present;        // The window needs the canvas again
+    bool key_down[KEYBOARD_KEYS];
+    bool key_dirty[KEYBOARD_KEYS];
+
+    uint32 scope_position; // Where the feed was when the views were last drawn
+    float32 frames[SCOPE_VIEW_FRAMES];
+    float32 decibels[SPECTRUM_BINS];
+    SDL_Point points[VIEW_WIDTH];
+    Spectrum spectrum;
+} Display;
+
+void display_create_canvas(Display *display) {
+    display->canvas = NULL;
+    if (SDL_RenderTargetSupported(display->renderer)) {
+        display->canvas = SDL_CreateTexture(display->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+                                            VIEW_WIDTH, VIEW_HEIGHT);
+    }
+    display->redraw_all = true;
 }
 
-void generate_square(SquareState *audio_state, int32 len) {
-    int16 *sample_write = audio_state->buffer;
+void display_init(Display *display, SDL_Renderer *renderer) {
+    memset(display, 0, sizeof(*display));
+    display->renderer = renderer;
+    display_create_canvas(display);
+    spectrum_init(&display->spectrum);
+}
 
-    int32 bytes_per_sample = sizeof(uint16) * CHANNELS;
-    int32 total_samples = len / bytes_per_sample;
+// The window was exposed or resized. contents_lost is for the renderer
+// dropping its textures, which takes the canvas with it.
+void display_invalidate(Display *display, bool contents_lost) {
+    if (contents_lost) {
+        if (display->canvas) SDL_DestroyTexture(display->canvas);
+        display_create_canvas(display);
+    }
+    if (!display->canvas) display->redraw_all = true;
+    display->present = true;
+}
+
+void display_set_key(Display *display, int32 note, bool down) {
+    for (int32 key = 0; key < KEYBOARD_KEYS; key++) {
+        if (keyboard_notes[key] != note || display->key_down[key] == down) continue;
+        display->key_down[key] = down;
+        display->key_dirty[key] = true;
+    }
+}
+
+SDL_Rect white_key_rect(int32 key) {
+    int32 width = keyboard_rect.w / KEYBOARD_KEYS;
+    SDL_Rect rect = {keyboard_rect.x + key * width, keyboard_rect.y, width, keyboard_rect.h};
+    return rect;
+}
 
-    int32 period = samples_per_second / tone_hz;
-    int32 half_period = period / 2;
-    int16 sample_value;
-    int32 sample_index;
-    for (sample_index = 0; sample_index < total_samples; sample_index++) {
+SDL_Rect black_key_rect(int32 key) {
+    SDL_Rect white = white_key_rect(key);
+    int32 width = 3 * white.w / 5;
+    SDL_Rect rect = {white.x + white.w - width / 2, white.y, width, 3 * white.h / 5};
+    return rect;
+}
 
-        if ((sample_index + audio_state->last) % half_period == 0) {
-            audio_state->sign *= -1;
+// Redraw the dirty white keys and the black keys lying over them
+void draw_keyboard(Display *display) {
+    SDL_Renderer *renderer = display->renderer;
+    for (int32 key = 0; key < KEYBOARD_KEYS; key++) {
+        if (!display->key_dirty[key]) continue;
+        display->key_dirty[key] = false;
+
+        SDL_Rect rect = white_key_rect(key);
+        if (display->key_down[key]) SDL_SetRenderDrawColor(renderer, 120, 180, 240, 255);
+        else SDL_SetRenderDrawColor(renderer, 230, 230, 230, 255);
+        SDL_RenderFillRect(renderer, &rect);
+        SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255);
+        SDL_RenderDrawRect(renderer, &rect);
+
+        SDL_SetRenderDrawColor(renderer, 10, 10, 10, 255);
+        for (int32 black = key - 1; black <= key; black++) {
+            if (black < 0 || !keyboard_black_keys[black]) continue;
+            SDL_Rect black_rect = black_key_rect(black);
+            SDL_RenderFillRect(renderer, &black_rect);
         }
+    }
+}
 
-        sample_value = audio_state->sign * tone_volume;
+void clear_view(Display *display, SDL_Rect *rect) {
+    SDL_SetRenderDrawColor(display->renderer, 20, 20, 20, 255);
+    SDL_RenderFillRect(display->renderer, rect);
+    SDL_SetRenderDrawColor(display->renderer, 60, 60, 60, 255);
+    SDL_RenderDrawRect(display->renderer, rect);
+}
 
-        // Write the sample_value to the buffer for each channel
-        for (int32 channel = 0; channel < CHANNELS; channel++) {
-            *sample_write++ = sample_value;
+// A window of the newest frames starting at a rising zero crossing, so a
+// steady tone holds still
+void draw_scope(Display *display) {
+    SDL_Rect *rect = &scope_rect;
+    clear_view(display, rect);
+    int32 center = rect->y + rect->h / 2;
+    SDL_RenderDrawLine(display->renderer, rect->x, center, rect->x + rect->w - 1, center);
+
+    int32 start = SCOPE_VIEW_FRAMES - SCOPE_WIDTH_FRAMES;
+    for (int32 frame = 1; frame < SCOPE_VIEW_FRAMES - SCOPE_WIDTH_FRAMES; frame++) {
+        if (display->frames[frame - 1] < 0.0f && display->frames[frame] >= 0.0f) {
+            start = frame;
+            break;
         }
     }
-    audio_state->last = (sample_index + audio_state->last) % half_period;
+
+    float32 half_height = 0.5f * (rect->h - 2);
+    for (int32 x = 0; x < rect->w; x++) {
+        float32 value = display->frames[start + x * SCOPE_WIDTH_FRAMES / rect->w];
+        if (value > 1.0f) value = 1.0f;
+        if (value < -1.0f) value = -1.0f;
+        display->points[x].x = rect->x + x;
+        display->points[x].y = center - (int32) (value * half_height);
+    }
+    SDL_SetRenderDrawColor(display->renderer, 80, 220, 120, 255);
+    SDL_RenderDrawLines(display->renderer, display->points, rect->w);
 }
 
-typedef struct {
-    void *user_data;
-    SineState sine_data;
-    TriangleState triangle_data;
-    SquareState square_data;
-    SawtoothState sawtooth_data;
-    enum WaveType {SIN, TRI, SQU, SAW} wave_type;
-} AudioData;
+// Newest SPECTRUM_SIZE frames on a log frequency axis, each pixel showing the
+// loudest bin under it
+void draw_spectrum(Display *display, float32 device_rate) {
+    SDL_Rect *rect = &spectrum_rect;
+    clear_view(display, rect);
+    spectrum_analyze(&display->spectrum, display->frames + SCOPE_VIEW_FRAMES - SPECTRUM_SIZE, display->decibels);
+
+    float32 bin_hz = device_rate / SCOPE_DECIMATION / SPECTRUM_SIZE;
+    float32 octaves = log2f(0.5f * SPECTRUM_SIZE * bin_hz / SPECTRUM_LOW_HZ);
+    int32 low = (int32) (SPECTRUM_LOW_HZ / bin_hz + 0.5f);
+    for (int32 x = 0; x < rect->w; x++) {
+        float32 next_hz = SPECTRUM_LOW_HZ * exp2f(octaves * (x + 1) / rect->w);
+        int32 high = (int32) (next_hz / bin_hz + 0.5f);
+        if (high > SPECTRUM_BINS - 1) high = SPECTRUM_BINS - 1;
+
+        float32 level = SPECTRUM_FLOOR_DB;
+        for (int32 bin = low; bin <= high; bin++) {
+            if (display->decibels[bin] > level) level = display->decibels[bin];
+        }
+        if (high > low) low = high;
 
+        display->points[x].x = rect->x + x;
+        display->points[x].y = rect->y + 1 + (int32) ((rect->h - 2) * level / SPECTRUM_FLOOR_DB);
+    }
+    SDL_SetRenderDrawColor(display->renderer, 90, 160, 230, 255);
+    SDL_RenderDrawLines(display->renderer, display->points, rect->w);
+}
 
-// @Todo: need to come up with a good solution for a general callback function
-void audio_callback(void *userdata, Uint8 *stream, int32 len) {
-    AudioData *audio_data = (AudioData *) userdata;
-    switch (audio_data->wave_type) {
-#if 0
-        case SIN:
-            generate_sine(&audio_data->sine_data, len);
-            memcpy(stream, (uint8 *) audio_data->sine_data.buffer, len);
-            break;
-        case TRI:
-            generate_triangle(&audio_data->triangle_data, len);
-            memcpy(stream, (uint8 *) audio_data->triangle_data.buffer, len);
-            break;
-        case SQU:
-            generate_square(&audio_data->square_data, len);
-            memcpy(stream, (uint8 *) audio_data->square_data.buffer, len);
-            break;
-        case SAW:
-            generate_sawtooth(&audio_data->sawtooth_data, len);
-            memcpy(stream, (uint8 *) audio_data->sawtooth_data.buffer, len);
-            break;
-#endif
-        default:
-            break;
+// Called every FRAME_MS. Draws what changed into the canvas and presents it,
+// or does nothing at all if nothing did.
+void display_update(Display *display, ScopeFeed *scope, float32 device_rate) {
+    uint32 position;
+    bool new_audio = scope_read(scope, display->frames, SCOPE_VIEW_FRAMES, &position) &&
+                     position != display->scope_position;
+    if (new_audio) display->scope_position = position;
+
+    bool keys_changed = false;
+    for (int32 key = 0; key < KEYBOARD_KEYS; key++) keys_changed |= display->key_dirty[key];
+    if (!display->redraw_all && !keys_changed && !new_audio && !display->present) return;
+
+    // Without a canvas the back buffer is undefined after presenting
+    SDL_Renderer *renderer = display->renderer;
+    if (!display->canvas) display->redraw_all = true;
+    if (display->canvas) SDL_SetRenderTarget(renderer, display->canvas);
+    if (display->redraw_all) {
+        SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255);
+        SDL_RenderClear(renderer);
+        for (int32 key = 0; key < KEYBOARD_KEYS; key++) display->key_dirty[key] = true;
+    }
+
+    draw_keyboard(display);
+    if (new_audio || display->redraw_all) {
+        draw_scope(display);
+        draw_spectrum(display, device_rate);
     }
+    display->redraw_all = false;
+
+    if (display->canvas) {
+        SDL_SetRenderTarget(renderer, NULL);
+        SDL_RenderCopy(renderer, display->canvas, NULL, NULL);
+    }
+    SDL_RenderPresent(renderer);
+    display->present = false;
 }
 
 int32 main(int32 argc, char* argv[]){
     printf("Playing a wave.\n");
 
-    int32 bytes_per_sample = sizeof(Uint16) * CHANNELS;
-    int32 bytes_to_write = samples_per_second * bytes_per_sample; // number of bytes for a second of audio
+    // --low-latency starts with a small buffer and grows it while the
+    // machine can't keep up, --buffer <frames> asks for a fixed size.
+    // --dither adds TPDF dither to 16 bit output. --threads <count> adds that
+    // many worker threads to help the audio thread render voices.
+    // --rate <hz> sets the engine's rate and --resampler low|medium|high the
+    // quality used to convert it to the device's and to play samples.
+    // --sample <file.wav> adds a sampler patch playing that file, recorded
+    // at the note given by --root (C4 by default). --reverb <ir.wav> replaces
+    // the generated impulse response the reverb starts with.
+    int32 buffer_frames = DEFAULT_BUFFER_FRAMES;
+    bool low_latency = false;
+    bool dither = false;
+    int32 thread_count = 0;
+    char *sample_path = NULL;
+    char *root_note = "C4";
+    char *reverb_path = NULL;
+    ResampleQuality resample_quality = RESAMPLE_MEDIUM;
+    for (int32 arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "--low-latency") == 0) {
+            low_latency = true;
+            buffer_frames = LOW_LATENCY_BUFFER_FRAMES;
+        } else if (strcmp(argv[arg], "--buffer") == 0 && arg + 1 < argc) {
+            buffer_frames = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--dither") == 0) {
+            dither = true;
+        } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+            thread_count = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--sample") == 0 && arg + 1 < argc) {
+            sample_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--root") == 0 && arg + 1 < argc) {
+            root_note = argv[++arg];
+        } else if (strcmp(argv[arg], "--reverb") == 0 && arg + 1 < argc) {
+            reverb_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--rate") == 0 && arg + 1 < argc) {
+            samples_per_second = atof(argv[++arg]);
+        } else if (strcmp(argv[arg], "--resampler") == 0 && arg + 1 < argc) {
+            if (!resample_quality_from_name(argv[++arg], &resample_quality)) {
+                printf("Unknown resampler quality '%s', using medium\n", argv[arg]);
+            }
+        }
+    }
+
+    if (samples_per_second <= 0) {
+        printf("Sample rate must be positive\n");
+        return 1;
+    }
 
-    void *sound_buffer = malloc(bytes_to_write);
-    Sint16 *sample_write = (Sint16 *)sound_buffer;
-    Sint16 *sample_start = sample_write;
+    // Everything the engine needs comes out of this one reservation
+    void *engine_memory = reserve_memory(ENGINE_MEMORY_SIZE);
+    if (!engine_memory) {
+        printf("Could not reserve %d bytes for the engine\n", ENGINE_MEMORY_SIZE);
+        return 1;
+    }
+    MemoryArena arena;
+    arena_init(&arena, engine_memory, ENGINE_MEMORY_SIZE);
 
     // Init SDL
     if (SDL_Init(SDL_INIT_VIDEO|SDL_INIT_AUDIO) < 0) {
@@ -218,88 +481,119 @@ int32 main(int32 argc, char* argv[]){
         return 1;
     }
 
-    SDL_AudioSpec wanted_spec;
-    SDL_AudioSpec obtained_spec;
+    wavetable_init();
+    oscillator_simd_init();
+    resample_tables_init();
+    printf("Oscillator path: %s\n", oscillator_path);
+
+    AudioData *audio_data = arena_push_struct(&arena, AudioData);
+    engine_init(&audio_data->engine, &arena, samples_per_second, buffer_frames);
+    audio_data->engine.volume = tone_volume;
+    audio_data->engine.wave_type = SIN; // @Update: the wave_type should be initialized to a better default
+    audio_data->mix_bus = arena_push_array(&arena, float32, MAX_BLOCK_FRAMES);
+    audio_data->resampled = arena_push_array(&arena, float32, MAX_BLOCK_FRAMES);
+    audio_data->resample_quality = resample_quality;
+    audio_data->engine.voices.sample_quality = resample_quality;
+    dither_init(&audio_data->dither, dither);
+    meter_init(&audio_data->meter, SDL_GetPerformanceFrequency());
+    scope_init(&audio_data->scope);
+
+    // The reverb is silent until something is loaded, start with a generated room
+    Reverb *reverb = &audio_data->engine.effects->reverb;
+    const char *reverb_error = reverb_path ? reverb_load_file(reverb, reverb_path) : NULL;
+    if (reverb_error) printf("Could not load %s: %s\n", reverb_path, reverb_error);
+    if (!reverb_path || reverb_error) reverb_generate(reverb, 2.0f, samples_per_second);
+
+    // Samples are mapped now and streamed by the prefetch thread from here on
+    Sample *sample = NULL;
+    if (sample_path) {
+        int32 root = parse_note_name(root_note);
+        if (root < 0) root = parse_note_name("C4");
+        const char *error = sample_load(audio_data->engine.sample_bank, sample_path, note_frequency(root), &sample);
+        if (error) {
+            printf("Could not load %s: %s\n", sample_path, error);
+            sample = NULL;
+        } else if (!sample_bank_start(audio_data->engine.sample_bank)) {
+            printf("Could not start the sample prefetch thread, playing without %s\n", sample_path);
+            sample_bank_disable(audio_data->engine.sample_bank);
+            sample = NULL;
+        }
+    }
 
-    SineState sine_audio_data = get_sine_state(sample_start);
-    TriangleState triangle_audio_data = get_triangle_state(sample_start);
-    SawtoothState sawtooth_audio_data = get_sawtooth_state(sample_start);
-    SquareState square_audio_data = get_square_state(sample_start);
-
-    AudioData audio_data;
-    audio_data.sine_data = sine_audio_data;
-    audio_data.triangle_data = triangle_audio_data;
-    audio_data.square_data = square_audio_data;
-    audio_data.sawtooth_data = sawtooth_audio_data;
-
-    wanted_spec.freq = samples_per_second;
-    wanted_spec.format = AUDIO_S16;
-    wanted_spec.channels = CHANNELS;
-    wanted_spec.samples = 4096;
-    wanted_spec.callback = audio_callback;
-    wanted_spec.userdata = &audio_data;
-    audio_data.wave_type = SIN; // @Update: the wave_type should be initialized to a better default
+    // Spawn the workers before the device starts calling back
+    WorkerPool *workers = NULL;
+    if (thread_count > 0) {
+        workers = arena_push_struct(&arena, WorkerPool);
+        if (!worker_pool_start(workers, thread_count)) {
+            printf("Only started %d of %d worker threads\n", workers->thread_count, thread_count);
+        }
+        printf("Rendering on %d threads\n", worker_pool_participants(workers));
+        audio_data->engine.workers = workers;
+    }
 
     // Open the audio device
-    int32 iscapture = 0;
-    int32 allowed_changes = 0;
-    const char* device_name = SDL_GetAudioDeviceName(0, iscapture);
-    SDL_AudioDeviceID device = SDL_OpenAudioDevice(device_name, iscapture, &wanted_spec,
-                                                   &obtained_spec, allowed_changes);
+    int32 allowed_changes = SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_FORMAT_CHANGE |
+                            SDL_AUDIO_ALLOW_CHANNELS_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE;
+    SDL_AudioDeviceID device = open_audio_device(audio_data, buffer_frames, allowed_changes);
     if (device == 0) {
-        printf("SDL_OpenAudioDevice error: %s\n", SDL_GetError());
         return 1;
     }
 
-    // @TODO: Work on getting visuals up and running
-
     SDL_Window *window;
-    SDL_Renderer *renderer; // @Question: Do I need a renderer to draw to the window?
+    SDL_Renderer *renderer;
 
     // @Note: Use default renderer for now, in the future we may want to switch to something else
-    if (SDL_CreateWindowAndRenderer(1400, 800, SDL_WINDOW_RESIZABLE, &window, &renderer)) {
+    if (SDL_CreateWindowAndRenderer(VIEW_WIDTH, VIEW_HEIGHT, SDL_WINDOW_RESIZABLE, &window, &renderer)) {
         SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Couldn't create window and renderer: %s", SDL_GetError());
         return 1;
     }
-    SDL_Surface* surface = SDL_GetWindowSurface(window);
-    SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, surface);
 
     SDL_SetWindowTitle(window, "Audio Engine");
-
-    // Check that the window was successfully created
-    if (window == NULL) {
-        printf("Could not create window: %s\n", SDL_GetError());
-        return 1;
-    }
     SDL_ShowWindow(window);
 
-    SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255);
-    SDL_RenderClear(renderer);
-
-    SDL_Rect white_key;
-    white_key.x = 50; white_key.y = 50; white_key.w = 50; white_key.h = 50;
-    SDL_SetRenderDrawColor(renderer, 230, 230, 230, 255);
-    SDL_RenderFillRect(renderer, &white_key);
-
-    SDL_Rect black_key;
-    black_key.x = 150; black_key.y = 50; black_key.w = 50; black_key.h = 50;
-    SDL_SetRenderDrawColor(renderer, 10, 10, 10, 255);
-    SDL_RenderFillRect(renderer, &black_key);
-
-    SDL_RenderPresent(renderer);
+    Display *display = arena_push_struct(&arena, Display);
+    display_init(display, renderer);
+    display_update(display, &audio_data->scope, audio_data->device_rate);
 
     // Start playing
     SDL_PauseAudioDevice(device, 0);
 
     bool running = true;
     SDL_Event event;
-
+    FilterType filter_type = FILTER_NONE;
+    float32 cutoff = audio_data->engine.voices.filters[0].cutoff;
+    int32 patch_index = 0; // Default, stacked, then sampler if a sample is loaded
+    bool reverb_on = false;
+    bool delay_on = false;
+    uint32 last_meter_check = SDL_GetTicks();
+    MeterSnapshot last_meter;
+    meter_read(&audio_data->meter, &last_meter);
+
+    uint32 next_frame = SDL_GetTicks();
+
+    // Sleep in the event queue rather than polling it, so a key press wakes
+    // the main thread and goes to the engine straight away. The timeout only
+    // brings the next redraw around.
     while (running) {
-        while (SDL_PollEvent(&event)) {
+        int32 timeout = (int32) (next_frame - SDL_GetTicks());
+        if (timeout < 0) timeout = 0;
+        bool have_event = SDL_WaitEventTimeout(&event, timeout);
+        for (; have_event; have_event = SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT) {
                 running = false;
             }
 
+            if (event.type == SDL_WINDOWEVENT) {
+                if (event.window.event == SDL_WINDOWEVENT_EXPOSED ||
+                    event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                    display_invalidate(display, false);
+                }
+            }
+            if (event.type == SDL_RENDER_TARGETS_RESET || event.type == SDL_RENDER_DEVICE_RESET) {
+                display_invalidate(display, event.type == SDL_RENDER_DEVICE_RESET);
+                display->redraw_all = true;
+            }
+
             if (event.type == SDL_KEYDOWN && event.key.repeat == 0) {
                 switch (event.key.keysym.sym) {
                     case SDLK_q:
@@ -309,76 +603,135 @@ int32 main(int32 argc, char* argv[]){
                     // Wave types
                     case SDLK_w: // Sine
                         printf("Playing a sine\n");
-                        audio_data.wave_type = SIN;
+                        set_wave_type(audio_data, SIN);
                         break;
                     case SDLK_e: // Triangle
                         printf("Playing a triangle\n");
-                        audio_data.wave_type = TRI;
+                        set_wave_type(audio_data, TRI);
                         break;
                     case SDLK_r: // Square
                         printf("Playing a square\n");
-                        audio_data.wave_type = SQU;
+                        set_wave_type(audio_data, SQU);
                         break;
                     case SDLK_t: // Sawtooth
                         printf("Playing a sawtooth\n");
-                        audio_data.wave_type = SAW;
+                        set_wave_type(audio_data, SAW);
                         break;
 
-                    // C major scale
-                    case SDLK_a:
-                        tone_hz = get_frequency("C4");
-                        break;
-                    case SDLK_s:
-                        tone_hz = get_frequency("D4");
-                        break;
-                    case SDLK_d:
-                        tone_hz = get_frequency("E4");
+                    // Patch
+                    case SDLK_v: { // Cycle through the default, stacked and sampler patches
+                        char *patch_names[] = {"default", "stacked", "sampler"};
+                        Patch patch;
+                        patch_index = (patch_index + 1) % (sample ? 3 : 2);
+                        if (patch_index == 1) patch_stack(&patch);
+                        else if (patch_index == 2) patch_sampler_voice(&patch, sample);
+                        else patch_default(&patch);
+                        const char *error = engine_load_patch(&audio_data->engine, &patch);
+                        if (error) {
+                            printf("Patch error: %s\n", error);
+                        } else {
+                            printf("Playing the %s patch\n", patch_names[patch_index]);
+                            for (int32 node = patch.node_count - 1; node >= 0; node--) {
+                                if (patch.nodes[node].type != NODE_FILTER) continue;
+                                filter_type = patch.nodes[node].filter.type;
+                                cutoff = patch.nodes[node].filter.cutoff;
+                            }
+                        }
+                    } break;
+
+                    // Filter
+                    case SDLK_z: // Next filter type
+                        filter_type = (FilterType) ((filter_type + 1) % FILTER_TYPE_COUNT);
+                        printf("Filter type %d\n", filter_type);
+                        set_parameter(audio_data, PARAMETER_FILTER_TYPE, filter_type);
                         break;
-                    case SDLK_f:
-                        tone_hz = get_frequency("F4");
+                    case SDLK_x: // Cutoff down an octave
+                    case SDLK_c: // Cutoff up an octave
+                        cutoff *= (event.key.keysym.sym == SDLK_x) ? 0.5f : 2.0f;
+                        if (cutoff < 20.0f) cutoff = 20.0f;
+                        if (cutoff > 20000.0f) cutoff = 20000.0f;
+                        printf("Filter cutoff %.0f Hz\n", cutoff);
+                        set_parameter(audio_data, PARAMETER_CUTOFF, cutoff);
                         break;
-                    case SDLK_g:
-                        tone_hz = get_frequency("G4");
-                        break;
-                    case SDLK_h:
-                        tone_hz = get_frequency("A4");
-                        break;
-                    case SDLK_j:
-                        tone_hz = get_frequency("B4");
+
+                    // Effects
+                    case SDLK_b: // Reverb send on and off
+                        reverb_on = !reverb_on;
+                        printf("Reverb %s\n", reverb_on ? "on" : "off");
+                        set_parameter(audio_data, PARAMETER_REVERB_SEND, reverb_on ? 0.3f : 0.0f);
                         break;
-                    case SDLK_k:
-                        tone_hz = get_frequency("C5");
+                    case SDLK_n: // Delay send on and off
+                        delay_on = !delay_on;
+                        printf("Delay %s\n", delay_on ? "on" : "off");
+                        set_parameter(audio_data, PARAMETER_DELAY_SEND, delay_on ? 0.3f : 0.0f);
                         break;
 
                     default:
                         break;
                 }
+
+                int32 note = key_note(event.key.keysym.sym);
+                if (note >= 0) {
+                    play_note(audio_data, note);
+                    display_set_key(display, note, true);
+                }
             }
 
             if (event.type == SDL_KEYUP && event.key.repeat == 0) {
-                switch (event.key.keysym.sym) {
-                    // C major scale
-                    case SDLK_a:
-                    case SDLK_s:
-                    case SDLK_d:
-                    case SDLK_f:
-                    case SDLK_g:
-                    case SDLK_h:
-                    case SDLK_j:
-                    case SDLK_k:
-                        tone_hz = 0.0;
-                        break;
-                    default:
-                        break;
+                int32 note = key_note(event.key.keysym.sym);
+                if (note >= 0) {
+                    stop_note(audio_data, note);
+                    display_set_key(display, note, false);
+                }
+            }
+        }
+
+        if ((int32) (SDL_GetTicks() - next_frame) >= 0) {
+            display_update(display, &audio_data->scope, audio_data->device_rate);
+            next_frame = SDL_GetTicks() + FRAME_MS;
+        }
+
+        // Once a second show the DSP load in the title bar. In low latency
+        // mode, also step the buffer up while callbacks keep running over
+        // budget or the device runs dry. Reopening keeps the rate and format
+        // fixed so held voices stay in tune.
+        if (SDL_GetTicks() - last_meter_check >= 1000) {
+            last_meter_check = SDL_GetTicks();
+            MeterSnapshot meter;
+            meter_read(&audio_data->meter, &meter);
+
+            uint32 overruns = meter.overruns - last_meter.overruns;
+            uint32 underruns = meter.underruns - last_meter.underruns;
+            char title[128];
+            snprintf(title, sizeof(title), "Audio Engine - DSP %.1f%% (peak %.1f%%), %d frames, late %u, xruns %u",
+                     meter_average_load(&last_meter, &meter), meter_take_peak(&audio_data->meter),
+                     audio_data->block_frames, meter.late_callbacks, meter.underruns);
+            SDL_SetWindowTitle(window, title);
+            last_meter = meter;
+
+            // Sized in device frames, the engine's block is in its own rate's
+            if (low_latency && overruns + underruns >= 2 && audio_data->block_frames < MAX_BLOCK_FRAMES) {
+                int32 frames = 2 * audio_data->block_frames;
+                printf("%u callbacks over budget and %u underruns, reopening with a %d frame buffer\n",
+                       overruns, underruns, frames);
+                SDL_CloseAudioDevice(device);
+                meter_restart(&audio_data->meter);
+                device = open_audio_device(audio_data, frames, SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+                if (device == 0) {
+                    running = false;
+                    break;
                 }
+                SDL_PauseAudioDevice(device, 0);
             }
         }
-        SDL_Delay(50);
     }
 
     // Shut everything down
     SDL_DestroyWindow(window);
     SDL_CloseAudioDevice(device);
-    free(sound_buffer);
+    if (workers) worker_pool_stop(workers);
+    sample_bank_stop(audio_data->engine.sample_bank);
+    meter_dump(&audio_data->meter, stdout);
+    free(engine_memory);
     SDL_Quit();
 }
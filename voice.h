@@ -0,0 +1,510 @@
+#if !defined(VOICE_H)
+#define VOICE_H
+
+#include <string.h>
+#include "platform.h"
+#include "oscillator.h"
+#include "oscillator_simd.h"
+#include "envelope.h"
+#include "filter.h"
+#include "patch.h"
+#include "sampler.h"
+#include "arena.h"
+#include "workers.h"
+
+#define MAX_VOICES 256 // Must be a multiple of FILTER_LANES
+#define VOICE_JOB_VOICES FILTER_LANES // Voices per job, one filter group
+#define VOICE_CHUNK_FRAMES 256 // Patches run this many frames at a time so their buffers stay in cache
+
+// Struct-of-arrays voice pool. All storage lives inside the struct so the
+// pool is allocated once and never touches the heap. Active voices are kept
+// packed at the front of the arrays (index < active_count), so rendering
+// walks a dense range and never has to test whether a slot is in use.
+typedef struct {
+    uint32 phase[PATCH_MAX_OSCILLATORS][MAX_VOICES]; // Fixed-point position in the cycle, per oscillator
+    uint32 increment[MAX_VOICES];  // Phase step per sample at the note's pitch, see phase_increment
+    float32 amplitude[MAX_VOICES];
+    WaveType wave_type[MAX_VOICES];
+    int32 note[MAX_VOICES];        // Id used to match note off with note on
+    uint32 age[MAX_VOICES];        // Note on stamp, the smallest is the oldest voice
+
+    // Envelope state, see envelope.h
+    EnvelopeStage envelope_stage[MAX_VOICES];
+    float32 envelope_level[MAX_VOICES];
+    float32 envelope_target[MAX_VOICES]; // Aim point of the exponential stages
+    int32 envelope_samples_left[MAX_VOICES];
+
+    // Filter state per patch filter, see filter.h. Voices
+    // first..first+FILTER_LANES-1 are filtered together as one group.
+    _Alignas(32) float32 filter_state1[PATCH_MAX_FILTERS][MAX_VOICES];
+    _Alignas(32) float32 filter_state2[PATCH_MAX_FILTERS][MAX_VOICES];
+
+    // Playback state per patch sampler, see sampler.h
+    uint64 sample_position[PATCH_MAX_SAMPLERS][MAX_VOICES]; // 32.32 fixed point frames
+    int32 sample_stream[PATCH_MAX_SAMPLERS][MAX_VOICES];    // Index into the bank's streams, -1 for none
+
+    int32 active_count;
+    uint32 next_age;
+    float32 sample_rate;
+    Envelope envelope; // Used by every voice as it enters each stage
+    FilterSettings filters[PATCH_MAX_FILTERS]; // Shared by every voice, cutoff can follow the note
+    Sample *samples[PATCH_MAX_SAMPLERS];       // What each sampler plays, NULL for unused slots
+    ResampleQuality sample_quality;            // Interpolation the samplers play with
+    SampleBank *sample_bank;                   // Streams for the samplers, NULL for none
+} VoicePool;
+
+void voice_pool_init(VoicePool *pool, float32 sample_rate) {
+    memset(pool, 0, sizeof(*pool));
+    pool->sample_rate = sample_rate;
+    envelope_set(&pool->envelope, 0.005f, 0.1f, 0.7f, 0.2f, sample_rate);
+    for (int32 slot = 0; slot < PATCH_MAX_FILTERS; slot++) filter_settings_init(&pool->filters[slot]);
+    memset(pool->sample_stream, 0xff, sizeof(pool->sample_stream));
+    pool->sample_quality = RESAMPLE_MEDIUM;
+}
+
+// Give back a voice's sample streams
+void voice_stop_samples(VoicePool *pool, int32 voice) {
+    for (int32 slot = 0; slot < PATCH_MAX_SAMPLERS; slot++) {
+        if (pool->sample_bank) sample_stream_release(pool->sample_bank, pool->sample_stream[slot][voice]);
+        pool->sample_stream[slot][voice] = -1;
+    }
+}
+
+// Play every sampler from the start, claiming streams for samples that are
+// longer than their attack
+void voice_start_samples(VoicePool *pool, int32 voice) {
+    for (int32 slot = 0; slot < PATCH_MAX_SAMPLERS; slot++) {
+        pool->sample_position[slot][voice] = 0;
+        pool->sample_stream[slot][voice] = -1;
+        if (pool->samples[slot] && pool->sample_bank) {
+            pool->sample_stream[slot][voice] = sample_stream_claim(pool->sample_bank, pool->samples[slot]);
+        }
+    }
+}
+
+void voice_remove(VoicePool *pool, int32 index) {
+    assert(index >= 0 && index < pool->active_count);
+
+    voice_stop_samples(pool, index);
+
+    // Swap the last active voice into the hole to keep the arrays packed
+    int32 last = --pool->active_count;
+    for (int32 slot = 0; slot < PATCH_MAX_OSCILLATORS; slot++) pool->phase[slot][index] = pool->phase[slot][last];
+    pool->increment[index] = pool->increment[last];
+    pool->amplitude[index] = pool->amplitude[last];
+    pool->wave_type[index] = pool->wave_type[last];
+    pool->note[index] = pool->note[last];
+    pool->age[index] = pool->age[last];
+    pool->envelope_stage[index] = pool->envelope_stage[last];
+    pool->envelope_level[index] = pool->envelope_level[last];
+    pool->envelope_target[index] = pool->envelope_target[last];
+    pool->envelope_samples_left[index] = pool->envelope_samples_left[last];
+    for (int32 slot = 0; slot < PATCH_MAX_FILTERS; slot++) {
+        pool->filter_state1[slot][index] = pool->filter_state1[slot][last];
+        pool->filter_state2[slot][index] = pool->filter_state2[slot][last];
+    }
+    for (int32 slot = 0; slot < PATCH_MAX_SAMPLERS; slot++) {
+        pool->sample_position[slot][index] = pool->sample_position[slot][last];
+        pool->sample_stream[slot][index] = pool->sample_stream[slot][last];
+    }
+}
+
+// Move a voice into stage, starting from its current envelope level
+void voice_enter_stage(VoicePool *pool, int32 voice, EnvelopeStage stage) {
+    Envelope *envelope = &pool->envelope;
+    float32 level = pool->envelope_level[voice];
+
+    // Skip stages with no length
+    if (stage == ENVELOPE_ATTACK && envelope->attack_samples == 0) {
+        level = 1.0f;
+        stage = ENVELOPE_DECAY;
+    }
+    if (stage == ENVELOPE_DECAY && envelope->decay_samples == 0) {
+        level = envelope->sustain_level;
+        stage = ENVELOPE_SUSTAIN;
+    }
+    if (stage == ENVELOPE_SUSTAIN && level <= 0.0f) stage = ENVELOPE_OFF;
+    if (stage == ENVELOPE_RELEASE && envelope->release_samples == 0) stage = ENVELOPE_OFF;
+
+    switch (stage) {
+        case ENVELOPE_ATTACK:
+            pool->envelope_samples_left[voice] = envelope->attack_samples;
+            break;
+        case ENVELOPE_DECAY:
+            pool->envelope_target[voice] = envelope->sustain_level -
+                                           ENVELOPE_OVERSHOOT * (1.0f - envelope->sustain_level);
+            pool->envelope_samples_left[voice] = envelope->decay_samples;
+            break;
+        case ENVELOPE_RELEASE:
+            pool->envelope_target[voice] = -ENVELOPE_OVERSHOOT * level;
+            pool->envelope_samples_left[voice] = envelope->release_samples;
+            break;
+        case ENVELOPE_SUSTAIN:
+            break;
+        case ENVELOPE_OFF:
+            level = 0.0f;
+            break;
+    }
+    pool->envelope_stage[voice] = stage;
+    pool->envelope_level[voice] = level;
+}
+
+// The envelope's length for stage changed to samples: voices part way
+// through that stage finish it within the new length. A stage cut to zero
+// still takes one sample, so the ramp ends where it should.
+void voice_pool_clamp_stage(VoicePool *pool, EnvelopeStage stage, int32 samples) {
+    if (samples < 1) samples = 1;
+    for (int32 voice = 0; voice < pool->active_count; voice++) {
+        if (pool->envelope_stage[voice] == stage && pool->envelope_samples_left[voice] > samples) {
+            pool->envelope_samples_left[voice] = samples;
+        }
+    }
+}
+
+// Start a voice, stealing the oldest one when the pool is full. Returns the
+// index the voice was written to.
+int32 voice_note_on(VoicePool *pool, int32 note, float32 frequency, float32 amplitude,
+                    WaveType wave_type, float32 sample_rate) {
+    int32 index = pool->active_count;
+    if (index == MAX_VOICES) {
+        index = 0;
+        for (int32 voice = 1; voice < pool->active_count; voice++) {
+            if (pool->age[voice] < pool->age[index]) index = voice;
+        }
+        voice_stop_samples(pool, index);
+    } else {
+        pool->active_count++;
+    }
+
+    for (int32 slot = 0; slot < PATCH_MAX_OSCILLATORS; slot++) pool->phase[slot][index] = 0;
+    pool->increment[index] = phase_increment(frequency, sample_rate);
+    pool->amplitude[index] = amplitude;
+    pool->wave_type[index] = wave_type;
+    pool->note[index] = note;
+    pool->age[index] = pool->next_age++;
+    pool->envelope_level[index] = 0.0f;
+    for (int32 slot = 0; slot < PATCH_MAX_FILTERS; slot++) {
+        pool->filter_state1[slot][index] = 0.0f;
+        pool->filter_state2[slot][index] = 0.0f;
+    }
+    voice_start_samples(pool, index);
+    voice_enter_stage(pool, index, ENVELOPE_ATTACK);
+    return index;
+}
+
+// Release every voice playing note. The voices stay in the pool until their
+// release reaches silence.
+void voice_note_off(VoicePool *pool, int32 note) {
+    for (int32 voice = 0; voice < pool->active_count; voice++) {
+        if (pool->note[voice] == note && pool->envelope_stage[voice] < ENVELOPE_RELEASE) {
+            voice_enter_stage(pool, voice, ENVELOPE_RELEASE);
+        }
+    }
+}
+
+// Add source, the voice's signal, into mix_bus one envelope
+// segment at a time, moving the voice through its stages as they end
+void voice_apply_envelope(VoicePool *pool, int32 voice, float32 *mix_bus, float32 *source,
+                          int32 total_samples) {
+    int32 offset = 0;
+    while (offset < total_samples && pool->envelope_stage[voice] != ENVELOPE_OFF) {
+        EnvelopeStage stage = pool->envelope_stage[voice];
+        float32 level = pool->envelope_level[voice];
+        int32 samples = total_samples - offset;
+
+        if (stage == ENVELOPE_SUSTAIN) {
+            // Most voices sit here, a plain loop vectorizes better than a ramp with no slope
+            for (int32 sample_index = offset; sample_index < total_samples; sample_index++) {
+                mix_bus[sample_index] += source[sample_index] * level;
+            }
+            break;
+        }
+
+        if (samples > pool->envelope_samples_left[voice]) samples = pool->envelope_samples_left[voice];
+        if (stage == ENVELOPE_ATTACK) {
+            // From where this voice is to 1 over what is left of its own attack,
+            // whatever the attack time has been changed to since
+            float32 step = (1.0f - level) / pool->envelope_samples_left[voice];
+            level = envelope_linear(mix_bus + offset, source + offset, samples, level, step);
+        } else {
+            float32 coefficient = (stage == ENVELOPE_DECAY) ? pool->envelope.decay_coefficient
+                                                            : pool->envelope.release_coefficient;
+            level = envelope_exponential(mix_bus + offset, source + offset, samples, level,
+                                         pool->envelope_target[voice], coefficient);
+        }
+        pool->envelope_level[voice] = level;
+        offset += samples;
+
+        pool->envelope_samples_left[voice] -= samples;
+        if (pool->envelope_samples_left[voice] == 0) {
+            // Land exactly on the end level before moving on
+            switch (stage) {
+                case ENVELOPE_ATTACK:
+                    pool->envelope_level[voice] = 1.0f;
+                    voice_enter_stage(pool, voice, ENVELOPE_DECAY);
+                    break;
+                case ENVELOPE_DECAY:
+                    pool->envelope_level[voice] = pool->envelope.sustain_level;
+                    voice_enter_stage(pool, voice, ENVELOPE_SUSTAIN);
+                    break;
+                default:
+                    voice_enter_stage(pool, voice, ENVELOPE_OFF);
+                    break;
+            }
+        }
+    }
+}
+
+// Soft clip: drive * x / (1 + |drive * x|), unity slope at zero
+void drive_process(float32 *output, float32 *input, int32 total_samples, float32 drive) {
+    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+        float32 x = drive * input[sample_index];
+        output[sample_index] = x / (1.0f + fabsf(x));
+    }
+}
+
+// Wave type an oscillator instruction plays for voice
+WaveType oscillator_wave_type(PatchInstruction *instruction, VoicePool *pool, int32 voice) {
+    return (instruction->wave_type == PATCH_VOICE_WAVE) ? pool->wave_type[voice] : (WaveType) instruction->wave_type;
+}
+
+// Run program over voices first..first+count-1 (count at most FILTER_LANES)
+// for total_samples frames, adding the result into bus. Each program buffer
+// is FILTER_LANES lane buffers of total_samples, one per voice of the group;
+// buffers holds program->buffer_count of them plus one more group for
+// interleaving. Lanes past count carry silence so the filters see zeros.
+void patch_render_group(PatchProgram *program, VoicePool *pool, int32 first, int32 count, float32 *bus,
+                        float32 *buffers, int32 total_samples) {
+    int32 group_size = FILTER_LANES * total_samples;
+    float32 *interleaved = buffers + program->buffer_count * group_size;
+#define lane_buffer(buffer, lane) (buffers + (buffer) * group_size + (lane) * total_samples)
+
+    for (int32 index = 0; index < program->instruction_count; index++) {
+        PatchInstruction *instruction = &program->instructions[index];
+        int32 output = instruction->output;
+        int32 input = instruction->inputs[0];
+
+        switch (instruction->type) {
+            case NODE_OSCILLATOR: {
+                memset(lane_buffer(output, 0), 0, group_size * sizeof(float32));
+                uint32 *phase = pool->phase[instruction->slot];
+                for (int32 lane = 0; lane < count; lane++) {
+                    int32 voice = first + lane;
+                    uint32 increment = (uint32) (pool->increment[voice] * (float64) instruction->ratio);
+                    phase[voice] = generators[oscillator_wave_type(instruction, pool, voice)](phase[voice], increment,
+                                                         pool->amplitude[voice] * instruction->level,
+                                                         lane_buffer(output, lane), total_samples);
+                }
+            } break;
+
+            case NODE_SAMPLER: {
+                memset(lane_buffer(output, 0), 0, group_size * sizeof(float32));
+                int32 slot = instruction->slot;
+                Sample *sample = instruction->sample;
+                for (int32 lane = 0; lane < count; lane++) {
+                    int32 voice = first + lane;
+                    int32 stream_index = pool->sample_stream[slot][voice];
+                    SampleStream *stream = (stream_index >= 0) ? &pool->sample_bank->streams[stream_index] : NULL;
+                    uint32 increment = (uint32) (pool->increment[voice] * (float64) instruction->ratio);
+                    uint64 step = sample_step(sample, increment, pool->sample_rate);
+                    const ResampleTable *table = resample_table_for_step(pool->sample_quality, step);
+                    pool->sample_position[slot][voice] =
+                        sample_render(pool->sample_bank, table, sample, stream,
+                                      pool->sample_position[slot][voice], step,
+                                      pool->amplitude[voice] * instruction->level, lane_buffer(output, lane),
+                                      total_samples);
+                }
+            } break;
+
+            case NODE_MIXER: {
+                float32 *target = lane_buffer(output, 0);
+                float32 *source = lane_buffer(input, 0);
+                float32 gain = instruction->gains[0];
+                for (int32 sample_index = 0; sample_index < group_size; sample_index++) {
+                    target[sample_index] = gain * source[sample_index];
+                }
+                for (int32 other = 1; other < instruction->input_count; other++) {
+                    source = lane_buffer(instruction->inputs[other], 0);
+                    gain = instruction->gains[other];
+                    for (int32 sample_index = 0; sample_index < group_size; sample_index++) {
+                        target[sample_index] += gain * source[sample_index];
+                    }
+                }
+            } break;
+
+            case NODE_FILTER: {
+                FilterSettings *filter = &pool->filters[instruction->slot];
+                if (filter->type == FILTER_NONE) {
+                    if (output != input) {
+                        memcpy(lane_buffer(output, 0), lane_buffer(input, 0), group_size * sizeof(float32));
+                    }
+                    break;
+                }
+
+                FilterCoefficients coefficients;
+                float32 *lanes[FILTER_LANES];
+                for (int32 lane = 0; lane < FILTER_LANES; lane++) {
+                    lanes[lane] = lane_buffer(input, lane);
+                    float32 frequency = (lane < count) ? pool->increment[first + lane] * PHASE_TO_FLOAT *
+                                                         pool->sample_rate : 0.0f;
+                    float32 cutoff = filter_voice_cutoff(filter, frequency, pool->sample_rate);
+                    filter_coefficients(&coefficients, lane, filter->type, cutoff, filter->smoothed_resonance,
+                                        pool->sample_rate);
+                }
+
+                filter_interleave(interleaved, lanes, total_samples);
+                float32 *state1 = pool->filter_state1[instruction->slot] + first;
+                float32 *state2 = pool->filter_state2[instruction->slot] + first;
+                if (filter_is_svf(filter->type)) {
+                    svf_process(interleaved, total_samples, state1, state2, &coefficients.svf);
+                } else {
+                    biquad_process(interleaved, total_samples, state1, state2, &coefficients.biquad);
+                }
+                for (int32 lane = 0; lane < FILTER_LANES; lane++) lanes[lane] = lane_buffer(output, lane);
+                filter_deinterleave(lanes, interleaved, total_samples);
+            } break;
+
+            case NODE_DRIVE:
+                drive_process(lane_buffer(output, 0), lane_buffer(input, 0), group_size, instruction->level);
+                break;
+
+            case NODE_ENVELOPE:
+                if (output != PATCH_BUS) memset(lane_buffer(output, 0), 0, group_size * sizeof(float32));
+                for (int32 lane = 0; lane < count; lane++) {
+                    float32 *target = (output == PATCH_BUS) ? bus : lane_buffer(output, lane);
+                    voice_apply_envelope(pool, first + lane, target, lane_buffer(input, lane), total_samples);
+                }
+                break;
+
+            case NODE_OUTPUT:
+                for (int32 lane = 0; lane < count; lane++) {
+                    float32 *source = lane_buffer(input, lane);
+                    for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+                        bus[sample_index] += source[sample_index];
+                    }
+                }
+                break;
+        }
+    }
+#undef lane_buffer
+}
+
+// True while program is plain and all its filters are off, see patch.h
+bool32 patch_plays_plain(PatchProgram *program, VoicePool *pool) {
+    if (!program->plain) return 0;
+    for (int32 slot = 0; slot < program->filter_count; slot++) {
+        if (pool->filters[slot].type != FILTER_NONE) return 0;
+    }
+    return 1;
+}
+
+// One voice of a plain program, added into bus. A sustaining voice, which
+// most are, generates straight into the bus at its envelope level; any
+// other goes through buffer and the envelope a chunk at a time.
+void generate_plain_voice(PatchProgram *program, VoicePool *pool, int32 voice, float32 *bus, float32 *buffer,
+                          int32 total_samples) {
+    PatchInstruction *oscillator = &program->instructions[0];
+    GenerateFunction *generate = generators[oscillator_wave_type(oscillator, pool, voice)];
+    uint32 *phase = &pool->phase[oscillator->slot][voice];
+    uint32 increment = (uint32) (pool->increment[voice] * (float64) oscillator->ratio);
+    float32 amplitude = pool->amplitude[voice] * oscillator->level;
+
+    if (pool->envelope_stage[voice] == ENVELOPE_SUSTAIN) {
+        *phase = generate(*phase, increment, amplitude * pool->envelope_level[voice], bus, total_samples);
+        return;
+    }
+    for (int32 offset = 0; offset < total_samples; offset += VOICE_CHUNK_FRAMES) {
+        int32 frames = total_samples - offset;
+        if (frames > VOICE_CHUNK_FRAMES) frames = VOICE_CHUNK_FRAMES;
+        memset(buffer, 0, frames * sizeof(float32));
+        *phase = generate(*phase, increment, amplitude, buffer, frames);
+        voice_apply_envelope(pool, voice, bus + offset, buffer, frames);
+    }
+}
+
+// Scratch floats one rendering thread needs for program
+int32 patch_scratch_floats(PatchProgram *program) {
+    return (program->buffer_count + 1) * FILTER_LANES * VOICE_CHUNK_FRAMES;
+}
+
+// One block of voice rendering split into jobs of VOICE_JOB_VOICES voices.
+// Every job renders into a bus of its own, job 0 straight into mix_bus, and
+// the buses are summed in job order afterwards. The result is the same bit
+// for bit however many threads ran the jobs and whichever thread ran which.
+typedef struct {
+    VoicePool *pool;
+    PatchProgram *program;
+    float32 *mix_bus;
+    float32 *job_buses;     // total_samples for each job after the first
+    float32 *voice_buffers; // patch_scratch_floats for each participant
+    int32 total_samples;
+} VoiceJobs;
+
+void generate_voice_job(void *data, int32 job, int32 participant) {
+    VoiceJobs *jobs = (VoiceJobs *) data;
+    VoicePool *pool = jobs->pool;
+    int32 total_samples = jobs->total_samples;
+    float32 *bus = (job == 0) ? jobs->mix_bus : jobs->job_buses + (job - 1) * total_samples;
+    float32 *buffers = jobs->voice_buffers + participant * patch_scratch_floats(jobs->program);
+    int32 first = job * VOICE_JOB_VOICES;
+    int32 count = pool->active_count - first;
+    if (count > VOICE_JOB_VOICES) count = VOICE_JOB_VOICES;
+
+    memset(bus, 0, total_samples * sizeof(float32));
+    if (patch_plays_plain(jobs->program, pool)) {
+        for (int32 voice = first; voice < first + count; voice++) {
+            generate_plain_voice(jobs->program, pool, voice, bus, buffers, total_samples);
+        }
+        return;
+    }
+    for (int32 offset = 0; offset < total_samples; offset += VOICE_CHUNK_FRAMES) {
+        int32 frames = total_samples - offset;
+        if (frames > VOICE_CHUNK_FRAMES) frames = VOICE_CHUNK_FRAMES;
+        patch_render_group(jobs->program, pool, first, count, bus + offset, buffers, frames);
+    }
+}
+
+// Sum every active voice, played through program, into mix_bus, overwriting
+// what was there, and free voices whose release has finished. Jobs are
+// spread over workers, which may be NULL to render everything on the calling
+// thread. Temporary buffers come from scratch and are given back before
+// returning.
+void generate_voices(VoicePool *pool, PatchProgram *program, float32 *mix_bus, MemoryArena *scratch,
+                     int32 total_samples, WorkerPool *workers) {
+    int32 job_count = (pool->active_count + VOICE_JOB_VOICES - 1) / VOICE_JOB_VOICES;
+    if (job_count == 0) {
+        memset(mix_bus, 0, total_samples * sizeof(float32));
+        return;
+    }
+    for (int32 slot = 0; slot < program->filter_count; slot++) {
+        filter_smooth(&pool->filters[slot], total_samples / pool->sample_rate);
+    }
+
+    TemporaryMemory temporary = begin_temporary_memory(scratch);
+    VoiceJobs jobs;
+    jobs.pool = pool;
+    jobs.program = program;
+    jobs.mix_bus = mix_bus;
+    jobs.job_buses = arena_push_array(scratch, float32, (job_count - 1) * total_samples);
+    jobs.voice_buffers = arena_push_array(scratch, float32, worker_pool_participants(workers) *
+                                                            patch_scratch_floats(program));
+    jobs.total_samples = total_samples;
+
+    worker_pool_run(workers, generate_voice_job, &jobs, job_count);
+
+    // Fixed order mixdown
+    for (int32 job = 1; job < job_count; job++) {
+        float32 *bus = jobs.job_buses + (job - 1) * total_samples;
+        for (int32 sample_index = 0; sample_index < total_samples; sample_index++) {
+            mix_bus[sample_index] += bus[sample_index];
+        }
+    }
+    end_temporary_memory(temporary);
+
+    // Walk down so the voice swapped into a hole has already been checked
+    for (int32 voice = pool->active_count - 1; voice >= 0; voice--) {
+        if (pool->envelope_stage[voice] == ENVELOPE_OFF) voice_remove(pool, voice);
+    }
+}
+
+#endif
@@ -0,0 +1,77 @@
+#if !defined(WAV_H)
+#define WAV_H
+
+#include <stdio.h>
+#include "platform.h"
+
+// Streaming RIFF/WAVE writer for 16 bit PCM or 32 bit float samples. The
+// header is written up front with empty sizes and patched by wav_close, so
+// any length can be written without holding it in memory.
+
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_FLOAT 3
+
+typedef struct {
+    FILE *file;
+    int32 format;
+    int32 channels;
+    int32 bytes_per_value;
+    uint32 frames_written;
+} WavWriter;
+
+void wav_write_u16(FILE *file, uint16 value) {
+    uint8 bytes[2] = {(uint8) value, (uint8) (value >> 8)};
+    fwrite(bytes, 1, sizeof(bytes), file);
+}
+
+void wav_write_u32(FILE *file, uint32 value) {
+    uint8 bytes[4] = {(uint8) value, (uint8) (value >> 8), (uint8) (value >> 16), (uint8) (value >> 24)};
+    fwrite(bytes, 1, sizeof(bytes), file);
+}
+
+void wav_write_header(WavWriter *wav, int32 sample_rate) {
+    uint32 data_bytes = wav->frames_written * wav->channels * wav->bytes_per_value;
+    uint32 block_align = wav->channels * wav->bytes_per_value;
+
+    fwrite("RIFF", 1, 4, wav->file);
+    wav_write_u32(wav->file, 36 + data_bytes);
+    fwrite("WAVEfmt ", 1, 8, wav->file);
+    wav_write_u32(wav->file, 16);
+    wav_write_u16(wav->file, wav->format);
+    wav_write_u16(wav->file, wav->channels);
+    wav_write_u32(wav->file, sample_rate);
+    wav_write_u32(wav->file, sample_rate * block_align);
+    wav_write_u16(wav->file, block_align);
+    wav_write_u16(wav->file, 8 * wav->bytes_per_value);
+    fwrite("data", 1, 4, wav->file);
+    wav_write_u32(wav->file, data_bytes);
+}
+
+// Returns false if the file can't be created
+bool32 wav_open(WavWriter *wav, const char *path, int32 format, int32 channels, int32 sample_rate) {
+    wav->file = fopen(path, "wb");
+    if (!wav->file) return 0;
+
+    wav->format = format;
+    wav->channels = channels;
+    wav->bytes_per_value = (format == WAV_FORMAT_FLOAT) ? sizeof(float32) : sizeof(int16);
+    wav->frames_written = 0;
+    wav_write_header(wav, sample_rate);
+    return 1;
+}
+
+// samples holds total_samples interleaved frames in the writer's format.
+// Assumes a little endian host, like the rest of the engine.
+void wav_write(WavWriter *wav, void *samples, int32 total_samples) {
+    fwrite(samples, wav->channels * wav->bytes_per_value, total_samples, wav->file);
+    wav->frames_written += total_samples;
+}
+
+void wav_close(WavWriter *wav, int32 sample_rate) {
+    fseek(wav->file, 0, SEEK_SET);
+    wav_write_header(wav, sample_rate);
+    fclose(wav->file);
+    wav->file = NULL;
+}
+
+#endif
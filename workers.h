@@ -0,0 +1,302 @@
+#if !defined(WORKERS_H)
+#define WORKERS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include "platform.h"
+#include "arena.h"
+#include "command_queue.h"
+
+// Pool of worker threads that help the audio thread through a batch of jobs.
+// The threads are spawned and pinned to their own cores once, at startup;
+// after that running a batch is all atomics: no locks, no allocation and no
+// syscalls while the batch is in flight.
+//
+// Each participant (the calling thread is participant 0) owns a contiguous
+// range of the batch's job indices. It takes jobs from the front of its own
+// range, and when that runs dry it steals from the other ranges the same
+// way. A range is one 64 bit word, next job and end packed together, so a
+// claim is a single compare and swap and can never straddle two batches.
+//
+// Between batches workers spin with a pause instruction for up to
+// WORKER_SPIN_SECONDS, which covers the gap between device callbacks, and only
+// then go to sleep on a semaphore. With everyone awake, starting a batch
+// checks one sleeper count and makes no syscall. After the audio has been
+// idle the audio thread posts to a single sleeping worker, and each worker
+// that wakes posts to the next, so the audio thread makes at most one
+// syscall per batch.
+// Keep the thread count below the core count: the audio thread spins while
+// it waits for the last job, so a preempted worker stalls the whole block.
+
+#define MAX_WORKERS 8 // Threads, not counting the caller
+#define WORKER_SPIN_SECONDS 0.05
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define cpu_relax() _mm_pause()
+#else
+#define cpu_relax()
+#endif
+
+// Counting semaphore for parking a thread. macOS has no unnamed POSIX
+// semaphores (sem_init fails with ENOSYS), so it gets a dispatch semaphore,
+// whose signal is also cheap enough for the audio thread.
+#if defined(__APPLE__)
+#include <dispatch/dispatch.h>
+
+typedef dispatch_semaphore_t Semaphore;
+
+bool32 semaphore_init(Semaphore *semaphore) {
+    *semaphore = dispatch_semaphore_create(0);
+    return *semaphore != NULL;
+}
+
+void semaphore_destroy(Semaphore *semaphore) {
+    dispatch_release(*semaphore);
+}
+
+void semaphore_post(Semaphore *semaphore) {
+    dispatch_semaphore_signal(*semaphore);
+}
+
+void semaphore_wait(Semaphore *semaphore) {
+    dispatch_semaphore_wait(*semaphore, DISPATCH_TIME_FOREVER);
+}
+#else
+#include <errno.h>
+#include <semaphore.h>
+
+typedef sem_t Semaphore;
+
+bool32 semaphore_init(Semaphore *semaphore) {
+    return sem_init(semaphore, 0, 0) == 0;
+}
+
+void semaphore_destroy(Semaphore *semaphore) {
+    sem_destroy(semaphore);
+}
+
+void semaphore_post(Semaphore *semaphore) {
+    sem_post(semaphore);
+}
+
+void semaphore_wait(Semaphore *semaphore) {
+    while (sem_wait(semaphore) != 0 && errno == EINTR) {}
+}
+#endif
+
+typedef void JobFunction(void *data, int32 job, int32 participant);
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64 range; // next job in the low half, end in the high half
+} JobRange;
+
+typedef struct WorkerPool WorkerPool;
+
+typedef struct {
+    WorkerPool *pool;
+    int32 participant;
+    pthread_t thread;
+    Semaphore wake;
+    _Alignas(CACHE_LINE_SIZE) _Atomic bool32 sleeping;
+} Worker;
+
+struct WorkerPool {
+    int32 thread_count;
+    Worker workers[MAX_WORKERS];
+    JobRange ranges[MAX_WORKERS + 1];
+
+    // The current batch, written before generation is bumped
+    JobFunction *function;
+    void *data;
+
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32 generation;
+    _Alignas(CACHE_LINE_SIZE) _Atomic int32 pending; // Jobs of the current batch not yet finished
+    _Atomic int32 sleepers; // Workers with their sleeping flag set
+    _Atomic bool32 quit;
+};
+
+uint64 job_range(uint32 next, uint32 end) {
+    return ((uint64) end << 32) | next;
+}
+
+// Claim the next job from range, -1 if it is empty
+int32 job_claim(JobRange *range) {
+    uint64 value = atomic_load_explicit(&range->range, memory_order_acquire);
+    for (;;) {
+        uint32 next = (uint32) value;
+        uint32 end = (uint32) (value >> 32);
+        if (next >= end) return -1;
+        if (atomic_compare_exchange_weak_explicit(&range->range, &value, job_range(next + 1, end),
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            return (int32) next;
+        }
+    }
+}
+
+// Run jobs until every range is empty, starting with our own
+void worker_pool_work(WorkerPool *pool, int32 participant) {
+    int32 participants = pool->thread_count + 1;
+    for (int32 offset = 0; offset < participants; offset++) {
+        JobRange *range = &pool->ranges[(participant + offset) % participants];
+        int32 job;
+        while ((job = job_claim(range)) >= 0) {
+            pool->function(pool->data, job, participant);
+            atomic_fetch_sub_explicit(&pool->pending, 1, memory_order_release);
+        }
+    }
+}
+
+// Post to one sleeping worker, if there is one. Whoever clears a sleeping
+// flag takes the worker off the sleeper count.
+void worker_pool_wake_one(WorkerPool *pool) {
+    for (int32 index = 0; index < pool->thread_count; index++) {
+        Worker *worker = &pool->workers[index];
+        if (atomic_load(&worker->sleeping) && atomic_exchange(&worker->sleeping, 0)) {
+            atomic_fetch_sub(&pool->sleepers, 1);
+            semaphore_post(&worker->wake);
+            return;
+        }
+    }
+}
+
+float64 worker_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now); // vDSO, no syscall
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void *worker_main(void *argument) {
+    Worker *worker = (Worker *) argument;
+    WorkerPool *pool = worker->pool;
+    uint32 seen = atomic_load_explicit(&pool->generation, memory_order_acquire);
+
+    // Workers run audio code, the same no-heap rule applies
+    audio_thread_begin();
+
+    while (!atomic_load_explicit(&pool->quit, memory_order_acquire)) {
+        float64 idle_since = worker_seconds();
+        int32 spins = 0;
+        uint32 generation;
+        while ((generation = atomic_load_explicit(&pool->generation, memory_order_acquire)) == seen) {
+            cpu_relax();
+            if (++spins % 1024 == 0 && worker_seconds() - idle_since > WORKER_SPIN_SECONDS) {
+                // Sleep. The dispatcher bumps generation before it checks the
+                // sleepers, we count ourselves before checking generation
+                // again, so one of us sees the other.
+                atomic_fetch_add(&pool->sleepers, 1);
+                atomic_store(&worker->sleeping, 1);
+                if (atomic_load(&pool->generation) == seen && !atomic_load(&pool->quit)) {
+                    semaphore_wait(&worker->wake);
+                } else if (atomic_exchange(&worker->sleeping, 0)) {
+                    atomic_fetch_sub(&pool->sleepers, 1);
+                } else {
+                    semaphore_wait(&worker->wake); // Consume the post that raced with us
+                }
+                if (atomic_load_explicit(&pool->quit, memory_order_acquire)) break;
+                idle_since = worker_seconds();
+            }
+        }
+        if (atomic_load_explicit(&pool->quit, memory_order_acquire)) break;
+        seen = generation;
+        if (atomic_load(&pool->sleepers) > 0) worker_pool_wake_one(pool); // Pass the wake up along
+        worker_pool_work(pool, worker->participant);
+    }
+
+    audio_thread_end();
+    return NULL;
+}
+
+// Spawn thread_count workers, each pinned to its own core where the platform
+// allows. Returns false if the threads could not be created; the pool then
+// runs everything on the caller.
+bool32 worker_pool_start(WorkerPool *pool, int32 thread_count) {
+    if (thread_count > MAX_WORKERS) thread_count = MAX_WORKERS;
+    pool->thread_count = 0;
+    pool->function = NULL;
+    pool->data = NULL;
+    atomic_init(&pool->generation, 0);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->sleepers, 0);
+    atomic_init(&pool->quit, 0);
+    for (int32 participant = 0; participant <= MAX_WORKERS; participant++) {
+        atomic_init(&pool->ranges[participant].range, 0);
+    }
+
+    for (int32 index = 0; index < thread_count; index++) {
+        Worker *worker = &pool->workers[index];
+        worker->pool = pool;
+        worker->participant = index + 1;
+        atomic_init(&worker->sleeping, 0);
+        if (!semaphore_init(&worker->wake)) break;
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            semaphore_destroy(&worker->wake);
+            break;
+        }
+
+#if defined(__linux__) && defined(CPU_SET)
+        // Workers take cores 1 and up. The calling thread belongs to the
+        // platform layer and is left unpinned; core 0 is simply the one no
+        // worker competes for.
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cores > 1) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET((index + 1) % cores, &cpus);
+            pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus);
+        }
+#endif
+        pool->thread_count++;
+    }
+    return pool->thread_count == thread_count;
+}
+
+void worker_pool_stop(WorkerPool *pool) {
+    atomic_store(&pool->quit, 1);
+    for (int32 index = 0; index < pool->thread_count; index++) {
+        semaphore_post(&pool->workers[index].wake);
+    }
+    for (int32 index = 0; index < pool->thread_count; index++) {
+        pthread_join(pool->workers[index].thread, NULL);
+        semaphore_destroy(&pool->workers[index].wake);
+    }
+    pool->thread_count = 0;
+}
+
+// Threads that may run jobs of one batch, the caller included
+int32 worker_pool_participants(WorkerPool *pool) {
+    return pool ? pool->thread_count + 1 : 1;
+}
+
+// Audio thread: run function(data, job, participant) for every job below
+// job_count and return once all of them have finished. participant is below
+// worker_pool_participants and tells a job which per thread scratch to use.
+// With no pool, or no threads, the jobs run in order on the caller.
+void worker_pool_run(WorkerPool *pool, JobFunction *function, void *data, int32 job_count) {
+    if (!pool || pool->thread_count == 0 || job_count <= 1) {
+        for (int32 job = 0; job < job_count; job++) function(data, job, 0);
+        return;
+    }
+
+    pool->function = function;
+    pool->data = data;
+    atomic_store_explicit(&pool->pending, job_count, memory_order_relaxed);
+
+    // Split the jobs into one contiguous range per participant
+    int32 participants = pool->thread_count + 1;
+    for (int32 participant = 0; participant < participants; participant++) {
+        uint32 start = (uint32) ((int64) job_count * participant / participants);
+        uint32 end = (uint32) ((int64) job_count * (participant + 1) / participants);
+        atomic_store_explicit(&pool->ranges[participant].range, job_range(start, end), memory_order_release);
+    }
+
+    atomic_fetch_add(&pool->generation, 1);
+    if (atomic_load(&pool->sleepers) > 0) worker_pool_wake_one(pool);
+
+    worker_pool_work(pool, 0);
+    while (atomic_load_explicit(&pool->pending, memory_order_acquire) > 0) cpu_relax();
+}
+
+#endif